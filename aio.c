@@ -0,0 +1,505 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+// linux/fs.h, pulled in by io_uring.h, has its own 1 KiB BLOCK_SIZE
+#undef BLOCK_SIZE
+#include "aio.h"
+#include "block.h"
+#include "image.h"
+
+// Asynchronous block I/O next to bread()/bwrite().
+// Requests are queued with aio_submit() and handed to the kernel in batches,
+// and finished requests are collected with aio_reap().
+// The engine talks to io_uring through the raw system calls. If the kernel
+// refuses io_uring, a pool of worker threads doing pread()/pwrite() stands in.
+// Like block_read_raw()/block_write_raw(), this goes around the block cache,
+// so bsync() first if cached writes must be seen.
+
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+struct thread_pool {
+    pthread_t *workers;
+    int nworkers;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    struct aio_request **todo;      // ring of requests waiting for a worker
+    int todo_head;
+    int todo_count;
+    struct aio_request **done;      // ring of finished requests
+    int done_head;
+    int done_count;
+};
+
+struct aio_engine {
+    struct image *img;
+    int backend;
+    int queue_depth;
+    int batch_size;
+    int pending;            // queued but not yet handed to the kernel or workers
+    int inflight;           // handed over but not yet reaped
+    struct aio_request **batch; // pending requests, thread-pool backend only
+    struct aio_stats stats;
+    struct uring ring;
+    struct thread_pool pool;
+};
+
+void aio_default_opts(struct aio_opts *opts) {
+    opts->backend = AIO_BACKEND_AUTO;
+    opts->queue_depth = AIO_DEFAULT_QUEUE_DEPTH;
+    opts->batch_size = AIO_DEFAULT_BATCH_SIZE;
+    opts->threads = AIO_DEFAULT_THREADS;
+}
+
+// Finishes a request given how many bytes moved in all (or a negative
+// errno). A short transfer only ends here once nothing more would move:
+// reads that run off the end of the image are zero-filled, as in
+// block_read_raw(), and a write that stops making progress fails.
+static void complete_request(struct aio_request *req, long res) {
+    if(res < 0) {
+        req->result = res;
+    } else if(res == BLOCK_SIZE) {
+        req->result = 0;
+    } else if(req->op == AIO_READ) {
+        memset(req->block + res, 0, BLOCK_SIZE - res);
+        req->result = 0;
+    } else {
+        req->result = -EIO;
+    }
+}
+
+// ---- io_uring backend ----
+
+static int uring_setup(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(r->fd < 0) {
+        return -1;
+    }
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_ring == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if(r->cq_ring == MAP_FAILED) {
+            munmap(r->sq_ring, r->sq_ring_size);
+            close(r->fd);
+            return -1;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED) {
+        if(r->cq_ring != r->sq_ring) {
+            munmap(r->cq_ring, r->cq_ring_size);
+        }
+        munmap(r->sq_ring, r->sq_ring_size);
+        close(r->fd);
+        return -1;
+    }
+
+    unsigned char *sq = r->sq_ring;
+    unsigned char *cq = r->cq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(struct uring *r) {
+    munmap(r->sqes, r->sqes_size);
+    if(r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+}
+
+static int uring_enter(struct uring *r, unsigned to_submit, unsigned min_complete) {
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    for(;;) {
+        int ret = syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete, flags, NULL, 0);
+        if(ret >= 0 || errno != EINTR) {
+            return ret;
+        }
+    }
+}
+
+static void uring_queue(struct aio_engine *e, struct aio_request *req) {
+    struct uring *r = &e->ring;
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->op == AIO_WRITE ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = e->img->fd;
+    sqe->addr = (unsigned long)&req->iov;
+    sqe->len = 1;
+    // a request queued again after a short transfer carries on where it stopped
+    sqe->off = (unsigned long long)req->block_num * BLOCK_SIZE + ((unsigned char *)req->iov.iov_base - req->block);
+    sqe->user_data = (unsigned long)req;
+
+    r->sq_array[index] = index;
+    // the kernel must see the filled-in entry before the new tail
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_flush(struct aio_engine *e) {
+    while(e->pending > 0) {
+        int ret = uring_enter(&e->ring, e->pending, 0);
+        e->stats.submit_calls++;
+        if(ret < 0) {
+            if(errno == EAGAIN || errno == EBUSY) {
+                // the completion queue is full, so make room before retrying
+                return 0;
+            }
+            return -1;
+        }
+        e->pending -= ret;
+        e->inflight += ret;
+    }
+    return 0;
+}
+
+static int uring_reap(struct aio_engine *e, struct aio_request **done, int min, int max) {
+    struct uring *r = &e->ring;
+    if(uring_flush(e) == -1) {
+        return -1;
+    }
+    int got = 0;
+    for(;;) {
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        int reaped = 0;
+        int requeued = 0;
+        while(head != tail && got < max) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            struct aio_request *req = (struct aio_request *)(unsigned long)cqe->user_data;
+            head++;
+            if(cqe->res > 0 && (size_t)cqe->res < req->iov.iov_len) {
+                // a short transfer: queue the rest of the block again
+                req->iov.iov_base = (unsigned char *)req->iov.iov_base + cqe->res;
+                req->iov.iov_len -= cqe->res;
+                uring_queue(e, req);
+                requeued++;
+                continue;
+            }
+            long moved = BLOCK_SIZE - req->iov.iov_len;
+            complete_request(req, cqe->res < 0 ? cqe->res : moved + cqe->res);
+            done[got++] = req;
+            reaped++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        e->inflight -= reaped + requeued;
+        e->pending += requeued;
+        e->stats.completed += reaped;
+        if(got >= min || (e->inflight == 0 && e->pending == 0)) {
+            return got;
+        }
+
+        // push anything still queued and wait for the rest of the minimum
+        int wait = min - got;
+        if(wait > e->inflight + e->pending) {
+            wait = e->inflight + e->pending;
+        }
+        int ret = uring_enter(r, e->pending, wait);
+        e->stats.submit_calls++;
+        if(ret < 0 && errno != EAGAIN && errno != EBUSY) {
+            return got > 0 ? got : -1;
+        }
+        if(ret > 0) {
+            e->pending -= ret;
+            e->inflight += ret;
+        }
+    }
+}
+
+// ---- thread-pool backend ----
+
+static void *pool_worker(void *arg) {
+    struct aio_engine *e = arg;
+    struct thread_pool *pool = &e->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        while(pool->todo_count == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if(pool->todo_count == 0 && pool->stopping) {
+            break;
+        }
+        struct aio_request *req = pool->todo[pool->todo_head];
+        pool->todo_head = (pool->todo_head + 1) % e->queue_depth;
+        pool->todo_count--;
+        pthread_mutex_unlock(&pool->lock);
+
+        // pick up where a short transfer left off, as block_run_raw() does
+        off_t offset = (off_t)req->block_num * BLOCK_SIZE;
+        long moved = 0;
+        ssize_t res = 0;
+        while(moved < BLOCK_SIZE) {
+            if(req->op == AIO_WRITE) {
+                res = pwrite(e->img->fd, req->block + moved, BLOCK_SIZE - moved, offset + moved);
+            } else {
+                res = pread(e->img->fd, req->block + moved, BLOCK_SIZE - moved, offset + moved);
+            }
+            if(res <= 0) {
+                break;
+            }
+            moved += res;
+        }
+        complete_request(req, res < 0 ? -errno : moved);
+
+        pthread_mutex_lock(&pool->lock);
+        int slot = (pool->done_head + pool->done_count) % e->queue_depth;
+        pool->done[slot] = req;
+        pool->done_count++;
+        pthread_cond_signal(&pool->work_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static int pool_setup(struct aio_engine *e, int nworkers) {
+    struct thread_pool *pool = &e->pool;
+    pool->todo = calloc(e->queue_depth, sizeof(struct aio_request *));
+    pool->done = calloc(e->queue_depth, sizeof(struct aio_request *));
+    e->batch = calloc(e->queue_depth, sizeof(struct aio_request *));
+    pool->workers = calloc(nworkers, sizeof(pthread_t));
+    if(pool->todo == NULL || pool->done == NULL || e->batch == NULL || pool->workers == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    for(int i = 0; i < nworkers; i++) {
+        if(pthread_create(&pool->workers[i], NULL, pool_worker, e) != 0) {
+            break;
+        }
+        pool->nworkers++;
+    }
+    return pool->nworkers > 0 ? 0 : -1;
+}
+
+static void pool_teardown(struct aio_engine *e) {
+    struct thread_pool *pool = &e->pool;
+    if(pool->workers != NULL && pool->nworkers > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stopping = 1;
+        pthread_cond_broadcast(&pool->work_ready);
+        pthread_mutex_unlock(&pool->lock);
+        for(int i = 0; i < pool->nworkers; i++) {
+            pthread_join(pool->workers[i], NULL);
+        }
+        pthread_cond_destroy(&pool->work_done);
+        pthread_cond_destroy(&pool->work_ready);
+        pthread_mutex_destroy(&pool->lock);
+    }
+    free(pool->workers);
+    free(pool->todo);
+    free(pool->done);
+    free(e->batch);
+}
+
+static int pool_flush(struct aio_engine *e) {
+    struct thread_pool *pool = &e->pool;
+    if(e->pending == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&pool->lock);
+    for(int i = 0; i < e->pending; i++) {
+        int slot = (pool->todo_head + pool->todo_count) % e->queue_depth;
+        pool->todo[slot] = e->batch[i];
+        pool->todo_count++;
+    }
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    e->inflight += e->pending;
+    e->pending = 0;
+    e->stats.submit_calls++;
+    return 0;
+}
+
+static int pool_reap(struct aio_engine *e, struct aio_request **done, int min, int max) {
+    struct thread_pool *pool = &e->pool;
+    pool_flush(e);
+    if(min > e->inflight) {
+        min = e->inflight;
+    }
+
+    int got = 0;
+    pthread_mutex_lock(&pool->lock);
+    while(pool->done_count < min) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    while(pool->done_count > 0 && got < max) {
+        done[got++] = pool->done[pool->done_head];
+        pool->done_head = (pool->done_head + 1) % e->queue_depth;
+        pool->done_count--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    e->inflight -= got;
+    e->stats.completed += got;
+    return got;
+}
+
+// ---- public interface ----
+
+// Creates an asynchronous I/O engine for the image.
+// opts may be NULL to get aio_default_opts().
+// Returns NULL if no backend could be started.
+struct aio_engine *aio_create(struct image *img, struct aio_opts *opts) {
+    struct aio_opts defaults;
+    if(opts == NULL) {
+        aio_default_opts(&defaults);
+        opts = &defaults;
+    }
+
+    struct aio_engine *e = calloc(1, sizeof(struct aio_engine));
+    if(e == NULL) {
+        return NULL;
+    }
+    e->img = img;
+    e->queue_depth = opts->queue_depth > 0 ? opts->queue_depth : AIO_DEFAULT_QUEUE_DEPTH;
+    e->batch_size = opts->batch_size > 0 ? opts->batch_size : 1;
+    if(e->batch_size > e->queue_depth) {
+        e->batch_size = e->queue_depth;
+    }
+
+    if(opts->backend != AIO_BACKEND_THREADS) {
+        // size the completion queue so it can hold every request in flight
+        if(uring_setup(&e->ring, e->queue_depth) == 0) {
+            e->backend = AIO_BACKEND_URING;
+            return e;
+        }
+        if(opts->backend == AIO_BACKEND_URING) {
+            perror("Error setting up io_uring\n");
+            free(e);
+            return NULL;
+        }
+    }
+
+    e->backend = AIO_BACKEND_THREADS;
+    if(pool_setup(e, opts->threads > 0 ? opts->threads : AIO_DEFAULT_THREADS) == -1) {
+        fprintf(stderr, "Error starting aio worker threads\n");
+        pool_teardown(e);
+        free(e);
+        return NULL;
+    }
+    return e;
+}
+
+// Waits for everything outstanding to finish and frees the engine.
+// Requests still in flight are completed but never returned by aio_reap().
+void aio_destroy(struct aio_engine *e) {
+    struct aio_request *done[AIO_DEFAULT_QUEUE_DEPTH];
+    while(e->pending + e->inflight > 0) {
+        if(aio_reap(e, done, 1, AIO_DEFAULT_QUEUE_DEPTH) <= 0) {
+            break;
+        }
+    }
+    if(e->backend == AIO_BACKEND_URING) {
+        uring_teardown(&e->ring);
+    } else {
+        pool_teardown(e);
+    }
+    free(e);
+}
+
+int aio_backend(struct aio_engine *e) {
+    return e->backend;
+}
+
+// Queues a request. Once batch_size requests are queued they are handed
+// over together; aio_flush() or aio_reap() hands over a partial batch.
+// Returns 0, or -1 if queue_depth requests are already outstanding.
+int aio_submit(struct aio_engine *e, struct aio_request *req) {
+    if(e->pending + e->inflight >= e->queue_depth) {
+        return -1;
+    }
+    req->iov.iov_base = req->block;
+    req->iov.iov_len = BLOCK_SIZE;
+    req->result = 0;
+
+    if(e->backend == AIO_BACKEND_URING) {
+        uring_queue(e, req);
+    } else {
+        e->batch[e->pending] = req;
+    }
+    e->pending++;
+    e->stats.submitted++;
+
+    if(e->pending >= e->batch_size) {
+        return aio_flush(e);
+    }
+    return 0;
+}
+
+// Hands every queued request over to the kernel or the workers
+int aio_flush(struct aio_engine *e) {
+    if(e->backend == AIO_BACKEND_URING) {
+        return uring_flush(e);
+    }
+    return pool_flush(e);
+}
+
+// Collects between min and max finished requests into done, waiting as
+// needed. min is capped at the number of requests outstanding.
+// Returns how many were collected, or -1 on error.
+int aio_reap(struct aio_engine *e, struct aio_request **done, int min, int max) {
+    if(e->backend == AIO_BACKEND_URING) {
+        return uring_reap(e, done, min, max);
+    }
+    return pool_reap(e, done, min, max);
+}
+
+void aio_get_stats(struct aio_engine *e, struct aio_stats *stats) {
+    *stats = e->stats;
+}
@@ -0,0 +1,53 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <sys/uio.h>
+
+#define AIO_READ 0
+#define AIO_WRITE 1
+
+#define AIO_BACKEND_AUTO 0      // io_uring if the kernel allows it, else threads
+#define AIO_BACKEND_URING 1
+#define AIO_BACKEND_THREADS 2
+
+#define AIO_DEFAULT_QUEUE_DEPTH 64
+#define AIO_DEFAULT_BATCH_SIZE 16
+#define AIO_DEFAULT_THREADS 4
+
+struct image;
+struct aio_engine;
+
+// One asynchronous block read or write.
+// The request and its block must stay valid until aio_reap() returns it.
+struct aio_request {
+    int op;                 // AIO_READ or AIO_WRITE
+    int block_num;
+    unsigned char *block;   // BLOCK_SIZE bytes to read into or write from
+    int result;             // set on completion: 0, or a negative errno
+    void *user_data;
+    struct iovec iov;       // engine use only
+};
+
+struct aio_opts {
+    int backend;            // one of AIO_BACKEND_*
+    int queue_depth;        // most requests queued or in flight at once
+    int batch_size;         // queued requests that trigger a submit on their own
+    int threads;            // worker threads for the thread-pool backend
+};
+
+struct aio_stats {
+    unsigned long submitted;
+    unsigned long completed;
+    unsigned long submit_calls; // io_uring_enter() calls or queue hand-offs
+};
+
+void aio_default_opts(struct aio_opts *opts);
+struct aio_engine *aio_create(struct image *img, struct aio_opts *opts);
+void aio_destroy(struct aio_engine *e);
+int aio_backend(struct aio_engine *e);
+int aio_submit(struct aio_engine *e, struct aio_request *req);
+int aio_flush(struct aio_engine *e);
+int aio_reap(struct aio_engine *e, struct aio_request **done, int min, int max);
+void aio_get_stats(struct aio_engine *e, struct aio_stats *stats);
+
+#endif
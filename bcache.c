@@ -0,0 +1,442 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bcache.h"
+#include "block.h"
+#include "image.h"
+
+// In-memory write-back cache of image blocks, one per open image.
+// Buffers live on one LRU list (most recently used at the head) and are
+// found by block number through a chained hash table.
+// Dirty buffers are only written to the image when they are evicted
+// or when bcache_sync() is called.
+//
+// The cache lock is never held across disk I/O. A buffer whose contents
+// are being read in or written back is marked busy, and anyone else who
+// wants it waits on io_done until the I/O finishes.
+// Buffers handed out by bcache_ref() are pinned and skipped by eviction
+// until the matching bcache_unref().
+
+static int hash_block(struct bcache *c, int block_num) {
+    return (unsigned int)block_num & (c->hash_size - 1);
+}
+
+static void lru_unlink(struct bcache *c, struct bcache_buf *buf) {
+    if(buf->lru_prev != NULL) {
+        buf->lru_prev->lru_next = buf->lru_next;
+    } else {
+        c->lru_head = buf->lru_next;
+    }
+    if(buf->lru_next != NULL) {
+        buf->lru_next->lru_prev = buf->lru_prev;
+    } else {
+        c->lru_tail = buf->lru_prev;
+    }
+    buf->lru_prev = NULL;
+    buf->lru_next = NULL;
+}
+
+static void lru_push_front(struct bcache *c, struct bcache_buf *buf) {
+    buf->lru_prev = NULL;
+    buf->lru_next = c->lru_head;
+    if(c->lru_head != NULL) {
+        c->lru_head->lru_prev = buf;
+    } else {
+        c->lru_tail = buf;
+    }
+    c->lru_head = buf;
+}
+
+static void hash_insert(struct bcache *c, struct bcache_buf *buf) {
+    int h = hash_block(c, buf->block_num);
+    buf->hash_next = c->hash_table[h];
+    c->hash_table[h] = buf;
+}
+
+static void hash_remove(struct bcache *c, struct bcache_buf *buf) {
+    struct bcache_buf **p = &c->hash_table[hash_block(c, buf->block_num)];
+    while(*p != NULL) {
+        if(*p == buf) {
+            *p = buf->hash_next;
+            break;
+        }
+        p = &(*p)->hash_next;
+    }
+    buf->hash_next = NULL;
+}
+
+static struct bcache_buf *lookup(struct bcache *c, int block_num) {
+    struct bcache_buf *buf = c->hash_table[hash_block(c, block_num)];
+    while(buf != NULL && buf->block_num != block_num) {
+        buf = buf->hash_next;
+    }
+    return buf;
+}
+
+// Finds the cached buffer for block_num, or binds the least recently used
+// idle buffer to it. A buffer that had to be rebound is returned busy with
+// *fresh set, and the caller must fill it and then call finish_io().
+// Called and returns with the cache lock held.
+static struct bcache_buf *get_buf(struct image *img, int block_num, int *fresh) {
+    struct bcache *c = &img->cache;
+    for(;;) {
+        struct bcache_buf *buf = lookup(c, block_num);
+        if(buf != NULL) {
+            if(buf->busy) {
+                pthread_cond_wait(&c->io_done, &c->lock);
+                continue;
+            }
+            lru_unlink(c, buf);
+            lru_push_front(c, buf);
+            *fresh = 0;
+            return buf;
+        }
+
+        struct bcache_buf *victim = c->lru_tail;
+        while(victim != NULL && (victim->busy || victim->pins > 0)) {
+            victim = victim->lru_prev;
+        }
+        if(victim == NULL) {
+            pthread_cond_wait(&c->io_done, &c->lock);
+            continue;
+        }
+
+        if(victim->block_num != -1 && victim->dirty) {
+            // write the old contents back before the buffer can be reused,
+            // then start over since the world may have changed meanwhile
+            victim->busy = 1;
+            pthread_mutex_unlock(&c->lock);
+            block_write_raw(img, victim->block_num, victim->data);
+            pthread_mutex_lock(&c->lock);
+            victim->busy = 0;
+            victim->dirty = 0;
+            c->stats.writebacks++;
+            c->write_seq++;
+            pthread_cond_broadcast(&c->io_done);
+            continue;
+        }
+
+        if(victim->block_num != -1) {
+            hash_remove(c, victim);
+            c->stats.evictions++;
+        }
+        lru_unlink(c, victim);
+        victim->block_num = block_num;
+        victim->dirty = 0;
+        victim->busy = 1;
+        hash_insert(c, victim);
+        lru_push_front(c, victim);
+        *fresh = 1;
+        return victim;
+    }
+}
+
+static void finish_io(struct bcache *c, struct bcache_buf *buf) {
+    buf->busy = 0;
+    pthread_cond_broadcast(&c->io_done);
+}
+
+// Sets the number of blocks the image's cache can hold; 0 disables caching.
+// Any dirty blocks already cached are written out first.
+// Must not race with other I/O on the same image.
+// Returns 0 on success, -1 if the buffers could not be allocated.
+int bcache_init(struct image *img, int nblocks) {
+    struct bcache *c = &img->cache;
+    bcache_destroy(img);
+    if(nblocks <= 0) {
+        return 0;
+    }
+
+    int hash_size = 1;
+    while(hash_size < nblocks) {
+        hash_size <<= 1;
+    }
+    c->bufs = calloc(nblocks, sizeof(struct bcache_buf));
+    c->hash_table = calloc(hash_size, sizeof(struct bcache_buf *));
+    if(c->bufs == NULL || c->hash_table == NULL) {
+        free(c->bufs);
+        free(c->hash_table);
+        c->bufs = NULL;
+        c->hash_table = NULL;
+        return -1;
+    }
+
+    c->nblocks = nblocks;
+    c->hash_size = hash_size;
+    for(int i = 0; i < nblocks; i++) {
+        c->bufs[i].block_num = -1;
+        lru_push_front(c, &c->bufs[i]);
+    }
+    return 0;
+}
+
+// Writes out anything dirty and releases the cache buffers
+void bcache_destroy(struct image *img) {
+    struct bcache *c = &img->cache;
+    bcache_sync(img);
+    free(c->bufs);
+    free(c->hash_table);
+    c->bufs = NULL;
+    c->hash_table = NULL;
+    c->lru_head = NULL;
+    c->lru_tail = NULL;
+    c->nblocks = 0;
+    c->hash_size = 0;
+}
+
+void bcache_read(struct image *img, int block_num, unsigned char *block) {
+    struct bcache *c = &img->cache;
+    if(c->nblocks == 0) {
+        block_read_raw(img, block_num, block);
+        return;
+    }
+
+    int fresh;
+    pthread_mutex_lock(&c->lock);
+    struct bcache_buf *buf = get_buf(img, block_num, &fresh);
+    if(fresh) {
+        c->stats.misses++;
+        pthread_mutex_unlock(&c->lock);
+        block_read_raw(img, block_num, buf->data);
+        pthread_mutex_lock(&c->lock);
+        finish_io(c, buf);
+    } else {
+        c->stats.hits++;
+    }
+    memcpy(block, buf->data, BLOCK_SIZE);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void bcache_write(struct image *img, int block_num, unsigned char *block) {
+    struct bcache *c = &img->cache;
+    if(c->nblocks == 0) {
+        block_write_raw(img, block_num, block);
+        return;
+    }
+
+    int fresh;
+    pthread_mutex_lock(&c->lock);
+    struct bcache_buf *buf = get_buf(img, block_num, &fresh);
+    // the whole block is overwritten, so a fresh buffer needs no read
+    memcpy(buf->data, block, BLOCK_SIZE);
+    buf->dirty = 1;
+    if(fresh) {
+        finish_io(c, buf);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Copies the block out of the cache if it is there.
+// Returns 0 on a hit, -1 on a miss (or if the image has no cache).
+int bcache_lookup_copy(struct image *img, int block_num, unsigned char *block) {
+    struct bcache *c = &img->cache;
+    if(c->nblocks == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    struct bcache_buf *buf = lookup(c, block_num);
+    while(buf != NULL && buf->busy) {
+        pthread_cond_wait(&c->io_done, &c->lock);
+        buf = lookup(c, block_num);
+    }
+    if(buf == NULL) {
+        c->stats.misses++;
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+    c->stats.hits++;
+    lru_unlink(c, buf);
+    lru_push_front(c, buf);
+    memcpy(block, buf->data, BLOCK_SIZE);
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+// Returns 1 if the block is in the cache, without touching its LRU position
+int bcache_contains(struct image *img, int block_num) {
+    struct bcache *c = &img->cache;
+    if(c->nblocks == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&c->lock);
+    int found = lookup(c, block_num) != NULL;
+    pthread_mutex_unlock(&c->lock);
+    return found;
+}
+
+// Returns the cache's write sequence number. Take it before reading blocks
+// from disk behind the cache's back and pass it to bcache_fill().
+unsigned long bcache_write_seq(struct image *img) {
+    pthread_mutex_lock(&img->cache.lock);
+    unsigned long seq = img->cache.write_seq;
+    pthread_mutex_unlock(&img->cache.lock);
+    return seq;
+}
+
+// Adds a clean copy of a block that was read from disk without the cache.
+// Nothing happens if the block is already cached, or if any cached block
+// was written to disk since seq was taken, since the copy may be stale.
+void bcache_fill(struct image *img, int block_num, const unsigned char *block, unsigned long seq) {
+    struct bcache *c = &img->cache;
+    if(c->nblocks == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    if(c->write_seq != seq || lookup(c, block_num) != NULL) {
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+    int fresh;
+    struct bcache_buf *buf = get_buf(img, block_num, &fresh);
+    if(fresh) {
+        if(c->write_seq == seq) {
+            memcpy(buf->data, block, BLOCK_SIZE);
+        } else {
+            hash_remove(c, buf);
+            buf->block_num = -1;
+        }
+        finish_io(c, buf);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Returns a pointer to the cached copy of the block, pinned in the cache
+// until bcache_unref() is called on it. Saves the copy bread() makes.
+// Returns NULL if the image has no block cache.
+unsigned char *bcache_ref(struct image *img, int block_num) {
+    struct bcache *c = &img->cache;
+    if(c->nblocks == 0) {
+        return NULL;
+    }
+
+    int fresh;
+    pthread_mutex_lock(&c->lock);
+    struct bcache_buf *buf = get_buf(img, block_num, &fresh);
+    buf->pins++;
+    if(fresh) {
+        c->stats.misses++;
+        pthread_mutex_unlock(&c->lock);
+        block_read_raw(img, block_num, buf->data);
+        pthread_mutex_lock(&c->lock);
+        finish_io(c, buf);
+    } else {
+        c->stats.hits++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return buf->data;
+}
+
+void bcache_unref(struct image *img, const unsigned char *data) {
+    struct bcache *c = &img->cache;
+    struct bcache_buf *buf = (struct bcache_buf *)(data - offsetof(struct bcache_buf, data));
+    pthread_mutex_lock(&c->lock);
+    buf->pins--;
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Returns true if data points into one of the image's cache buffers
+int bcache_owns(struct image *img, const unsigned char *data) {
+    struct bcache *c = &img->cache;
+    return c->nblocks > 0 &&
+        data >= (unsigned char *)c->bufs &&
+        data < (unsigned char *)(c->bufs + c->nblocks);
+}
+
+static int compare_buf_block_num(const void *a, const void *b) {
+    const struct bcache_buf *x = *(struct bcache_buf * const *)a;
+    const struct bcache_buf *y = *(struct bcache_buf * const *)b;
+    return (x->block_num > y->block_num) - (x->block_num < y->block_num);
+}
+
+// Writes every dirty block back to the image in ascending block order
+void bcache_sync(struct image *img) {
+    struct bcache *c = &img->cache;
+    if(c->nblocks == 0) {
+        return;
+    }
+
+    struct bcache_buf **dirty = malloc(c->nblocks * sizeof(struct bcache_buf *));
+    if(dirty == NULL) {
+        perror("Error allocating dirty list\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    int count = 0;
+    for(int i = 0; i < c->nblocks; i++) {
+        struct bcache_buf *buf = &c->bufs[i];
+        if(buf->block_num != -1 && buf->dirty && !buf->busy) {
+            buf->busy = 1;
+            dirty[count++] = buf;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    // write the dirty blocks in ascending order, one pwritev() per run
+    qsort(dirty, count, sizeof(struct bcache_buf *), compare_buf_block_num);
+    int *block_nums = malloc((count + 1) * sizeof(int));
+    unsigned char **blocks = malloc((count + 1) * sizeof(unsigned char *));
+    if(block_nums == NULL || blocks == NULL) {
+        perror("Error allocating dirty list\n");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < count; i++) {
+        block_nums[i] = dirty[i]->block_num;
+        blocks[i] = dirty[i]->data;
+    }
+    block_rw_many_raw(img, block_nums, blocks, count, 1);
+    free(block_nums);
+    free(blocks);
+
+    pthread_mutex_lock(&c->lock);
+    for(int i = 0; i < count; i++) {
+        dirty[i]->dirty = 0;
+        finish_io(c, dirty[i]);
+    }
+    c->stats.writebacks += count;
+    if(count > 0) {
+        c->write_seq++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    free(dirty);
+}
+
+// Drops every cached block without writing anything back.
+// Used when the underlying image changes out from under the cache.
+// A buffer still pinned by bcache_ref() keeps its contents and its pins
+// for its holders, but is never found again, and is only reused once the
+// last of them has called bcache_unref().
+void bcache_invalidate(struct image *img) {
+    struct bcache *c = &img->cache;
+    if(c->nblocks == 0) {
+        return;
+    }
+    pthread_mutex_lock(&c->lock);
+    c->lru_head = NULL;
+    c->lru_tail = NULL;
+    for(int i = 0; i < c->nblocks; i++) {
+        struct bcache_buf *buf = &c->bufs[i];
+        if(buf->block_num != -1) {
+            hash_remove(c, buf);
+        }
+        buf->block_num = -1;
+        buf->dirty = 0;
+        lru_push_front(c, buf);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void bcache_get_stats(struct image *img, struct bcache_stats *stats) {
+    pthread_mutex_lock(&img->cache.lock);
+    *stats = img->cache.stats;
+    pthread_mutex_unlock(&img->cache.lock);
+}
+
+void bcache_reset_stats(struct image *img) {
+    pthread_mutex_lock(&img->cache.lock);
+    memset(&img->cache.stats, 0, sizeof(img->cache.stats));
+    pthread_mutex_unlock(&img->cache.lock);
+}
@@ -0,0 +1,58 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <pthread.h>
+
+#define BLOCK_SIZE 4096
+#define BCACHE_DEFAULT_BLOCKS 256
+
+struct image;
+
+struct bcache_buf {
+    int block_num;      // -1 when the buffer holds nothing
+    int dirty;
+    int busy;           // set while the buffer is being read or written back
+    int pins;           // outstanding bcache_ref() references, never evicted while > 0
+    struct bcache_buf *lru_prev;
+    struct bcache_buf *lru_next;
+    struct bcache_buf *hash_next;
+    unsigned char data[BLOCK_SIZE];
+};
+
+struct bcache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;
+};
+
+struct bcache {
+    struct bcache_buf *bufs;
+    struct bcache_buf **hash_table;
+    int nblocks;        // 0 when caching is disabled
+    int hash_size;
+    struct bcache_buf *lru_head;
+    struct bcache_buf *lru_tail;
+    struct bcache_stats stats;
+    unsigned long write_seq;    // bumped every time a cached block is written to disk
+    pthread_mutex_t lock;
+    pthread_cond_t io_done;
+};
+
+int bcache_init(struct image *img, int nblocks);
+void bcache_destroy(struct image *img);
+void bcache_read(struct image *img, int block_num, unsigned char *block);
+void bcache_write(struct image *img, int block_num, unsigned char *block);
+int bcache_lookup_copy(struct image *img, int block_num, unsigned char *block);
+int bcache_contains(struct image *img, int block_num);
+unsigned long bcache_write_seq(struct image *img);
+void bcache_fill(struct image *img, int block_num, const unsigned char *block, unsigned long seq);
+unsigned char *bcache_ref(struct image *img, int block_num);
+void bcache_unref(struct image *img, const unsigned char *data);
+int bcache_owns(struct image *img, const unsigned char *data);
+void bcache_sync(struct image *img);
+void bcache_invalidate(struct image *img);
+void bcache_get_stats(struct image *img, struct bcache_stats *stats);
+void bcache_reset_stats(struct image *img);
+
+#endif
@@ -1,57 +1,489 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include "image.h"
+#include "block.h"
 #include "free.h"
+#include "bcache.h"
+#include "journal.h"
 
 #define BLOCK_SIZE 4096
-#define FREE_BLOCK_MAP_NUM 2
+// most blocks moved by one preadv()/pwritev(), within the usual IOV_MAX
+#define MAX_RUN_BLOCKS 1024
 
-unsigned char *bread(int block_num, unsigned char *block) {
-    off_t block_offset = block_num * BLOCK_SIZE;
-    off_t file_offset = lseek(image_fd, block_offset, SEEK_SET);
-    if (file_offset == -1) {
-        perror("Error finding file_offset using lseek\n");
+struct block_io {
+    int block_num;
+    int order;              // position in the caller's list, keeps sorting stable
+    unsigned char *data;
+};
+
+// Reads a block straight from the image, bypassing the cache.
+// Uses positioned I/O, so there is no shared file offset between threads.
+// Anything past the end of the image reads back as zeros.
+void block_read_raw(struct image *img, int block_num, unsigned char *block) {
+    off_t block_offset = (off_t)block_num * BLOCK_SIZE;
+    ssize_t total = 0;
+    while(total < BLOCK_SIZE) {
+        ssize_t bytes_read = pread(img->fd, block + total, BLOCK_SIZE - total, block_offset + total);
+        __atomic_fetch_add(&img->read_calls, 1, __ATOMIC_RELAXED);
+        if(bytes_read == -1) {
+            perror("Error reading block\n");
+            exit(EXIT_FAILURE);
+        }
+        if(bytes_read == 0) {
+            memset(block + total, 0, BLOCK_SIZE - total);
+            break;
+        }
+        total += bytes_read;
+    }
+}
+
+// Writes a block straight to the image, bypassing the cache
+void block_write_raw(struct image *img, int block_num, unsigned char *block) {
+    off_t block_offset = (off_t)block_num * BLOCK_SIZE;
+    ssize_t total = 0;
+    while(total < BLOCK_SIZE) {
+        ssize_t bytes_written = pwrite(img->fd, block + total, BLOCK_SIZE - total, block_offset + total);
+        __atomic_fetch_add(&img->write_calls, 1, __ATOMIC_RELAXED);
+        if (bytes_written == -1) {
+            perror("Error writing block\n");
+            exit(EXIT_FAILURE);
+        }
+        total += bytes_written;
+    }
+}
+
+// Waits for everything written to the image to reach the disk, unless the
+// image was opened with IMAGE_DURABLE_NONE
+void block_sync_raw(struct image *img) {
+    if(img->durability == IMAGE_DURABLE_NONE) {
+        return;
+    }
+    if(fdatasync(img->fd) == -1) {
+        perror("Error syncing image\n");
         exit(EXIT_FAILURE);
     }
-    ssize_t bytes_read = read(image_fd, block, BLOCK_SIZE);
-    if(bytes_read == -1) {
-        perror("Error reading block\n");
+    __atomic_fetch_add(&img->sync_calls, 1, __ATOMIC_RELAXED);
+}
+
+// Moves one run of consecutive blocks with a single preadv()/pwritev(),
+// picking up where a short transfer left off
+static void block_run_raw(struct image *img, struct block_io *run, int n, int write) {
+    struct iovec iov[MAX_RUN_BLOCKS];
+    for(int i = 0; i < n; i++) {
+        iov[i].iov_base = run[i].data;
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+
+    off_t offset = (off_t)run[0].block_num * BLOCK_SIZE;
+    struct iovec *next = iov;
+    int left = n;
+    while(left > 0) {
+        ssize_t bytes;
+        if(write) {
+            bytes = pwritev(img->fd, next, left, offset);
+            __atomic_fetch_add(&img->write_calls, 1, __ATOMIC_RELAXED);
+        } else {
+            bytes = preadv(img->fd, next, left, offset);
+            __atomic_fetch_add(&img->read_calls, 1, __ATOMIC_RELAXED);
+        }
+        if(bytes == -1) {
+            perror(write ? "Error writing blocks\n" : "Error reading blocks\n");
+            exit(EXIT_FAILURE);
+        }
+        if(bytes == 0 && !write) {
+            // past the end of the image, which reads back as zeros
+            for(int i = 0; i < left; i++) {
+                memset(next[i].iov_base, 0, next[i].iov_len);
+            }
+            break;
+        }
+        offset += bytes;
+        while(left > 0 && (size_t)bytes >= next->iov_len) {
+            bytes -= next->iov_len;
+            next++;
+            left--;
+        }
+        if(left > 0) {
+            next->iov_base = (unsigned char *)next->iov_base + bytes;
+            next->iov_len -= bytes;
+        }
+    }
+}
+
+static int compare_block_io(const void *a, const void *b) {
+    const struct block_io *x = a;
+    const struct block_io *y = b;
+    if(x->block_num != y->block_num) {
+        return (x->block_num > y->block_num) - (x->block_num < y->block_num);
+    }
+    return x->order - y->order;
+}
+
+// Moves a batch of blocks straight to or from the image, bypassing the cache.
+// The blocks are sorted and every run of consecutive block numbers goes
+// through one preadv()/pwritev(). If a block is listed twice for writing,
+// the later entry wins.
+void block_rw_many_raw(struct image *img, const int *block_nums, unsigned char **blocks, int count, int write) {
+    if(count <= 0) {
+        return;
+    }
+    struct block_io *ios = malloc(count * sizeof(struct block_io));
+    if(ios == NULL) {
+        perror("Error allocating block list\n");
         exit(EXIT_FAILURE);
     }
+    for(int i = 0; i < count; i++) {
+        ios[i].block_num = block_nums[i];
+        ios[i].order = i;
+        ios[i].data = blocks[i];
+    }
+    qsort(ios, count, sizeof(struct block_io), compare_block_io);
+
+    int i = 0;
+    while(i < count) {
+        int n = 1;
+        while(i + n < count && n < MAX_RUN_BLOCKS &&
+                ios[i + n].block_num == ios[i + n - 1].block_num + 1) {
+            n++;
+        }
+        block_run_raw(img, ios + i, n, write);
+        i += n;
+    }
+    free(ios);
+}
+
+// Returns where the block lives in the image's mapping, or NULL if the
+// image is not memory-mapped or the block lies past the mapping
+static unsigned char *mapped_block(struct image *img, int block_num) {
+    if(img->map == NULL || block_num < 0 || block_num >= img->map_blocks) {
+        return NULL;
+    }
+    return img->map + (size_t)block_num * BLOCK_SIZE;
+}
+
+// Reads a block of the given image through its block cache or mapping
+unsigned char *bread_img(struct image *img, int block_num, unsigned char *block) {
+    if(journal_read(img, block_num, block)) {
+        return block;
+    }
+    unsigned char *mapped = mapped_block(img, block_num);
+    if(mapped != NULL) {
+        memcpy(block, mapped, BLOCK_SIZE);
+    } else {
+        bcache_read(img, block_num, block);
+    }
     return block;
 }
 
-void bwrite(int block_num, unsigned char *block) {
-    off_t block_offset = block_num * BLOCK_SIZE;
-    off_t file_offset = lseek(image_fd, block_offset, SEEK_SET);
-    if (file_offset == -1) {
-        perror("Error finding file_offset using lseek\n");
+static void block_write(struct image *img, int block_num, unsigned char *block, int metadata) {
+    __atomic_fetch_add(&img->unsynced_writes, 1, __ATOMIC_RELAXED);
+    freemap_block_written(img, block_num);
+    if(!journal_capture(img, block_num, block, metadata)) {
+        block_write_home(img, block_num, block);
+    }
+}
+
+// Writes a block of the given image into its block cache or mapping; it
+// reaches the image when it is evicted or when the image is synced. A
+// block that belongs in the running journal transaction is held there
+// until the transaction commits.
+void bwrite_img(struct image *img, int block_num, unsigned char *block) {
+    block_write(img, block_num, block, 1);
+}
+
+// Writes a block into the block cache or mapping, past the journal
+void block_write_home(struct image *img, int block_num, unsigned char *block) {
+    unsigned char *mapped = mapped_block(img, block_num);
+    if(mapped == NULL) {
+        bcache_write(img, block_num, block);
+        return;
+    }
+    memcpy(mapped, block, BLOCK_SIZE);
+    if(img->msync_policy == IMAGE_MSYNC_EACH_WRITE && msync(mapped, BLOCK_SIZE, MS_SYNC) == -1) {
+        perror("Error syncing block\n");
         exit(EXIT_FAILURE);
     }
-    ssize_t bytes_written = write(image_fd, block, BLOCK_SIZE);
-    if (bytes_written == -1) {
-        perror("Error writing block\n");
+}
+
+// Reads several blocks of the given image at once into blocks[i].
+// Cached and mapped blocks are copied, and the rest are read with one
+// preadv() per run of consecutive block numbers and then cached.
+void bread_many_img(struct image *img, const int *block_nums, unsigned char **blocks, int count) {
+    int *miss_nums = malloc(count * sizeof(int));
+    unsigned char **miss_blocks = malloc(count * sizeof(unsigned char *));
+    if(miss_nums == NULL || miss_blocks == NULL) {
+        perror("Error allocating block list\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int misses = 0;
+    for(int i = 0; i < count; i++) {
+        if(journal_read(img, block_nums[i], blocks[i])) {
+            continue;
+        }
+        unsigned char *mapped = mapped_block(img, block_nums[i]);
+        if(mapped != NULL) {
+            memcpy(blocks[i], mapped, BLOCK_SIZE);
+        } else if(bcache_lookup_copy(img, block_nums[i], blocks[i]) == -1) {
+            miss_nums[misses] = block_nums[i];
+            miss_blocks[misses] = blocks[i];
+            misses++;
+        }
+    }
+
+    if(misses > 0) {
+        unsigned long seq = bcache_write_seq(img);
+        block_rw_many_raw(img, miss_nums, miss_blocks, misses, 0);
+        for(int i = 0; i < misses; i++) {
+            bcache_fill(img, miss_nums[i], miss_blocks[i], seq);
+        }
+    }
+    free(miss_nums);
+    free(miss_blocks);
+}
+
+// Brings blocks into the block cache ahead of use: the ones not cached yet
+// are read with one preadv() per run of consecutive block numbers. For a
+// memory-mapped image the kernel is asked to page them in instead.
+void bprefetch_many_img(struct image *img, const int *block_nums, int count) {
+    if(img->map != NULL) {
+        for(int i = 0; i < count; i++) {
+            unsigned char *mapped = mapped_block(img, block_nums[i]);
+            if(mapped != NULL) {
+                madvise(mapped, BLOCK_SIZE, MADV_WILLNEED);
+            }
+        }
+        return;
+    }
+    if(img->cache.nblocks == 0 || count <= 0) {
+        return;
+    }
+
+    int *miss_nums = malloc(count * sizeof(int));
+    unsigned char **miss_blocks = malloc(count * sizeof(unsigned char *));
+    unsigned char *data = malloc((size_t)count * BLOCK_SIZE);
+    if(miss_nums == NULL || miss_blocks == NULL || data == NULL) {
+        perror("Error allocating block list\n");
         exit(EXIT_FAILURE);
     }
+    int misses = 0;
+    for(int i = 0; i < count; i++) {
+        if(!bcache_contains(img, block_nums[i])) {
+            miss_nums[misses] = block_nums[i];
+            miss_blocks[misses] = data + (size_t)misses * BLOCK_SIZE;
+            misses++;
+        }
+    }
+    if(misses > 0) {
+        unsigned long seq = bcache_write_seq(img);
+        block_rw_many_raw(img, miss_nums, miss_blocks, misses, 0);
+        for(int i = 0; i < misses; i++) {
+            bcache_fill(img, miss_nums[i], miss_blocks[i], seq);
+        }
+    }
+    free(miss_nums);
+    free(miss_blocks);
+    free(data);
 }
 
+static void block_write_many(struct image *img, const int *block_nums, unsigned char **blocks, int count,
+                             int metadata) {
+    if(img->map != NULL || img->cache.nblocks > 0) {
+        for(int i = 0; i < count; i++) {
+            block_write(img, block_nums[i], blocks[i], metadata);
+        }
+        return;
+    }
+    int *home_nums = malloc(count * sizeof(int));
+    unsigned char **home_blocks = malloc(count * sizeof(unsigned char *));
+    if(home_nums == NULL || home_blocks == NULL) {
+        perror("Error allocating block list\n");
+        exit(EXIT_FAILURE);
+    }
+    __atomic_fetch_add(&img->unsynced_writes, count, __ATOMIC_RELAXED);
+    int n = 0;
+    for(int i = 0; i < count; i++) {
+        freemap_block_written(img, block_nums[i]);
+        if(!journal_capture(img, block_nums[i], blocks[i], metadata)) {
+            home_nums[n] = block_nums[i];
+            home_blocks[n] = blocks[i];
+            n++;
+        }
+    }
+    block_rw_many_raw(img, home_nums, home_blocks, n, 1);
+    free(home_nums);
+    free(home_blocks);
+}
+
+// Writes several blocks of the given image at once. With a block cache
+// they are simply cached dirty and bsync() later merges them into runs;
+// without one they go out with one pwritev() per run, apart from those
+// held for the running journal transaction.
+void bwrite_many_img(struct image *img, const int *block_nums, unsigned char **blocks, int count) {
+    block_write_many(img, block_nums, blocks, count, 1);
+}
+
+// Writes file contents like bwrite_many_img(), but straight home even in
+// the middle of a journaled operation: only the metadata pointing at the
+// blocks is journaled, not the data itself
+void bwrite_data_many_img(struct image *img, const int *block_nums, unsigned char **blocks, int count) {
+    block_write_many(img, block_nums, blocks, count, 0);
+}
+
+// Returns a read-only pointer to the block's contents without copying it:
+// straight into the mapping for memory-mapped images, or a pinned cache
+// buffer otherwise. A block in the running journal transaction is copied. Every reference must be handed back with brelse_img().
+const unsigned char *bread_ref_img(struct image *img, int block_num) {
+    if(journal_contains(img, block_num)) {
+        unsigned char *copy = malloc(BLOCK_SIZE);
+        if(copy == NULL) {
+            perror("Error allocating block\n");
+            exit(EXIT_FAILURE);
+        }
+        return bread_img(img, block_num, copy);
+    }
+    unsigned char *mapped = mapped_block(img, block_num);
+    if(mapped != NULL) {
+        return mapped;
+    }
+    unsigned char *cached = bcache_ref(img, block_num);
+    if(cached != NULL) {
+        return cached;
+    }
+    // no cache and no mapping, so hand out a private copy
+    unsigned char *copy = malloc(BLOCK_SIZE);
+    if(copy == NULL) {
+        perror("Error allocating block\n");
+        exit(EXIT_FAILURE);
+    }
+    block_read_raw(img, block_num, copy);
+    return copy;
+}
+
+void brelse_img(struct image *img, const unsigned char *ref) {
+    if(img->map != NULL && ref >= img->map && ref < img->map + (size_t)img->map_blocks * BLOCK_SIZE) {
+        return;
+    }
+    if(bcache_owns(img, ref)) {
+        bcache_unref(img, ref);
+        return;
+    }
+    free((unsigned char *)ref);
+}
+
+// Commits the running journal transaction, then flushes every dirty
+// cached block of the given image, or for a memory-mapped image syncs the
+// mapping according to its msync policy
+void bsync_img(struct image *img) {
+    journal_commit_img(img);
+    bcache_sync(img);
+    if(img->map == NULL || img->msync_policy == IMAGE_MSYNC_NONE) {
+        return;
+    }
+    int flags = img->msync_policy == IMAGE_MSYNC_ASYNC ? MS_ASYNC : MS_SYNC;
+    if(msync(img->map, (size_t)img->map_blocks * BLOCK_SIZE, flags) == -1) {
+        perror("Error syncing image\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// bread(), bwrite() and bsync() work on the image opened with image_open()
+unsigned char *bread(int block_num, unsigned char *block) {
+    return bread_img(image_current(), block_num, block);
+}
+
+void bwrite(int block_num, unsigned char *block) {
+    bwrite_img(image_current(), block_num, block);
+}
+
+void bsync(void) {
+    bsync_img(image_current());
+}
+
+void bread_many(const int *block_nums, unsigned char **blocks, int count) {
+    bread_many_img(image_current(), block_nums, blocks, count);
+}
+
+void bwrite_many(const int *block_nums, unsigned char **blocks, int count) {
+    bwrite_many_img(image_current(), block_nums, blocks, count);
+}
+
+void bwrite_data_many(const int *block_nums, unsigned char **blocks, int count) {
+    bwrite_data_many_img(image_current(), block_nums, blocks, count);
+}
+
+void bprefetch_many(const int *block_nums, int count) {
+    bprefetch_many_img(image_current(), block_nums, count);
+}
+
+const unsigned char *bread_ref(int block_num) {
+    return bread_ref_img(image_current(), block_num);
+}
+
+void brelse(const unsigned char *ref) {
+    brelse_img(image_current(), ref);
+}
+
+// the block map covers every block of the image
+static void block_map_layout(struct image *img, int *first_block, int *nbits) {
+    *first_block = img->sb.block_map_start;
+    *nbits = img->sb.nblocks;
+}
+
+// resident copy of the free block map, with its search summary
+static struct freemap block_free_map = FREEMAP_INIT(block_map_layout);
+
+// allocate a previously free block in the block map
+// returns the block number, or -1 if no block is free
 int alloc(void){
-    unsigned char *buffer = malloc(BLOCK_SIZE);
-    // call bread() to get the inode map
-    unsigned char *inode_map = bread(FREE_BLOCK_MAP_NUM, buffer);
+    return freemap_alloc(&block_free_map);
+}
 
-    // call find_free() to locate a free inode
-    int byte_index = find_free(inode_map);
-    if(byte_index == -1) {
-        return byte_index;
+// allocate n free blocks in one pass over the block map, storing their
+// numbers in block_nums; the map is written back once for the whole batch
+// returns n, or -1 (allocating nothing) if fewer than n blocks are free
+int alloc_many(int *block_nums, int n) {
+    return freemap_alloc_many(&block_free_map, block_nums, n, 0);
+}
+
+// allocate a free block as close after goal as possible, so related
+// blocks end up next to each other; falls back to the lowest free block
+// returns the block number, or -1 if no block is free
+int alloc_near(int goal) {
+    int block_num = freemap_alloc_from(&block_free_map, goal);
+    if(block_num == -1 && goal > 0) {
+        block_num = freemap_alloc(&block_free_map);
     }
+    return block_num;
+}
+
+// allocate n contiguous blocks, searching first-fit from goal or best-fit
+// (policy is FREEMAP_FIRST_FIT or FREEMAP_BEST_FIT)
+// returns the first block of the run, or -1 if no run of n blocks is free
+int alloc_run(int n, int goal, int policy) {
+    return freemap_alloc_run(&block_free_map, n, goal, policy);
+}
+
+// mark a block free again in the block map
+void bfree(int block_num) {
+    freemap_free(&block_free_map, block_num);
+}
 
-    // call set_free() to mark it as non-free
-    set_free(inode_map, byte_index, 1);
+// mark every block in block_nums free again, writing the map back once
+void bfree_many(const int *block_nums, int n) {
+    freemap_free_many(&block_free_map, block_nums, n);
+}
 
-    // call bwrite() to save the inode back out to disk
-    bwrite(FREE_BLOCK_MAP_NUM, inode_map);
-    free(buffer);
-    return byte_index;
-}
\ No newline at end of file
+// mark n contiguous blocks starting at first free again
+void bfree_run(int first, int n) {
+    freemap_free_run(&block_free_map, first, n);
+}
+
+// report how fragmented the free blocks are
+void alloc_stats(struct freemap_stats *stats) {
+    freemap_stats(&block_free_map, stats);
+}
@@ -3,8 +3,39 @@
 
 #define BLOCK_SIZE 4096
 
+struct image;
+struct freemap_stats;
+
 unsigned char *bread(int block_num, unsigned char *block);
 void bwrite(int block_num, unsigned char *block);
+void bsync(void);
+void bread_many(const int *block_nums, unsigned char **blocks, int count);
+void bwrite_many(const int *block_nums, unsigned char **blocks, int count);
+void bwrite_data_many(const int *block_nums, unsigned char **blocks, int count);
+void bprefetch_many(const int *block_nums, int count);
+const unsigned char *bread_ref(int block_num);
+void brelse(const unsigned char *ref);
+unsigned char *bread_img(struct image *img, int block_num, unsigned char *block);
+void bwrite_img(struct image *img, int block_num, unsigned char *block);
+void bsync_img(struct image *img);
+void bread_many_img(struct image *img, const int *block_nums, unsigned char **blocks, int count);
+void bwrite_many_img(struct image *img, const int *block_nums, unsigned char **blocks, int count);
+void bwrite_data_many_img(struct image *img, const int *block_nums, unsigned char **blocks, int count);
+void bprefetch_many_img(struct image *img, const int *block_nums, int count);
+const unsigned char *bread_ref_img(struct image *img, int block_num);
+void brelse_img(struct image *img, const unsigned char *ref);
+void block_read_raw(struct image *img, int block_num, unsigned char *block);
+void block_write_raw(struct image *img, int block_num, unsigned char *block);
+void block_write_home(struct image *img, int block_num, unsigned char *block);
+void block_sync_raw(struct image *img);
+void block_rw_many_raw(struct image *img, const int *block_nums, unsigned char **blocks, int count, int write);
 int alloc(void);
+int alloc_many(int *block_nums, int n);
+int alloc_near(int goal);
+int alloc_run(int n, int goal, int policy);
+void bfree(int block_num);
+void bfree_many(const int *block_nums, int n);
+void bfree_run(int first, int n);
+void alloc_stats(struct freemap_stats *stats);
 
 #endif
\ No newline at end of file
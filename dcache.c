@@ -0,0 +1,181 @@
+#include <string.h>
+#include <pthread.h>
+#include "image.h"
+#include "dcache.h"
+
+// Directory entry cache: remembers what looking a name up in a directory
+// found, including that it found nothing. A fixed pool of entries sits in a
+// hash table keyed by (directory inode, name), with the least recently used
+// entry recycled when the pool runs out. One lock covers the whole cache;
+// nothing under it takes longer than a short hash chain walk.
+
+struct dentry {
+    int dir_inode_num;          // -1 when the entry holds nothing
+    int inode_num;              // or DCACHE_NEGATIVE
+    char name[DCACHE_NAME_LEN];
+    struct dentry *hash_next;
+    struct dentry *lru_prev;
+    struct dentry *lru_next;
+};
+
+static struct dentry dentries[DCACHE_ENTRIES];
+static struct dentry *dentry_hash[DCACHE_ENTRIES];
+static struct dentry *lru_head = NULL;     // most recently used
+static struct dentry *lru_tail = NULL;
+static int initialized = 0;
+static struct image *dcache_img = NULL;     // image the entries describe
+static struct dcache_stats stats;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int dentry_bucket(int dir_inode_num, const char *name) {
+    // FNV-1a over the directory's inode number and the name
+    unsigned int h = 2166136261u;
+    for(int i = 0; i < 4; i++) {
+        h = (h ^ ((dir_inode_num >> (i * 8)) & 0xff)) * 16777619u;
+    }
+    for(const char *p = name; *p != '\0'; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return h % DCACHE_ENTRIES;
+}
+
+static void lru_remove(struct dentry *d) {
+    if(d->lru_prev != NULL) {
+        d->lru_prev->lru_next = d->lru_next;
+    } else {
+        lru_head = d->lru_next;
+    }
+    if(d->lru_next != NULL) {
+        d->lru_next->lru_prev = d->lru_prev;
+    } else {
+        lru_tail = d->lru_prev;
+    }
+}
+
+static void lru_push(struct dentry *d) {
+    d->lru_prev = NULL;
+    d->lru_next = lru_head;
+    if(lru_head != NULL) {
+        lru_head->lru_prev = d;
+    } else {
+        lru_tail = d;
+    }
+    lru_head = d;
+}
+
+static void hash_remove(struct dentry *d) {
+    struct dentry **p = &dentry_hash[dentry_bucket(d->dir_inode_num, d->name)];
+    while(*p != NULL && *p != d) {
+        p = &(*p)->hash_next;
+    }
+    if(*p != NULL) {
+        *p = d->hash_next;
+    }
+    d->hash_next = NULL;
+    d->dir_inode_num = -1;
+}
+
+// Empties the cache; every entry goes back on the LRU list unused
+static void dcache_clear(void) {
+    memset(dentry_hash, 0, sizeof(dentry_hash));
+    lru_head = NULL;
+    lru_tail = NULL;
+    for(int i = 0; i < DCACHE_ENTRIES; i++) {
+        dentries[i].dir_inode_num = -1;
+        dentries[i].hash_next = NULL;
+        lru_push(&dentries[i]);
+    }
+    initialized = 1;
+}
+
+// Makes sure the cache describes the current image
+static void dcache_ready(void) {
+    struct image *img = image_current();
+    if(!initialized || img != dcache_img) {
+        dcache_clear();
+        dcache_img = img;
+    }
+}
+
+static struct dentry *dentry_find(int dir_inode_num, const char *name) {
+    for(struct dentry *d = dentry_hash[dentry_bucket(dir_inode_num, name)]; d != NULL; d = d->hash_next) {
+        if(d->dir_inode_num == dir_inode_num && strcmp(d->name, name) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// Looks up name in the directory with inode number dir_inode_num.
+// Returns 1 on a hit, with *inode_num set to the entry's inode number or
+// DCACHE_NEGATIVE if the name is known not to exist, or 0 on a miss.
+int dcache_lookup(int dir_inode_num, const char *name, int *inode_num) {
+    pthread_mutex_lock(&dcache_lock);
+    dcache_ready();
+    struct dentry *d = dentry_find(dir_inode_num, name);
+    if(d == NULL) {
+        stats.misses++;
+        pthread_mutex_unlock(&dcache_lock);
+        return 0;
+    }
+    lru_remove(d);
+    lru_push(d);
+    *inode_num = d->inode_num;
+    if(d->inode_num == DCACHE_NEGATIVE) {
+        stats.negative_hits++;
+    } else {
+        stats.hits++;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return 1;
+}
+
+// Records that name in the directory dir_inode_num refers to inode_num,
+// or with DCACHE_NEGATIVE that it does not exist. Replaces any earlier
+// entry for the name. Names too long for a directory entry are not cached.
+void dcache_insert(int dir_inode_num, const char *name, int inode_num) {
+    if(strlen(name) >= DCACHE_NAME_LEN) {
+        return;
+    }
+    pthread_mutex_lock(&dcache_lock);
+    dcache_ready();
+    struct dentry *d = dentry_find(dir_inode_num, name);
+    if(d == NULL) {
+        d = lru_tail;
+        if(d->dir_inode_num != -1) {
+            hash_remove(d);
+            stats.evictions++;
+        }
+        d->dir_inode_num = dir_inode_num;
+        strcpy(d->name, name);
+        unsigned int b = dentry_bucket(dir_inode_num, name);
+        d->hash_next = dentry_hash[b];
+        dentry_hash[b] = d;
+    }
+    d->inode_num = inode_num;
+    lru_remove(d);
+    lru_push(d);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// Called when an image is closed or rewritten from scratch
+void dcache_forget_image(struct image *img) {
+    pthread_mutex_lock(&dcache_lock);
+    if(initialized && img == dcache_img) {
+        dcache_clear();
+        dcache_img = NULL;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_get_stats(struct dcache_stats *out) {
+    pthread_mutex_lock(&dcache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_reset_stats(void) {
+    pthread_mutex_lock(&dcache_lock);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&dcache_lock);
+}
@@ -0,0 +1,23 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#define DCACHE_ENTRIES 4096
+#define DCACHE_NAME_LEN 16          // same as a directory entry's name
+#define DCACHE_NEGATIVE -1          // cached answer: the name does not exist
+
+struct image;
+
+struct dcache_stats {
+    unsigned long hits;
+    unsigned long negative_hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+int dcache_lookup(int dir_inode_num, const char *name, int *inode_num);
+void dcache_insert(int dir_inode_num, const char *name, int inode_num);
+void dcache_forget_image(struct image *img);
+void dcache_get_stats(struct dcache_stats *stats);
+void dcache_reset_stats(void);
+
+#endif
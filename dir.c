@@ -5,6 +5,10 @@
 #include "inode.h"
 #include "mkfs.h"
 #include "pack.h"
+#include "dcache.h"
+#include "dir.h"
+#include "free.h"
+#include "journal.h"
 
 char *get_dirname(const char *path, char *dirname) {
     strcpy(dirname, path);
@@ -36,12 +40,312 @@ char *get_basename(const char *path, char *basename) {
     return basename;
 }
 
-int directory_make(char *path) {
+// Directory index
+//
+// A directory with more than directory_index_threshold entries gets a
+// hashed name index, a little like ext4's htree. The entries themselves
+// stay in the plain linear format; the index sits beside them:
+//
+//   root block: u32 magic, u32 leaf count (a power of two), u32 leaf block
+//               numbers
+//   leaf block: u32 slot count, then (u32 name hash, u32 entry number) slots
+//
+// A name's hash picks its leaf, and the leaf gives the entry numbers of the
+// names with that hash. A lookup reads the root, one leaf and the one
+// directory block holding the entry. The root's block number is kept in
+// the spare bytes of the directory's "." entry, 0 meaning no index.
+
+static int directory_index_threshold = DIR_INDEX_DEFAULT_THRESHOLD;
+static int directory_prealloc = DIR_DEFAULT_PREALLOC;
+
+// Sets how many contiguous blocks a directory grows by when it runs out
+void directory_set_prealloc(int blocks) {
+    directory_prealloc = blocks > 0 ? blocks : 1;
+}
+
+// Sets how many entries a directory may hold before directory_make()
+// builds an index for it
+void directory_set_index_threshold(int entries) {
+    directory_index_threshold = entries;
+}
+
+static unsigned int dir_name_hash(const char *name) {
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    for(const char *p = name; *p != '\0'; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    return h;
+}
+
+// Maps the index-th block of a directory to its block number
+int directory_block_num(struct inode *dir_inode, int index) {
+    return bmap(dir_inode, index);
+}
+
+// Returns the block number of the directory's index root, or 0 if it has none
+int directory_index_root(struct inode *dir_inode) {
+    const unsigned char *block = bread_ref(directory_block_num(dir_inode, 0));
+    int root = read_u32(block + DIR_INDEX_ROOT_OFFSET);
+    brelse(block);
+    return root;
+}
+
+static void dir_set_index_root(struct inode *dir_inode, int root) {
+    unsigned char block[BLOCK_SIZE];
+    int block_num = directory_block_num(dir_inode, 0);
+    bread(block_num, block);
+    write_u32(block + DIR_INDEX_ROOT_OFFSET, root);
+    bwrite(block_num, block);
+}
+
+// Adds an entry number to a leaf block; returns -1 if the leaf is full
+static int dir_leaf_add(unsigned char *leaf, unsigned int hash, int entry) {
+    int count = read_u32(leaf);
+    if(count >= DIR_INDEX_LEAF_SLOTS) {
+        return -1;
+    }
+    write_u32(leaf + 4 + count * 8, hash);
+    write_u32(leaf + 8 + count * 8, entry);
+    write_u32(leaf, count + 1);
+    return 0;
+}
+
+// Builds a fresh index over every entry of the directory, with at least
+// min_leaves leaves, and frees the old index if there was one.
+// Returns 0, or -1 if there were no blocks for it.
+static int dir_index_build(struct inode *dir_inode, int min_leaves) {
+    int nentries = dir_inode->size / DIR_ENTRY_SIZE;
+    int nleaves = 1;
+    while(nleaves < min_leaves || nleaves * DIR_INDEX_LEAF_SLOTS < nentries * 2) {
+        nleaves *= 2;
+    }
+
+    unsigned char *leaves = NULL;
+    for(;;) {
+        if(nleaves > DIR_INDEX_MAX_LEAVES) {
+            free(leaves);
+            return -1;
+        }
+        leaves = realloc(leaves, (size_t)nleaves * BLOCK_SIZE);
+        if(leaves == NULL) {
+            perror("Error allocating directory index\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(leaves, 0, (size_t)nleaves * BLOCK_SIZE);
+
+        // one pass over the directory, a block at a time
+        int full = 0;
+        for(int entry = 0; entry < nentries && !full; entry += DIR_ENTRIES_PER_BLOCK) {
+            const unsigned char *block = bread_ref(directory_block_num(dir_inode, entry / DIR_ENTRIES_PER_BLOCK));
+            for(int i = entry; i < nentries && i < entry + DIR_ENTRIES_PER_BLOCK && !full; i++) {
+                const char *name = (const char *)block + (i % DIR_ENTRIES_PER_BLOCK) * DIR_ENTRY_SIZE + DIR_NAME_OFFSET;
+                unsigned int hash = dir_name_hash(name);
+                full = dir_leaf_add(leaves + (size_t)(hash & (nleaves - 1)) * BLOCK_SIZE, hash, i) == -1;
+            }
+            brelse(block);
+        }
+        if(!full) {
+            break;
+        }
+        nleaves *= 2;
+    }
+
+    // the root and its leaves, together and near the directory
+    int root = alloc_run(nleaves + 1, directory_block_num(dir_inode, 0), FREEMAP_FIRST_FIT);
+    if(root == -1) {
+        free(leaves);
+        return -1;
+    }
+    unsigned char root_block[BLOCK_SIZE] = {0};
+    write_u32(root_block, DIR_INDEX_MAGIC);
+    write_u32(root_block + 4, nleaves);
+    int *block_nums = malloc((nleaves + 1) * sizeof(int));
+    unsigned char **blocks = malloc((nleaves + 1) * sizeof(unsigned char *));
+    if(block_nums == NULL || blocks == NULL) {
+        perror("Error allocating directory index\n");
+        exit(EXIT_FAILURE);
+    }
+    block_nums[0] = root;
+    blocks[0] = root_block;
+    for(int i = 0; i < nleaves; i++) {
+        write_u32(root_block + 8 + i * 4, root + 1 + i);
+        block_nums[i + 1] = root + 1 + i;
+        blocks[i + 1] = leaves + (size_t)i * BLOCK_SIZE;
+    }
+    bwrite_many(block_nums, blocks, nleaves + 1);
+
+    int old_root = directory_index_root(dir_inode);
+    dir_set_index_root(dir_inode, root);
+    if(old_root != 0) {
+        const unsigned char *old = bread_ref(old_root);
+        int old_leaves = read_u32(old + 4);
+        bfree_run(old_root, old_leaves + 1);
+        brelse(old);
+    }
+    free(block_nums);
+    free(blocks);
+    free(leaves);
+    return 0;
+}
+
+// Records entry number entry, holding name, in the directory's index
+static void dir_index_add(struct inode *dir_inode, int root, const char *name, int entry) {
+    unsigned int hash = dir_name_hash(name);
+    const unsigned char *root_block = bread_ref(root);
+    int nleaves = read_u32(root_block + 4);
+    int leaf_num = read_u32(root_block + 8 + (hash & (nleaves - 1)) * 4);
+    brelse(root_block);
+
+    unsigned char leaf[BLOCK_SIZE];
+    bread(leaf_num, leaf);
+    if(dir_leaf_add(leaf, hash, entry) == 0) {
+        bwrite(leaf_num, leaf);
+    } else if(dir_index_build(dir_inode, nleaves * 2) == -1) {
+        // no room to grow it, so go back to plain linear lookups
+        dir_set_index_root(dir_inode, 0);
+        bfree_run(root, nleaves + 1);
+    }
+}
+
+// Looks name up through the directory's index.
+// Returns the entry's inode number, or -1 if there is no such entry.
+static int dir_index_find(struct inode *dir_inode, int root, const char *name) {
+    unsigned int hash = dir_name_hash(name);
+    const unsigned char *root_block = bread_ref(root);
+    int nleaves = read_u32(root_block + 4);
+    int leaf_num = read_u32(root_block + 8 + (hash & (nleaves - 1)) * 4);
+    brelse(root_block);
+
+    int inode_num = -1;
+    const unsigned char *leaf = bread_ref(leaf_num);
+    int count = read_u32(leaf);
+    for(int i = 0; i < count && inode_num == -1; i++) {
+        if(read_u32(leaf + 4 + i * 8) != hash) {
+            continue;
+        }
+        int entry = read_u32(leaf + 8 + i * 8);
+        const unsigned char *block = bread_ref(directory_block_num(dir_inode, entry / DIR_ENTRIES_PER_BLOCK));
+        const unsigned char *ent = block + (entry % DIR_ENTRIES_PER_BLOCK) * DIR_ENTRY_SIZE;
+        if(strcmp((const char *)ent + DIR_NAME_OFFSET, name) == 0) {
+            inode_num = read_u16(ent);
+        }
+        brelse(block);
+    }
+    brelse(leaf);
+    return inode_num;
+}
+
+// Looks name up in the directory whose in-core inode is dir_inode, going
+// to the directory's blocks only if the dentry cache has no answer.
+// Returns the entry's inode number, or -1 if there is no such entry.
+int directory_lookup(struct inode *dir_inode, const char *name) {
+    int inode_num;
+    if(dcache_lookup(dir_inode->inode_num, name, &inode_num)) {
+        return inode_num;
+    }
+
+    int root = directory_index_root(dir_inode);
+    if(root != 0) {
+        inode_num = dir_index_find(dir_inode, root, name);
+        dcache_insert(dir_inode->inode_num, name, inode_num);
+        return inode_num;
+    }
+
+    struct directory *dir = directory_open(dir_inode->inode_num);
+    if(dir == NULL) {
+        return -1;
+    }
+    struct directory_entry ent;
+    inode_num = DCACHE_NEGATIVE;
+    while(directory_get(dir, &ent) != -1) {
+        if(strcmp(ent.name, name) == 0) {
+            inode_num = ent.inode_num;
+            break;
+        }
+    }
+    directory_close(dir);
+
+    dcache_insert(dir_inode->inode_num, name, inode_num);
+    return inode_num;
+}
+
+// Makes room for the directory's index-th block, which it does not have
+// yet: allocates up to directory_prealloc contiguous blocks right after its
+// last one and maps them all. Returns the index-th block, or -1 if the
+// directory is at its largest or the image is full.
+static int directory_grow(struct inode *dir_inode, int index) {
+    int goal = index > 0 ? directory_block_num(dir_inode, index - 1) + 1 : 0;
+    int n = directory_prealloc;
+    if(n > INODE_MAX_BLOCKS - index) {
+        n = INODE_MAX_BLOCKS - index;
+    }
+    int first = -1;
+    // settle for a shorter run when free space is fragmented
+    while(n > 0 && (first = alloc_run(n, goal, FREEMAP_FIRST_FIT)) == -1) {
+        n /= 2;
+    }
+    if(first == -1) {
+        return -1;
+    }
+    for(int i = 0; i < n; i++) {
+        if(bmap_set(dir_inode, index + i, first + i) == -1) {
+            bfree_run(first + i, n - i);
+            return i > 0 ? first : -1;
+        }
+    }
+    return first;
+}
+
+// Appends an entry for inode_num called name to the directory, growing it
+// by a block when the last one is full, and keeps its index and the dentry
+// cache up to date. Returns 0, or -1 if the directory cannot grow.
+int directory_add_entry(struct inode *dir_inode, const char *name, int inode_num) {
+    int data_block_index = dir_inode->size / BLOCK_SIZE;
+    int data_block_num = directory_block_num(dir_inode, data_block_index);
+    if(data_block_num == 0) {
+        data_block_num = directory_grow(dir_inode, data_block_index);
+        if(data_block_num == -1) {
+            return -1;
+        }
+    }
+
+    // Read that block into memory and add the new directory entry to it
+    unsigned char block[BLOCK_SIZE];
+    bread(data_block_num, block);
+    unsigned char *entry = block + dir_inode->size % BLOCK_SIZE;
+    memset(entry, 0, DIR_ENTRY_SIZE);
+    write_u16(entry, inode_num);
+    strncpy((char *)entry + DIR_NAME_OFFSET, name, DCACHE_NAME_LEN - 1);
+    bwrite(data_block_num, block);
+
+    dir_inode->size += DIR_ENTRY_SIZE;
+    imark_dirty(dir_inode);
+
+    // keep the index up to date, or build one once the directory is big enough
+    int entry_num = dir_inode->size / DIR_ENTRY_SIZE - 1;
+    int root = directory_index_root(dir_inode);
+    if(root != 0) {
+        dir_index_add(dir_inode, root, name, entry_num);
+    } else if(entry_num + 1 > directory_index_threshold) {
+        dir_index_build(dir_inode, 1);
+    }
+
+    // replaces any cached "no such entry" for the name
+    dcache_insert(dir_inode->inode_num, name, inode_num);
+    return 0;
+}
+
+static int make_directory(char *path) {
     char dirname[1024];
     char basename[1024];
 
     get_dirname(path, dirname);
     get_basename(path, basename);
+    if(strlen(basename) >= DCACHE_NAME_LEN) {
+        fprintf(stderr, "Error in directory_make: name %s is too long\n", basename);
+        return -1;
+    }
 
     // Find the inode for the parent directory that will hold the new entry
     struct inode *parent_inode = namei(dirname);
@@ -49,61 +353,83 @@ int directory_make(char *path) {
         fprintf(stderr, "Error finding parent inode in directory_make");
         return -1;
     }
+    // hold the parent from the lookup to the new entry, so no other thread
+    // can take the name in between
+    ilock(parent_inode);
+    if (directory_lookup(parent_inode, basename) != -1) {
+        fprintf(stderr, "Error in directory_make: %s already exists\n", path);
+        iunlock(parent_inode);
+        iput(parent_inode);
+        return -1;
+    }
 
     // Create a new inode for the new directory
     struct inode *new_dir_inode = ialloc();
     if (new_dir_inode == NULL) {
         fprintf(stderr, "Error allocating new directory inode in directory_make");
+        iunlock(parent_inode);
+        iput(parent_inode);
         return -1;
     }
 
-    // Create a new data block for the new directory entries
-    int block_num = alloc();
+    // Create a new data block for the new directory entries,
+    // placed near the parent's last data block
+    int parent_last_block = parent_inode->size > 0 ?
+        directory_block_num(parent_inode, (parent_inode->size - 1) / BLOCK_SIZE) : (int)parent_inode->block_ptr[0];
+    int block_num = alloc_near(parent_last_block);
     if (block_num == -1) {
         fprintf(stderr, "Error creating new data block for new dir in directory_make");
+        int inode_num = new_dir_inode->inode_num;
+        iput(new_dir_inode);
+        ifree(inode_num);
+        iunlock(parent_inode);
+        iput(parent_inode);
         return -1;
     }
 
     // initialize new dir inode
-    new_dir_inode->flags = 2;
+    new_dir_inode->flags = INODE_FLAG_DIR;
     new_dir_inode->size = DIR_ENTRY_SIZE * 2;
     new_dir_inode->link_count = 1;
     new_dir_inode->block_ptr[0] = block_num;
+    imark_dirty(new_dir_inode);
 
     // array to populate with new directory data
-    unsigned char new_dir_data_block[BLOCK_SIZE];
-
-    int entry_num = 0;
-    write_u16(new_dir_data_block + (entry_num * DIR_ENTRY_SIZE), new_dir_inode->inode_num);
-    strcpy((char *)new_dir_data_block + (entry_num * DIR_ENTRY_SIZE) + DIR_NAME_OFFSET, ".");
+    unsigned char new_dir_data_block[BLOCK_SIZE] = {0};
+    struct directory_entry entries[2] = {{new_dir_inode->inode_num, "."}, {parent_inode->inode_num, ".."}};
+    encode_dir_block(new_dir_data_block, entries, 2);
 
-    entry_num = 1;
-    write_u16(new_dir_data_block + (entry_num * DIR_ENTRY_SIZE), parent_inode->inode_num);
-    strcpy((char *)new_dir_data_block + (entry_num * DIR_ENTRY_SIZE) + DIR_NAME_OFFSET, "..");
-
-    // Write the new directory data block to disk
+    // Write the new directory's block, then link it into the parent
     bwrite(block_num, new_dir_data_block);
-
-    // From the parent directory inode, find the block that will contain the new directory entry
-    // Use the size and block_ptr fields
-    int data_block_index = parent_inode->size / BLOCK_SIZE;
-    int new_data_block_num = parent_inode->block_ptr[data_block_index];
-
-    // Read that block into memory and add the new directory entry to it
-    unsigned char block[BLOCK_SIZE] = {0};
-    bread(new_data_block_num, block);
-
-    write_u16(block + parent_inode->size, new_dir_inode->inode_num);
-    strcpy((char *)block + parent_inode->size + DIR_NAME_OFFSET, basename);
-
-    // Write that block to disk
-    bwrite(new_data_block_num, block);
-
-    parent_inode->size += DIR_ENTRY_SIZE;
+    if (directory_add_entry(parent_inode, basename, new_dir_inode->inode_num) == -1) {
+        fprintf(stderr, "Error adding %s to its parent directory in directory_make\n", basename);
+        bfree(block_num);
+        int inode_num = new_dir_inode->inode_num;
+        new_dir_inode->size = 0;
+        new_dir_inode->block_ptr[0] = 0;
+        imark_dirty(new_dir_inode);
+        iput(new_dir_inode);
+        ifree(inode_num);
+        iunlock(parent_inode);
+        iput(parent_inode);
+        return -1;
+    }
 
     // Release both the new and parent directory's incore inode
     iput(new_dir_inode);
+    iunlock(parent_inode);
     iput(parent_inode);
     
     return 0;
-}
\ No newline at end of file
+}
+
+// Makes a directory as one journal transaction: the inode and block maps,
+// the new directory's block and inode, and the parent's block and inode
+// reach the image together or not at all. Names of DCACHE_NAME_LEN or more
+// characters do not fit a directory entry and are refused with -1.
+int directory_make(char *path) {
+    journal_begin();
+    int ret = make_directory(path);
+    journal_end();
+    return ret;
+}
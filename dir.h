@@ -1,7 +1,25 @@
 #ifndef DIR_H
 #define DIR_H
 
+#define DIR_INDEX_MAGIC 0x58444953          // "SIDX"
+#define DIR_INDEX_ROOT_OFFSET 28            // u32 in the spare bytes of the "." entry
+#define DIR_INDEX_MAX_LEAVES ((BLOCK_SIZE - 8) / 4)
+#define DIR_INDEX_LEAF_SLOTS ((BLOCK_SIZE - 4) / 8)
+#define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / DIR_ENTRY_SIZE)
+#define DIR_INDEX_DEFAULT_THRESHOLD DIR_ENTRIES_PER_BLOCK
+#define DIR_DEFAULT_PREALLOC 8
+
+struct inode;
+
+char *get_dirname(const char *path, char *dirname);
+char *get_basename(const char *path, char *basename);
+int directory_lookup(struct inode *dir_inode, const char *name);
 int directory_make(char *path);
+int directory_add_entry(struct inode *dir_inode, const char *name, int inode_num);
+void directory_set_prealloc(int blocks);
+int directory_block_num(struct inode *dir_inode, int index);
+int directory_index_root(struct inode *dir_inode);
+void directory_set_index_threshold(int entries);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block.h"
+#include "free.h"
+#include "inode.h"
+#include "dir.h"
+#include "dcache.h"
+#include "file.h"
+#include "readahead.h"
+#include "journal.h"
+#include "image.h"
+
+// Regular files. A file's blocks are mapped through its inode with bmap():
+// 12 direct pointers and then one indirect block, for INODE_MAX_BLOCKS in
+// all. Writes allocate the blocks they need as contiguous runs, and reads
+// and writes move every block of a call with one bread_many()/bwrite_many(),
+// so sequential I/O turns into a few large transfers.
+//
+// Writes are buffered per open file and only given blocks when the buffer
+// is flushed: when it fills, when a write does not continue the buffered
+// data, and before reads, truncates and close. By then the allocator knows
+// how much to hand out, so a file written in small appends still ends up in
+// one contiguous run written with one large I/O, even while other files are
+// growing at the same time. Until it is flushed, buffered data is only
+// visible through the struct file that wrote it.
+
+static int write_buffer_blocks = FILE_WRITE_BUFFER_DEFAULT_BLOCKS;
+
+// Sets the write buffer size, in blocks, of files opened from now on.
+// 0 sends every write straight to its blocks.
+void file_set_write_buffer(int blocks) {
+    write_buffer_blocks = blocks > 0 ? blocks : 0;
+}
+
+static int create_file(char *path) {
+    char dirname[1024];
+    char basename[1024];
+    get_dirname(path, dirname);
+    get_basename(path, basename);
+    if(strlen(basename) >= DCACHE_NAME_LEN) {
+        fprintf(stderr, "Error in file_create: name %s is too long\n", basename);
+        return -1;
+    }
+
+    struct inode *parent_inode = namei(dirname);
+    if(parent_inode == NULL) {
+        fprintf(stderr, "Error finding parent inode in file_create\n");
+        return -1;
+    }
+    ilock(parent_inode);
+    if(parent_inode->flags != INODE_FLAG_DIR || directory_lookup(parent_inode, basename) != -1) {
+        fprintf(stderr, "Error in file_create: cannot create %s\n", path);
+        iunlock(parent_inode);
+        iput(parent_inode);
+        return -1;
+    }
+
+    struct inode *file_inode = ialloc();
+    if(file_inode == NULL) {
+        fprintf(stderr, "Error allocating inode in file_create\n");
+        iunlock(parent_inode);
+        iput(parent_inode);
+        return -1;
+    }
+    file_inode->flags = INODE_FLAG_FILE;
+    file_inode->link_count = 1;
+    imark_dirty(file_inode);
+
+    int ret = directory_add_entry(parent_inode, basename, file_inode->inode_num);
+    int inode_num = file_inode->inode_num;
+    iput(file_inode);
+    if(ret == -1) {
+        ifree(inode_num);
+    }
+    iunlock(parent_inode);
+    iput(parent_inode);
+    return ret;
+}
+
+// Creates an empty regular file, as one journal transaction. Returns 0, or
+// -1 if the parent directory does not exist, the name is taken or too long
+// for a directory entry, or there is no inode or room for it.
+int file_create(char *path) {
+    journal_begin();
+    int ret = create_file(path);
+    journal_end();
+    return ret;
+}
+
+// Opens a regular file for reading and writing, at offset 0.
+// Returns NULL if there is no such file or it is a directory.
+struct file *file_open(char *path) {
+    struct inode *in = namei(path);
+    if(in == NULL) {
+        return NULL;
+    }
+    if(in->flags != INODE_FLAG_FILE) {
+        iput(in);
+        return NULL;
+    }
+    struct file *f = malloc(sizeof(struct file));
+    if(f == NULL) {
+        iput(in);
+        return NULL;
+    }
+    f->inode = in;
+    f->offset = 0;
+    f->wbuf = NULL;
+    f->wbuf_offset = 0;
+    f->wbuf_len = 0;
+    // an operation that must be durable when it returns cannot be buffered
+    f->wbuf_cap = image_current()->durability == IMAGE_DURABLE_EACH_OP ? 0 : write_buffer_blocks * BLOCK_SIZE;
+    return f;
+}
+
+void file_close(struct file *f) {
+    if(file_flush(f) == -1) {
+        fprintf(stderr, "Error flushing file in file_close\n");
+    }
+    iput(f->inode);
+    free(f->wbuf);
+    free(f);
+}
+
+// Moves the file's offset. Returns 0, or -1 past the largest possible file.
+int file_seek(struct file *f, unsigned int offset) {
+    if(offset > (unsigned int)INODE_MAX_BLOCKS * BLOCK_SIZE) {
+        return -1;
+    }
+    f->offset = offset;
+    return 0;
+}
+
+// Undoes the first count entries of a failed file_map_range(): unmaps and
+// frees each block it allocated, and the indirect block if it made that too
+static void file_unmap_fresh(struct inode *in, int first, int count, int *block_nums,
+                             const unsigned char *fresh, int had_indirect) {
+    int nfreed = 0;
+    for(int k = 0; k < count; k++) {
+        if(fresh[k]) {
+            bmap_set(in, first + k, 0);
+            block_nums[nfreed++] = block_nums[k];
+        }
+    }
+    if(!had_indirect && in->indirect != 0) {
+        block_nums[nfreed++] = in->indirect;
+        in->indirect = 0;
+        imark_dirty(in);
+    }
+    bfree_many(block_nums, nfreed);
+}
+
+// Maps every block from first to last (inclusive) of the file, allocating
+// the missing ones. Each stretch of missing blocks is allocated as one run
+// straight after the block before it where possible. Marks freshly
+// allocated blocks in fresh. Returns 0, or -1 if the image filled up, in
+// which case the file is left mapped as it was.
+static int file_map_range(struct inode *in, int first, int last, int *block_nums, unsigned char *fresh) {
+    int had_indirect = in->indirect != 0;
+    int i = first;
+    while(i <= last) {
+        block_nums[i - first] = bmap(in, i);
+        fresh[i - first] = 0;
+        if(block_nums[i - first] != 0) {
+            i++;
+            continue;
+        }
+
+        int missing = 1;
+        while(i + missing <= last && bmap(in, i + missing) == 0) {
+            missing++;
+        }
+        int goal = i > 0 ? bmap(in, i - 1) + 1 : (int)in->block_ptr[0];
+        int n = missing;
+        int run = -1;
+        while(n > 0 && (run = alloc_run(n, goal, FREEMAP_FIRST_FIT)) == -1) {
+            n /= 2;
+        }
+        if(run == -1) {
+            file_unmap_fresh(in, first, i - first, block_nums, fresh, had_indirect);
+            return -1;
+        }
+        for(int j = 0; j < n; j++) {
+            if(bmap_set(in, i + j, run + j) == -1) {
+                bfree_run(run + j, n - j);
+                file_unmap_fresh(in, first, i + j - first, block_nums, fresh, had_indirect);
+                return -1;
+            }
+            block_nums[i + j - first] = run + j;
+            fresh[i + j - first] = 1;
+        }
+        i += n;
+    }
+    return 0;
+}
+
+// Reads up to len bytes at the file's offset into buf and advances the
+// offset. Holes read back as zeros. Returns the bytes read, 0 at the end,
+// or -1 if the file's buffered writes could not be flushed.
+int file_read(struct file *f, void *buf, int len) {
+    struct inode *in = f->inode;
+    if(file_flush(f) == -1) {
+        return -1;
+    }
+    ilock(in);
+    if(len <= 0 || f->offset >= in->size) {
+        iunlock(in);
+        return 0;
+    }
+    if((unsigned int)len > in->size - f->offset) {
+        len = in->size - f->offset;
+    }
+
+    int first = f->offset / BLOCK_SIZE;
+    int last = (f->offset + len - 1) / BLOCK_SIZE;
+    int count = last - first + 1;
+    int *block_nums = malloc(count * sizeof(int));
+    unsigned char **blocks = malloc(count * sizeof(unsigned char *));
+    unsigned char *bounce = malloc(2 * BLOCK_SIZE);
+    if(block_nums == NULL || blocks == NULL || bounce == NULL) {
+        perror("Error allocating file read\n");
+        exit(EXIT_FAILURE);
+    }
+
+    readahead(in, first, count, (in->size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+    // whole blocks land straight in buf; the partial ones at either end
+    // go through a bounce buffer
+    unsigned char *out = buf;
+    int head = f->offset % BLOCK_SIZE;
+    int tail = (f->offset + len) % BLOCK_SIZE;
+    int nreads = 0;
+    for(int i = first; i <= last; i++) {
+        int block_num = bmap(in, i);
+        long pos = (long)(i - first) * BLOCK_SIZE - head;
+        int partial = (i == first && head != 0) || (i == last && tail != 0);
+        if(block_num == 0) {
+            // a hole
+            long from = pos < 0 ? 0 : pos;
+            long to = pos + BLOCK_SIZE > len ? len : pos + BLOCK_SIZE;
+            memset(out + from, 0, to - from);
+            continue;
+        }
+        block_nums[nreads] = block_num;
+        blocks[nreads] = partial ? bounce + (i == first ? 0 : BLOCK_SIZE) : out + pos;
+        nreads++;
+    }
+    bread_many(block_nums, blocks, nreads);
+
+    if(head != 0 && bmap(in, first) != 0) {
+        int n = BLOCK_SIZE - head < len ? BLOCK_SIZE - head : len;
+        memcpy(out, bounce + head, n);
+    }
+    if(tail != 0 && bmap(in, last) != 0 && (last != first || head == 0)) {
+        long pos = (long)(last - first) * BLOCK_SIZE - head;
+        memcpy(out + pos, bounce + (last == first ? 0 : BLOCK_SIZE), tail);
+    }
+
+    free(block_nums);
+    free(blocks);
+    free(bounce);
+    iunlock(in);
+    f->offset += len;
+    return len;
+}
+
+// Writes len bytes from buf at offset straight to the file's blocks,
+// allocating the missing ones, and grows the file to cover them. The
+// allocation and the inode change are one journal transaction; the data
+// goes home around the journal. Returns 0, or -1 if the image is full.
+static int file_write_extent(struct inode *in, unsigned int offset, const void *buf, int len) {
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + len - 1) / BLOCK_SIZE;
+    int count = last - first + 1;
+    int *block_nums = malloc(count * sizeof(int));
+    unsigned char *fresh = malloc(count);
+    unsigned char **blocks = malloc(count * sizeof(unsigned char *));
+    unsigned char *bounce = malloc(2 * BLOCK_SIZE);
+    if(block_nums == NULL || fresh == NULL || blocks == NULL || bounce == NULL) {
+        perror("Error allocating file write\n");
+        exit(EXIT_FAILURE);
+    }
+    journal_begin();
+    ilock(in);
+    if(file_map_range(in, first, last, block_nums, fresh) == -1) {
+        iunlock(in);
+        journal_end();
+        free(block_nums);
+        free(fresh);
+        free(blocks);
+        free(bounce);
+        return -1;
+    }
+
+    // whole blocks go straight from buf; the partial ones at either end are
+    // read, patched and written back, unless they are brand new
+    const unsigned char *src = buf;
+    int head = offset % BLOCK_SIZE;
+    int tail = (offset + len) % BLOCK_SIZE;
+    for(int i = 0; i < count; i++) {
+        long pos = (long)i * BLOCK_SIZE - head;
+        int partial = (i == 0 && head != 0) || (i == count - 1 && tail != 0);
+        if(!partial) {
+            blocks[i] = (unsigned char *)src + pos;
+            continue;
+        }
+        unsigned char *b = bounce + (i == 0 ? 0 : BLOCK_SIZE);
+        if(fresh[i]) {
+            memset(b, 0, BLOCK_SIZE);
+        } else {
+            bread(block_nums[i], b);
+        }
+        long from = pos < 0 ? 0 : pos;
+        long to = pos + BLOCK_SIZE > len ? len : pos + BLOCK_SIZE;
+        memcpy(b + (from - pos), src + from, to - from);
+        blocks[i] = b;
+    }
+    bwrite_data_many(block_nums, blocks, count);
+
+    if(offset + len > in->size) {
+        in->size = offset + len;
+    }
+    imark_dirty(in);
+    iunlock(in);
+    journal_end();
+
+    free(block_nums);
+    free(fresh);
+    free(blocks);
+    free(bounce);
+    return 0;
+}
+
+// Returns how many blocks of a write may share one journal transaction, or
+// 0 for no limit. In the worst case every block needs a free-map block of
+// its own, and the indirect block and the inode come on top; together they
+// must fit the half of the journal journal_begin() leaves an operation.
+static int file_write_chunk_blocks(void) {
+    int room = journal_max_blocks() / 2 - 2;
+    if(journal_max_blocks() == 0 || (int)image_current()->sb.block_map_blocks <= room) {
+        return 0;
+    }
+    return room > 1 ? room : 1;
+}
+
+// Writes len bytes from buf at offset to the file's blocks as one or more
+// file_write_extent()s, each small enough for a journal transaction.
+// Returns 0, or -1 if the image is full.
+static int file_write_blocks(struct inode *in, unsigned int offset, const void *buf, int len) {
+    int chunk = file_write_chunk_blocks();
+    const unsigned char *src = buf;
+    while(len > 0) {
+        int n = len;
+        if(chunk > 0 && offset % BLOCK_SIZE + (unsigned int)n > (unsigned int)chunk * BLOCK_SIZE) {
+            n = chunk * BLOCK_SIZE - offset % BLOCK_SIZE;
+        }
+        if(file_write_extent(in, offset, src, n) == -1) {
+            return -1;
+        }
+        offset += n;
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Gives the file's buffered writes their blocks and writes them out.
+// Returns 0, or -1 if the image is full, in which case the buffered data
+// is dropped.
+int file_flush(struct file *f) {
+    if(f->wbuf_len == 0) {
+        return 0;
+    }
+    int ret = file_write_blocks(f->inode, f->wbuf_offset, f->wbuf, f->wbuf_len);
+    f->wbuf_len = 0;
+    return ret;
+}
+
+// Writes len bytes from buf at the file's offset and advances the offset,
+// growing the file as needed. Small writes that follow on from each other
+// are gathered in the file's write buffer. Returns the bytes written, or -1
+// if the file would outgrow its block pointers or the image is full.
+int file_write(struct file *f, const void *buf, int len) {
+    if(len <= 0) {
+        return 0;
+    }
+    if((unsigned long)f->offset + len > (unsigned long)INODE_MAX_BLOCKS * BLOCK_SIZE) {
+        return -1;
+    }
+
+    // only a write that carries on from the buffered data joins it
+    if(f->wbuf_len > 0 && (f->offset != f->wbuf_offset + f->wbuf_len || f->wbuf_len + len > f->wbuf_cap)) {
+        if(file_flush(f) == -1) {
+            return -1;
+        }
+    }
+    if(len >= f->wbuf_cap) {
+        if(file_write_blocks(f->inode, f->offset, buf, len) == -1) {
+            return -1;
+        }
+        f->offset += len;
+        return len;
+    }
+
+    if(f->wbuf == NULL) {
+        f->wbuf = malloc(f->wbuf_cap);
+        if(f->wbuf == NULL) {
+            perror("Error allocating file write buffer\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(f->wbuf_len == 0) {
+        f->wbuf_offset = f->offset;
+    }
+    memcpy(f->wbuf + f->wbuf_len, buf, len);
+    f->wbuf_len += len;
+    f->offset += len;
+    return len;
+}
+
+// Sets the file's size. Shrinking frees the blocks past the new end and
+// zeroes the rest of the last block; growing leaves a hole that reads back
+// as zeros. Returns 0, or -1 past the largest possible file.
+int file_truncate(struct file *f, unsigned int size) {
+    struct inode *in = f->inode;
+    if(size > (unsigned int)INODE_MAX_BLOCKS * BLOCK_SIZE || file_flush(f) == -1) {
+        return -1;
+    }
+    // the freed blocks and the inode change in one journal transaction
+    journal_begin();
+    ilock(in);
+    if(size < in->size) {
+        int keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int had = (in->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int *freed = malloc((had - keep + 1) * sizeof(int));
+        if(freed == NULL) {
+            perror("Error allocating file truncate\n");
+            exit(EXIT_FAILURE);
+        }
+        int nfreed = 0;
+        for(int i = keep; i < had; i++) {
+            int block_num = bmap(in, i);
+            if(block_num != 0) {
+                freed[nfreed++] = block_num;
+                bmap_set(in, i, 0);
+            }
+        }
+        if(keep <= INODE_PTR_COUNT && in->indirect != 0) {
+            freed[nfreed++] = in->indirect;
+            in->indirect = 0;
+        }
+        bfree_many(freed, nfreed);
+        free(freed);
+
+        int block_num = size % BLOCK_SIZE != 0 ? bmap(in, size / BLOCK_SIZE) : 0;
+        if(block_num != 0) {
+            unsigned char block[BLOCK_SIZE];
+            unsigned char *blocks[1] = {block};
+            bread(block_num, block);
+            memset(block + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+            bwrite_data_many(&block_num, blocks, 1);
+        }
+    }
+    in->size = size;
+    imark_dirty(in);
+    if(f->offset > size) {
+        f->offset = size;
+    }
+    iunlock(in);
+    journal_end();
+    return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef FILE_H
+#define FILE_H
+
+#define FILE_WRITE_BUFFER_DEFAULT_BLOCKS 64
+
+struct inode;
+
+struct file {
+    struct inode *inode;
+    unsigned int offset;
+    unsigned char *wbuf;        // written data not yet given blocks
+    unsigned int wbuf_offset;   // file offset of wbuf[0]
+    int wbuf_len;
+    int wbuf_cap;               // 0 when writes go straight through
+};
+
+int file_create(char *path);
+struct file *file_open(char *path);
+void file_close(struct file *f);
+int file_read(struct file *f, void *buf, int len);
+int file_write(struct file *f, const void *buf, int len);
+int file_seek(struct file *f, unsigned int offset);
+int file_truncate(struct file *f, unsigned int size);
+int file_flush(struct file *f);
+void file_set_write_buffer(int blocks);
+
+#endif
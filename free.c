@@ -1,19 +1,211 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "free.h"
+#include "block.h"
+#include "image.h"
 
 #define BLOCK_SIZE 4096
 // bits in 4096 byte block map are numbered 0 to 32767
+// bit n lives in byte n / 8, at bit position n % 8
 
-int find_low_clear_bit(unsigned char x)
-{
-    for (int i = 0; i < 8; i++) {
-        if (!(x & (1 << i))) {
-            return i;
+// Maps are scanned a 64-bit word at a time. Word w holds bits 64w to
+// 64w + 63 with bit 64w in its lowest position, so count-trailing-zeros of
+// the inverted word gives the first clear bit. On x86 an SSE2 or AVX2 pass
+// first skips over long stretches of completely full words.
+
+static int simd_level = -1;     // BITMAP_SIMD_*, -1 until first use
+static int has_popcnt = 0;
+
+static unsigned long long load_word(const unsigned char *map, int word) {
+    unsigned long long w;
+    memcpy(&w, map + word * 8, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+// Loads word w of a map of nbits bits, with any bits past the end
+// of the map reading as set so they are never reported free
+static unsigned long long load_word_masked(const unsigned char *map, int nbits, int word) {
+    int first_bit = word * 64;
+    if(first_bit + 64 <= nbits) {
+        return load_word(map, word);
+    }
+    unsigned long long w = 0;
+    int nbytes = (nbits - first_bit + 7) / 8;
+    for(int i = 0; i < nbytes; i++) {
+        w |= (unsigned long long)map[word * 8 + i] << (i * 8);
+    }
+    return w | (~0ULL << (nbits - first_bit));
+}
+
+// Returns the first word at or after word (and before end) that has a
+// clear bit, or end. Portable version.
+static int skip_full_scalar(const unsigned char *map, int word, int end) {
+    while(word < end && load_word(map, word) == ~0ULL) {
+        word++;
+    }
+    return word;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static int skip_full_sse2(const unsigned char *map, int word, int end) {
+    const __m128i ones = _mm_set1_epi8(-1);
+    while(word + 2 <= end) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(map + word * 8));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xffff) {
+            break;
+        }
+        word += 2;
+    }
+    return skip_full_scalar(map, word, end);
+}
+
+__attribute__((target("avx2")))
+static int skip_full_avx2(const unsigned char *map, int word, int end) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    while(word + 8 <= end) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(map + word * 8));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(map + word * 8 + 32));
+        if(!_mm256_testc_si256(_mm256_and_si256(a, b), ones)) {
+            break;
+        }
+        word += 8;
+    }
+    while(word + 4 <= end) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(map + word * 8));
+        if(!_mm256_testc_si256(v, ones)) {
+            break;
         }
+        word += 4;
+    }
+    return skip_full_scalar(map, word, end);
+}
+#endif
+
+// Picks the widest scanner the CPU supports, capped at level.
+// Returns the level actually in use.
+int bitmap_use_simd(int level) {
+    int best = BITMAP_SIMD_NONE;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")) {
+        best = BITMAP_SIMD_SSE2;
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        best = BITMAP_SIMD_AVX2;
+    }
+    has_popcnt = __builtin_cpu_supports("popcnt");
+#endif
+    simd_level = level < best ? level : best;
+    return simd_level;
+}
+
+static int skip_full(const unsigned char *map, int word, int end) {
+    if(simd_level == -1) {
+        bitmap_use_simd(BITMAP_SIMD_AVX2);
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if(simd_level == BITMAP_SIMD_AVX2) {
+        return skip_full_avx2(map, word, end);
+    }
+    if(simd_level == BITMAP_SIMD_SSE2) {
+        return skip_full_sse2(map, word, end);
+    }
+#endif
+    return skip_full_scalar(map, word, end);
+}
+
+// Returns the number of the first clear bit at or after start in a map of
+// nbits bits, or -1 if every bit from start on is set
+int bitmap_find_clear(const unsigned char *map, int nbits, int start) {
+    if(start < 0) {
+        start = 0;
+    }
+    if(start >= nbits) {
+        return -1;
+    }
+
+    int nwords = (nbits + 63) / 64;
+    int full_words = nbits / 64;
+    int word = start / 64;
+
+    // the first word may begin part way in; treat the bits before start as set
+    unsigned long long w = load_word_masked(map, nbits, word) | ((1ULL << (start % 64)) - 1);
+    if(w != ~0ULL) {
+        return word * 64 + __builtin_ctzll(~w);
+    }
+
+    word = skip_full(map, word + 1, full_words);
+    while(word < nwords) {
+        w = load_word_masked(map, nbits, word);
+        if(w != ~0ULL) {
+            return word * 64 + __builtin_ctzll(~w);
+        }
+        word++;
     }
     return -1;
 }
 
+static int count_set_scalar(const unsigned char *map, int nwords) {
+    int set = 0;
+    for(int word = 0; word < nwords; word++) {
+        set += __builtin_popcountll(load_word(map, word));
+    }
+    return set;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// the same loop, but built to use the popcnt instruction
+__attribute__((target("popcnt")))
+static int count_set_popcnt(const unsigned char *map, int nwords) {
+    int set = 0;
+    for(int word = 0; word < nwords; word++) {
+        set += __builtin_popcountll(load_word(map, word));
+    }
+    return set;
+}
+#endif
+
+// Returns how many bits of a map of nbits bits are clear
+int bitmap_count_clear(const unsigned char *map, int nbits) {
+    if(simd_level == -1) {
+        bitmap_use_simd(BITMAP_SIMD_AVX2);
+    }
+    int full_words = nbits / 64;
+    int set;
+#if defined(__x86_64__) || defined(__i386__)
+    if(has_popcnt) {
+        set = count_set_popcnt(map, full_words);
+    } else {
+        set = count_set_scalar(map, full_words);
+    }
+#else
+    set = count_set_scalar(map, full_words);
+#endif
+    if(full_words * 64 < nbits) {
+        // bits past the end of the map load as set, so leave them out
+        int tail_bits = nbits - full_words * 64;
+        set += __builtin_popcountll(load_word_masked(map, nbits, full_words)) - (64 - tail_bits);
+    }
+    return nbits - set;
+}
+
+int find_low_clear_bit(unsigned char x)
+{
+    if(x == 0xff) {
+        return -1;
+    }
+    return __builtin_ctz(~x & 0xff);
+}
+
 // set a specific bit to the value in set (0 or 1)
 void set_free(unsigned char *block, int num, int set) {
     int byte_num = num / 8;
@@ -32,14 +224,449 @@ void set_free(unsigned char *block, int num, int set) {
 
 // find a 0 bit and return its index (byte num that corresponds to this bit)
 // returns -1 if no free bit found
-int find_free(unsigned char *block) {
-    int index = -1;
-    for(int i = 0; i < BLOCK_SIZE; i++) {
-        int free_bit = find_low_clear_bit(block[i]);
-        if(free_bit != -1) {
-            index = i * 8 + free_bit;
+int find_free(const unsigned char *block) {
+    return bitmap_find_clear(block, BLOCK_SIZE * 8, 0);
+}
+
+// find the first 0 bit at or after hint, so a caller that remembers where
+// the last free bit was does not rescan the full part of the map
+// returns -1 if no free bit found from hint on
+int find_next_free(const unsigned char *block, int hint) {
+    return bitmap_find_clear(block, BLOCK_SIZE * 8, hint);
+}
+
+// count the 0 bits in a block map
+int count_free(const unsigned char *block) {
+    return bitmap_count_clear(block, BLOCK_SIZE * 8);
+}
+
+// ---- resident free maps with a summary hierarchy ----
+//
+// A freemap keeps a copy of an on-disk free map in memory together with
+// summary levels above it: bit w of summary[0] is set when map word w has
+// a clear bit, and bit i of summary[k + 1] is set when word i of summary[k]
+// is non-zero. Finding a free bit walks down from the single top word with
+// one count-trailing-zeros per level, however full the map is.
+// The on-disk map stays the source of truth: every change is written back
+// through bwrite(), and a freemap reloads itself when its blocks are
+// written by anyone else or the image changes.
+
+static struct freemap *freemaps = NULL;     // every freemap that has been loaded
+static pthread_mutex_t freemaps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long map_word(struct freemap *fm, int word) {
+    return load_word_masked(fm->map, fm->nbits, word);
+}
+
+static void summary_set(struct freemap *fm, int level, int index, int on) {
+    unsigned long long *w = &fm->summary[level][index / 64];
+    unsigned long long before = *w;
+    if(on) {
+        *w |= 1ULL << (index % 64);
+    } else {
+        *w &= ~(1ULL << (index % 64));
+    }
+    // the level above only cares whether this word went to or from zero
+    if(level + 1 < fm->nlevels && (before != 0) != (*w != 0)) {
+        summary_set(fm, level + 1, index / 64, *w != 0);
+    }
+}
+
+// Recomputes the summary bit for one map word after the map changed
+static void summary_update(struct freemap *fm, int word) {
+    summary_set(fm, 0, word, map_word(fm, word) != ~0ULL);
+}
+
+static void freemap_release(struct freemap *fm) {
+    free(fm->map);
+    fm->map = NULL;
+    free(fm->dirty);
+    fm->dirty = NULL;
+    for(int level = 0; level < FREEMAP_MAX_LEVELS; level++) {
+        free(fm->summary[level]);
+        fm->summary[level] = NULL;
+    }
+    __atomic_store_n(&fm->loaded, 0, __ATOMIC_RELAXED);
+}
+
+// Reads the on-disk map into memory and builds the summary levels
+static int freemap_load(struct freemap *fm, struct image *img) {
+    if(!fm->registered) {
+        pthread_mutex_lock(&freemaps_lock);
+        fm->next = freemaps;
+        __atomic_store_n(&freemaps, fm, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&freemaps_lock);
+        fm->registered = 1;
+    }
+    freemap_release(fm);
+    fm->layout(img, &fm->first_block, &fm->nbits);
+
+    int map_blocks = (fm->nbits + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8);
+    fm->map = malloc((size_t)map_blocks * BLOCK_SIZE);
+    fm->dirty = calloc(map_blocks, 1);
+    if(fm->map == NULL || fm->dirty == NULL) {
+        freemap_release(fm);
+        return -1;
+    }
+    for(int i = 0; i < map_blocks; i++) {
+        bread_img(img, fm->first_block + i, fm->map + (size_t)i * BLOCK_SIZE);
+    }
+    // the bits past the end of the map in its last block are never free
+    for(int i = fm->nbits; i < map_blocks * BLOCK_SIZE * 8; i++) {
+        set_free(fm->map, i, 1);
+    }
+
+    // size the levels until one word covers everything below it
+    int entries = (fm->nbits + 63) / 64;
+    fm->nlevels = 0;
+    do {
+        int words = (entries + 63) / 64;
+        fm->summary[fm->nlevels] = calloc(words, sizeof(unsigned long long));
+        if(fm->summary[fm->nlevels] == NULL) {
+            freemap_release(fm);
+            return -1;
+        }
+        fm->summary_words[fm->nlevels] = words;
+        fm->nlevels++;
+        entries = words;
+    } while(entries > 1 && fm->nlevels < FREEMAP_MAX_LEVELS);
+
+    int nwords = (fm->nbits + 63) / 64;
+    for(int word = 0; word < nwords; word++) {
+        if(map_word(fm, word) != ~0ULL) {
+            summary_set(fm, 0, word, 1);
+        }
+    }
+    fm->img = img;
+    __atomic_store_n(&fm->loaded, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Locks the freemap and makes sure its resident copy belongs to the
+// current image. Returns 0 with the lock held, or -1 without it. The lock
+// covers a whole allocation or free, from the search to the write-back, so
+// threads never hand out the same bit or write a map block half changed.
+static int freemap_lock(struct freemap *fm) {
+    struct image *img = image_current();
+    pthread_mutex_lock(&fm->lock);
+    if(__atomic_load_n(&fm->loaded, __ATOMIC_RELAXED) && fm->img == img) {
+        return 0;
+    }
+    if(freemap_load(fm, img) == -1) {
+        pthread_mutex_unlock(&fm->lock);
+        return -1;
+    }
+    return 0;
+}
+
+// Returns the first index at or after index whose bit is set in summary
+// level, asking the level above to skip words that are all zero
+static int summary_next(struct freemap *fm, int level, int index) {
+    int limit = fm->summary_words[level] * 64;
+    while(index < limit) {
+        int w = index / 64;
+        unsigned long long bits = fm->summary[level][w] & (~0ULL << (index % 64));
+        if(bits != 0) {
+            return w * 64 + __builtin_ctzll(bits);
+        }
+        if(level + 1 < fm->nlevels) {
+            int next = summary_next(fm, level + 1, w + 1);
+            if(next == -1) {
+                return -1;
+            }
+            index = next * 64;
+        } else {
+            index = (w + 1) * 64;
+        }
+    }
+    return -1;
+}
+
+// Returns the first clear bit at or after start, or -1 if there is none
+static int freemap_find(struct freemap *fm, int start) {
+    if(start < 0) {
+        start = 0;
+    }
+    if(start >= fm->nbits) {
+        return -1;
+    }
+    int word = start / 64;
+    unsigned long long w = map_word(fm, word) | ((1ULL << (start % 64)) - 1);
+    if(w != ~0ULL) {
+        return word * 64 + __builtin_ctzll(~w);
+    }
+    word = summary_next(fm, 0, word + 1);
+    if(word == -1) {
+        return -1;
+    }
+    return word * 64 + __builtin_ctzll(~map_word(fm, word));
+}
+
+// Writes every map block changed since the last flush back out, once
+static void freemap_flush(struct freemap *fm) {
+    int map_blocks = (fm->nbits + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8);
+    __atomic_store_n(&fm->writing, 1, __ATOMIC_RELAXED);
+    for(int i = 0; i < map_blocks; i++) {
+        if(fm->dirty[i]) {
+            bwrite_img(fm->img, fm->first_block + i, fm->map + (size_t)i * BLOCK_SIZE);
+            fm->dirty[i] = 0;
+        }
+    }
+    __atomic_store_n(&fm->writing, 0, __ATOMIC_RELAXED);
+}
+
+// Sets or clears bit num in the resident map and its summary, and marks
+// its map block dirty
+static void freemap_set(struct freemap *fm, int num, int set) {
+    set_free(fm->map, num, set);
+    summary_update(fm, num / 64);
+    fm->dirty[num / (BLOCK_SIZE * 8)] = 1;
+}
+
+// Sets or clears n bits starting at first, updating each summary word and
+// dirty flag once rather than once per bit
+static void freemap_set_range(struct freemap *fm, int first, int n, int set) {
+    for(int i = first; i < first + n; i++) {
+        set_free(fm->map, i, set);
+    }
+    for(int word = first / 64; word <= (first + n - 1) / 64; word++) {
+        summary_update(fm, word);
+    }
+    int bits_per_block = BLOCK_SIZE * 8;
+    for(int b = first / bits_per_block; b <= (first + n - 1) / bits_per_block; b++) {
+        fm->dirty[b] = 1;
+    }
+}
+
+// Marks the first free bit at or after hint as in use and writes the map
+// back. Returns the bit number, or -1 if nothing from hint on is free.
+int freemap_alloc_from(struct freemap *fm, int hint) {
+    if(freemap_lock(fm) == -1) {
+        return -1;
+    }
+    int num = freemap_find(fm, hint);
+    if(num != -1) {
+        freemap_set(fm, num, 1);
+        freemap_flush(fm);
+    }
+    pthread_mutex_unlock(&fm->lock);
+    return num;
+}
+
+int freemap_alloc(struct freemap *fm) {
+    return freemap_alloc_from(fm, 0);
+}
+
+// Marks bit num free again and writes the map back
+void freemap_free(struct freemap *fm, int num) {
+    // nbits is only the current image's once the map is locked and loaded
+    if(num < 0 || freemap_lock(fm) == -1) {
+        return;
+    }
+    if(num < fm->nbits) {
+        freemap_set(fm, num, 0);
+        freemap_flush(fm);
+    }
+    pthread_mutex_unlock(&fm->lock);
+}
+
+// Marks the first n free bits at or after hint as in use, storing them in
+// nums, and writes the map back once. Either all n are allocated or, if
+// fewer than n bits are free from hint on, none are and -1 is returned.
+int freemap_alloc_many(struct freemap *fm, int *nums, int n, int hint) {
+    if(n < 0 || freemap_lock(fm) == -1) {
+        return -1;
+    }
+    int pos = hint;
+    for(int i = 0; i < n; i++) {
+        nums[i] = freemap_find(fm, pos);
+        if(nums[i] == -1) {
+            // put back what was taken; the map on disk was never touched
+            for(int j = 0; j < i; j++) {
+                freemap_set(fm, nums[j], 0);
+            }
+            memset(fm->dirty, 0, (fm->nbits + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8));
+            pthread_mutex_unlock(&fm->lock);
+            return -1;
+        }
+        freemap_set(fm, nums[i], 1);
+        pos = nums[i] + 1;
+    }
+    freemap_flush(fm);
+    pthread_mutex_unlock(&fm->lock);
+    return n;
+}
+
+// Marks every bit in nums free again and writes the map back once
+void freemap_free_many(struct freemap *fm, const int *nums, int n) {
+    if(freemap_lock(fm) == -1) {
+        return;
+    }
+    for(int i = 0; i < n; i++) {
+        if(nums[i] >= 0 && nums[i] < fm->nbits) {
+            freemap_set(fm, nums[i], 0);
+        }
+    }
+    freemap_flush(fm);
+    pthread_mutex_unlock(&fm->lock);
+}
+
+// Returns the first set bit at or after start, or nbits if there is none
+static int freemap_find_set(struct freemap *fm, int start) {
+    int nwords = (fm->nbits + 63) / 64;
+    int word = start / 64;
+    unsigned long long w = map_word(fm, word) & (~0ULL << (start % 64));
+    while(w == 0) {
+        if(++word >= nwords) {
+            return fm->nbits;
+        }
+        w = map_word(fm, word);
+    }
+    int bit = word * 64 + __builtin_ctzll(w);
+    return bit < fm->nbits ? bit : fm->nbits;
+}
+
+// First fit: the first run of n free bits at or after hint, wrapping
+// around to the start of the map if nothing past hint fits
+static int find_run_first_fit(struct freemap *fm, int n, int hint) {
+    for(int pass = 0; pass < 2; pass++) {
+        int pos = pass == 0 ? hint : 0;
+        int end = pass == 0 ? fm->nbits : hint + n - 1;
+        while(pos < end) {
+            int start = freemap_find(fm, pos);
+            if(start == -1 || start >= end) {
+                break;
+            }
+            int stop = freemap_find_set(fm, start);
+            if(stop - start >= n) {
+                return start;
+            }
+            pos = stop;
+        }
+    }
+    return -1;
+}
+
+// Best fit: the smallest free run that holds n bits, leaving the big runs
+// alone for big requests. Ties go to the run closest to hint.
+static int find_run_best_fit(struct freemap *fm, int n, int hint) {
+    int best = -1;
+    int best_len = 0;
+    int pos = 0;
+    while(pos < fm->nbits) {
+        int start = freemap_find(fm, pos);
+        if(start == -1) {
             break;
         }
+        int stop = freemap_find_set(fm, start);
+        int len = stop - start;
+        if(len >= n) {
+            int better = best == -1 || len < best_len ||
+                (len == best_len && abs(start - hint) < abs(best - hint));
+            if(better) {
+                best = start;
+                best_len = len;
+            }
+            if(len == n && start >= hint) {
+                break;      // an exact fit past the hint cannot be beaten
+            }
+        }
+        pos = stop;
     }
-    return index;
-}
\ No newline at end of file
+    return best;
+}
+
+// Marks n contiguous free bits as in use and writes the map back, touching
+// each on-disk map block once. policy is FREEMAP_FIRST_FIT or
+// FREEMAP_BEST_FIT, and hint is where a first-fit search starts.
+// Returns the first bit of the run, or -1 if no run of n bits is free.
+int freemap_alloc_run(struct freemap *fm, int n, int hint, int policy) {
+    if(n <= 0 || freemap_lock(fm) == -1) {
+        return -1;
+    }
+    if(hint < 0 || hint >= fm->nbits) {
+        hint = 0;
+    }
+    int start = policy == FREEMAP_BEST_FIT ?
+        find_run_best_fit(fm, n, hint) : find_run_first_fit(fm, n, hint);
+    if(start != -1) {
+        freemap_set_range(fm, start, n, 1);
+        freemap_flush(fm);
+    }
+    pthread_mutex_unlock(&fm->lock);
+    return start;
+}
+
+// Marks n bits starting at first free again and writes the map back
+void freemap_free_run(struct freemap *fm, int first, int n) {
+    if(first < 0 || n <= 0 || freemap_lock(fm) == -1) {
+        return;
+    }
+    if(first + n <= fm->nbits) {
+        freemap_set_range(fm, first, n, 0);
+        freemap_flush(fm);
+    }
+    pthread_mutex_unlock(&fm->lock);
+}
+
+// Fills in how the free space is laid out: how many bits are free, in how
+// many separate runs, and how long the longest run is
+void freemap_stats(struct freemap *fm, struct freemap_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if(freemap_lock(fm) == -1) {
+        return;
+    }
+    stats->free_bits = bitmap_count_clear(fm->map, fm->nbits);
+    int pos = 0;
+    while(pos < fm->nbits) {
+        int start = freemap_find(fm, pos);
+        if(start == -1) {
+            break;
+        }
+        int stop = freemap_find_set(fm, start);
+        stats->free_runs++;
+        if(stop - start > stats->largest_run) {
+            stats->largest_run = stop - start;
+        }
+        pos = stop;
+    }
+    // 0 when all free space is one run, approaching 1 as it splinters
+    if(stats->free_bits > 0) {
+        stats->fragmentation = 1.0 - (double)stats->largest_run / stats->free_bits;
+    }
+    pthread_mutex_unlock(&fm->lock);
+}
+
+// Drops the resident copy; it is reloaded from disk on next use
+void freemap_invalidate(struct freemap *fm) {
+    pthread_mutex_lock(&fm->lock);
+    __atomic_store_n(&fm->loaded, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fm->lock);
+}
+
+// Called for every block written through the block layer. A write to a
+// free map's blocks by anyone but the freemap itself makes its copy stale.
+// This runs under the writes a freemap makes while holding its own lock,
+// so it takes no freemap locks; loaded and writing are only ever touched
+// atomically instead.
+void freemap_block_written(struct image *img, int block_num) {
+    for(struct freemap *fm = __atomic_load_n(&freemaps, __ATOMIC_ACQUIRE); fm != NULL; fm = fm->next) {
+        int map_blocks = (fm->nbits + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8);
+        int loaded = __atomic_load_n(&fm->loaded, __ATOMIC_RELAXED);
+        int writing = __atomic_load_n(&fm->writing, __ATOMIC_RELAXED);
+        if(loaded && !writing && fm->img == img &&
+                block_num >= fm->first_block && block_num < fm->first_block + map_blocks) {
+            __atomic_store_n(&fm->loaded, 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Called when an image is closed or rewritten from scratch
+void freemap_forget_image(struct image *img) {
+    for(struct freemap *fm = freemaps; fm != NULL; fm = fm->next) {
+        if(fm->img == img) {
+            __atomic_store_n(&fm->loaded, 0, __ATOMIC_RELAXED);
+            fm->img = NULL;
+        }
+    }
+}
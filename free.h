@@ -1,8 +1,67 @@
 #ifndef FREE_H
 #define FREE_H
 
+#include <pthread.h>
+
+#define BITMAP_SIMD_NONE 0
+#define BITMAP_SIMD_SSE2 1
+#define BITMAP_SIMD_AVX2 2
+
+#define FREEMAP_MAX_LEVELS 4
+
+#define FREEMAP_FIRST_FIT 0
+#define FREEMAP_BEST_FIT 1
+
+struct image;
+
+// In-memory copy of an on-disk free map with a summary hierarchy on top
+struct freemap {
+    int first_block;        // first on-disk block of the map
+    int nbits;
+    // fills in first_block and nbits for an image before its map is loaded
+    void (*layout)(struct image *img, int *first_block, int *nbits);
+    int loaded;
+    int writing;            // set while the freemap writes its own blocks
+    int registered;
+    struct image *img;      // image the resident copy was loaded from
+    unsigned char *map;
+    unsigned char *dirty;   // one flag per map block changed since the last flush
+    unsigned long long *summary[FREEMAP_MAX_LEVELS];
+    int summary_words[FREEMAP_MAX_LEVELS];
+    int nlevels;
+    struct freemap *next;
+    pthread_mutex_t lock;   // held for each allocation or free
+};
+
+struct freemap_stats {
+    int free_bits;
+    int free_runs;          // separate stretches of free bits
+    int largest_run;
+    double fragmentation;   // 1 - largest_run / free_bits
+};
+
+#define FREEMAP_INIT(layout) { 0, 0, (layout), 0, 0, 0, NULL, NULL, NULL, {NULL}, {0}, 0, NULL, PTHREAD_MUTEX_INITIALIZER }
+
 int find_low_clear_bit(unsigned char x);
-int set_free(unsigned char *block, int num, int set);
-int find_free(unsigned char *block);
+void set_free(unsigned char *block, int num, int set);
+int find_free(const unsigned char *block);
+int find_next_free(const unsigned char *block, int hint);
+int count_free(const unsigned char *block);
+
+int bitmap_find_clear(const unsigned char *map, int nbits, int start);
+int bitmap_count_clear(const unsigned char *map, int nbits);
+int bitmap_use_simd(int level);
+
+int freemap_alloc(struct freemap *fm);
+int freemap_alloc_from(struct freemap *fm, int hint);
+void freemap_free(struct freemap *fm, int num);
+int freemap_alloc_many(struct freemap *fm, int *nums, int n, int hint);
+void freemap_free_many(struct freemap *fm, const int *nums, int n);
+int freemap_alloc_run(struct freemap *fm, int n, int hint, int policy);
+void freemap_free_run(struct freemap *fm, int first, int n);
+void freemap_stats(struct freemap *fm, struct freemap_stats *stats);
+void freemap_invalidate(struct freemap *fm);
+void freemap_block_written(struct image *img, int block_num);
+void freemap_forget_image(struct image *img);
 
 #endif
\ No newline at end of file
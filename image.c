@@ -1,35 +1,288 @@
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#include "image.h"
+#include "free.h"
+#include "inode.h"
+#include "dcache.h"
+#include "journal.h"
+#include "block.h"
 
-// represents open file (set within image_open())
-int image_fd;
+// the image opened with image_open(), used by bread()/bwrite()
+static struct image *current_image = NULL;
 
+void image_default_opts(struct image_opts *opts) {
+    opts->mode = IMAGE_MODE_CACHED;
+    opts->cache_blocks = BCACHE_DEFAULT_BLOCKS;
+    opts->msync_policy = IMAGE_MSYNC_SYNC;
+    opts->map_blocks = 0;
+    opts->durability = IMAGE_DURABLE_EXPLICIT;
+    opts->sync_ms = IMAGE_DEFAULT_SYNC_MS;
+    opts->sync_writes = IMAGE_DEFAULT_SYNC_WRITES;
+}
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// IMAGE_DURABLE_PERIODIC's background thread. It sleeps until sync_ms
+// after the last sync and then syncs if anything was written since, so a
+// write is durable within sync_ms even if no other operation follows it.
+static void *image_flusher(void *arg) {
+    struct image *img = arg;
+    pthread_mutex_lock(&img->flush_lock);
+    while(!img->flusher_stop) {
+        double last_sync;
+        __atomic_load(&img->last_sync, &last_sync, __ATOMIC_RELAXED);
+        double due = last_sync + img->sync_ms / 1000.0;
+        double now = monotonic_seconds();
+        if(now >= due) {
+            if(__atomic_load_n(&img->unsynced_writes, __ATOMIC_RELAXED) > 0) {
+                image_sync_img(img);
+                continue;
+            }
+            // nothing to sync yet; a write from now on waits at most this long
+            due = now + img->sync_ms / 1000.0;
+        }
+        struct timespec ts;
+        ts.tv_sec = (time_t)due;
+        ts.tv_nsec = (long)((due - ts.tv_sec) * 1e9);
+        pthread_cond_timedwait(&img->flush_wake, &img->flush_lock, &ts);
+    }
+    pthread_mutex_unlock(&img->flush_lock);
+    return NULL;
+}
+
+// Starts the flusher for an IMAGE_DURABLE_PERIODIC image. Without one the
+// time bound is still checked as each operation finishes.
+static void image_start_flusher(struct image *img) {
+    if(img->durability != IMAGE_DURABLE_PERIODIC || img->sync_ms <= 0) {
+        return;
+    }
+    if(pthread_create(&img->flusher, NULL, image_flusher, img) != 0) {
+        fprintf(stderr, "Error starting image flusher, syncing as operations finish\n");
+        return;
+    }
+    img->flusher_running = 1;
+}
+
+// Stops the flusher, letting a sync it is in the middle of finish first
+static void image_stop_flusher(struct image *img) {
+    if(!img->flusher_running) {
+        return;
+    }
+    pthread_mutex_lock(&img->flush_lock);
+    img->flusher_stop = 1;
+    pthread_cond_signal(&img->flush_wake);
+    pthread_mutex_unlock(&img->flush_lock);
+    pthread_join(img->flusher, NULL);
+    img->flusher_running = 0;
+}
+
+// Maps the whole image, growing the file first if it is smaller than
+// the requested mapping so that no mapped page lies past end of file
+static int map_image(struct image *img, int map_blocks) {
+    struct stat st;
+    if(fstat(img->fd, &st) == -1) {
+        perror("Error getting image size\n");
+        return -1;
+    }
+    if(map_blocks <= 0) {
+        map_blocks = IMAGE_DEFAULT_MAP_BLOCKS;
+    }
+    int file_blocks = (st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if(file_blocks > map_blocks) {
+        map_blocks = file_blocks;
+    }
+    if(st.st_size < (off_t)map_blocks * BLOCK_SIZE &&
+            ftruncate(img->fd, (off_t)map_blocks * BLOCK_SIZE) == -1) {
+        perror("Error growing image for mapping\n");
+        return -1;
+    }
+
+    void *map = mmap(NULL, (size_t)map_blocks * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, img->fd, 0);
+    if(map == MAP_FAILED) {
+        perror("Error mapping image\n");
+        return -1;
+    }
+    img->map = map;
+    img->map_blocks = map_blocks;
+    return 0;
+}
 
 // Opens the image file of the given name,
 // creating it if it doesn't exist,
-// and truncating it to 0 size if truncate is true
-int image_open(char *filename, int truncate) {
+// and truncating it to 0 size if truncate is true.
+// Anything committed to its journal is replayed first.
+// opts may be NULL to get image_default_opts().
+// Returns a new image handle, or NULL on failure.
+struct image *image_attach_opts(char *filename, int truncate, struct image_opts *opts) {
+    struct image_opts defaults;
+    if(opts == NULL) {
+        image_default_opts(&defaults);
+        opts = &defaults;
+    }
+
+    int flags = O_RDWR | O_CREAT;
     if(truncate) {
-        image_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
-        if(image_fd == -1) {
-            perror("Error opening file\n");
-        }
+        flags |= O_TRUNC;
+    }
+    int fd = open(filename, flags, 0600);
+    if(fd == -1) {
+        perror("Error opening file\n");
+        return NULL;
     }
-    else {
-        image_fd = open(filename, O_RDWR | O_CREAT, 0600);
-        if(image_fd == -1) {
-            perror("Error opening file\n");
+
+    struct image *img = calloc(1, sizeof(struct image));
+    if(img == NULL) {
+        perror("Error allocating image\n");
+        close(fd);
+        return NULL;
+    }
+    img->fd = fd;
+    img->mode = opts->mode;
+    img->msync_policy = opts->msync_policy;
+    img->durability = opts->durability;
+    img->sync_ms = opts->sync_ms;
+    img->sync_writes = opts->sync_writes;
+    img->last_sync = monotonic_seconds();
+    pthread_mutex_init(&img->cache.lock, NULL);
+    pthread_cond_init(&img->cache.io_done, NULL);
+    pthread_mutex_init(&img->flush_lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&img->flush_wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if(img->mode == IMAGE_MODE_MMAP) {
+        // the mapping is the cache, so no block cache is set up
+        if(map_image(img, opts->map_blocks) == -1) {
+            image_detach(img);
+            return NULL;
         }
+    } else if(bcache_init(img, opts->cache_blocks) == -1) {
+        fprintf(stderr, "Error allocating block cache, running uncached\n");
     }
-    return image_fd;
+    superblock_load(img);
+    if(journal_load(img) == -1) {
+        image_detach(img);
+        return NULL;
+    }
+    image_start_flusher(img);
+    return img;
 }
 
-// Closes the image file
-int image_close(void){
-    int ret = close(image_fd);
+struct image *image_attach(char *filename, int truncate) {
+    return image_attach_opts(filename, truncate, NULL);
+}
+
+// Flushes the image's block cache or mapping, closes the file and frees the handle
+int image_detach(struct image *img) {
+    image_stop_flusher(img);
+    freemap_forget_image(img);
+    isync_image(img);
+    journal_destroy(img);
+    inode_forget_image(img);
+    dcache_forget_image(img);
+    bcache_destroy(img);
+    if(img->map != NULL) {
+        if(img->msync_policy != IMAGE_MSYNC_NONE) {
+            msync(img->map, (size_t)img->map_blocks * BLOCK_SIZE, MS_SYNC);
+        }
+        munmap(img->map, (size_t)img->map_blocks * BLOCK_SIZE);
+    }
+    int ret = close(img->fd);
     if(ret == -1) {
         perror("Error closing file\n");
     }
+    pthread_cond_destroy(&img->cache.io_done);
+    pthread_mutex_destroy(&img->cache.lock);
+    pthread_cond_destroy(&img->flush_wake);
+    pthread_mutex_destroy(&img->flush_lock);
+    free(img);
     return ret;
+}
+
+// Makes everything written to the image so far durable: the changed
+// inodes, the running journal transaction, and every cached or mapped
+// block. A journal commit syncs the blocks written home before it and
+// then itself, which covers everything; otherwise one fdatasync() does.
+// Does nothing under IMAGE_DURABLE_NONE beyond handing the blocks to the
+// kernel.
+void image_sync_img(struct image *img) {
+    isync_image(img);
+    if(!journal_commit_img(img)) {
+        bsync_img(img);
+        if(img->map != NULL && img->durability != IMAGE_DURABLE_NONE && img->msync_policy != IMAGE_MSYNC_SYNC &&
+                msync(img->map, (size_t)img->map_blocks * BLOCK_SIZE, MS_SYNC) == -1) {
+            perror("Error syncing image\n");
+            exit(EXIT_FAILURE);
+        }
+        block_sync_raw(img);
+    }
+    // other threads may be counting writes or syncing too
+    double now = monotonic_seconds();
+    __atomic_store_n(&img->unsynced_writes, 0, __ATOMIC_RELAXED);
+    __atomic_store(&img->last_sync, &now, __ATOMIC_RELAXED);
+}
+
+// Called as each file system operation finishes. Syncs the image if its
+// durability mode asks for it by now, so the writes of many operations
+// share one fdatasync() under IMAGE_DURABLE_PERIODIC. The flusher keeps
+// the time bound between operations.
+void image_op_done(struct image *img) {
+    unsigned long writes = __atomic_load_n(&img->unsynced_writes, __ATOMIC_RELAXED);
+    double last_sync;
+    __atomic_load(&img->last_sync, &last_sync, __ATOMIC_RELAXED);
+    if(img->durability == IMAGE_DURABLE_EACH_OP) {
+        image_sync_img(img);
+    } else if(img->durability == IMAGE_DURABLE_PERIODIC && writes > 0 &&
+            (writes >= (unsigned long)img->sync_writes ||
+             (monotonic_seconds() - last_sync) * 1000 >= img->sync_ms)) {
+        image_sync_img(img);
+    }
+}
+
+// Opens the image the file system layers work on.
+// Returns its file descriptor, or -1 on failure.
+int image_open_opts(char *filename, int truncate, struct image_opts *opts) {
+    if(current_image != NULL) {
+        image_close();
+    }
+    current_image = image_attach_opts(filename, truncate, opts);
+    if(current_image == NULL) {
+        return -1;
+    }
+    return current_image->fd;
+}
+
+int image_open(char *filename, int truncate) {
+    return image_open_opts(filename, truncate, NULL);
+}
+
+// Flushes the block cache and closes the image opened with image_open()
+int image_close(void){
+    if(current_image == NULL) {
+        fprintf(stderr, "Error closing file: no image open\n");
+        return -1;
+    }
+    int ret = image_detach(current_image);
+    current_image = NULL;
+    return ret;
+}
+
+// Makes everything written to the image opened with image_open() durable
+void image_sync(void) {
+    image_sync_img(current_image);
+}
+
+struct image *image_current(void) {
+    return current_image;
 }
\ No newline at end of file
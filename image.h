@@ -1,9 +1,81 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include "bcache.h"
+#include "superblock.h"
+
+// image access modes
+#define IMAGE_MODE_CACHED 0     // pread()/pwrite() behind the block cache
+#define IMAGE_MODE_MMAP 1       // whole image mapped, blocks accessed in place
+
+// what bsync() does for a memory-mapped image
+#define IMAGE_MSYNC_NONE 0      // nothing, the kernel writes pages back when it likes
+#define IMAGE_MSYNC_ASYNC 1     // schedule write-back of the mapping with MS_ASYNC
+#define IMAGE_MSYNC_SYNC 2      // wait for the mapping to reach disk with MS_SYNC
+#define IMAGE_MSYNC_EACH_WRITE 3 // MS_SYNC each block as it is written
+
+#define IMAGE_DEFAULT_MAP_BLOCKS 1024
+
+// when what has been written to the image is made durable with fdatasync()
+#define IMAGE_DURABLE_NONE 0        // never; a crash can lose or tear anything
+#define IMAGE_DURABLE_EACH_OP 1     // before every file system operation returns
+#define IMAGE_DURABLE_PERIODIC 2    // within sync_ms of a write, or once sync_writes blocks were written
+#define IMAGE_DURABLE_EXPLICIT 3    // on image_sync(), and when the journal commits on its own
+
+#define IMAGE_DEFAULT_SYNC_MS 100
+#define IMAGE_DEFAULT_SYNC_WRITES 256
+
+struct journal;
+
+struct image_opts {
+    int mode;
+    int cache_blocks;       // block cache size in IMAGE_MODE_CACHED
+    int msync_policy;       // one of IMAGE_MSYNC_* in IMAGE_MODE_MMAP
+    int map_blocks;         // minimum mapping size in blocks, 0 for the default
+    int durability;         // one of IMAGE_DURABLE_*
+    int sync_ms;            // IMAGE_DURABLE_PERIODIC: longest time between syncs
+    int sync_writes;        // IMAGE_DURABLE_PERIODIC: most block writes between syncs
+};
+
+// An open image file. Every block I/O names the image it targets,
+// so several images can be open, and used from several threads, at once.
+struct image {
+    int fd;
+    int mode;
+    struct bcache cache;
+    unsigned char *map;     // start of the mapping in IMAGE_MODE_MMAP
+    int map_blocks;
+    int msync_policy;
+    int durability;
+    int sync_ms;
+    int sync_writes;
+    unsigned long unsynced_writes;  // block writes since the image was last synced
+    double last_sync;           // CLOCK_MONOTONIC seconds of the last sync
+    pthread_t flusher;          // IMAGE_DURABLE_PERIODIC: syncs once sync_ms have passed
+    int flusher_running;
+    int flusher_stop;
+    pthread_mutex_t flush_lock; // held by the flusher while it syncs, and by mkfs()
+    pthread_cond_t flush_wake;
+    struct superblock sb;       // the image's geometry
+    struct journal *journal;    // NULL for an image without a journal
+    unsigned long read_calls;   // read system calls issued against the image
+    unsigned long write_calls;  // write system calls issued against the image
+    unsigned long sync_calls;   // fdatasync() calls issued against the image
+};
+
+void image_default_opts(struct image_opts *opts);
+struct image *image_attach_opts(char *filename, int truncate, struct image_opts *opts);
+struct image *image_attach(char *filename, int truncate);
+int image_detach(struct image *img);
+void image_sync_img(struct image *img);
+void image_op_done(struct image *img);
+
+// The file system layers above the block layer work on the image
+// opened with image_open()
+int image_open_opts(char *filename, int truncate, struct image_opts *opts);
 int image_open(char *filename, int truncate);
 int image_close(void);
+void image_sync(void);
+struct image *image_current(void);
 
-extern int image_fd;
-
-#endif
\ No newline at end of file
+#endif
@@ -1,34 +1,314 @@
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include "block.h"
 #include "free.h"
 #include "image.h"
 #include "pack.h"
 #include "inode.h"
+#include "dcache.h"
+#include "dir.h"
+#include "journal.h"
 #include <stdio.h>
 
-static struct inode incore[MAX_SYS_OPEN_FILES] = {0};
+// The in-core inode table. Slots come in chunks that double in size as the
+// table grows, so a slot never moves once handed out. Every loaded inode
+// sits in a hash index keyed by inode number. Released inodes stay loaded
+// on an LRU list until their slot is needed; never-used slots sit on a
+// free list.
+//
+// The table is shared by every thread. The hash index is split by inode
+// number into INODE_TABLE_SHARDS shards, each with its own lock, which also
+// guards the reference counts of the inodes hashed there, so iget() and
+// iput() of different inodes rarely wait for each other. The slots
+// themselves - the chunks and the free, LRU and dirty lists - are guarded
+// by incore_lock, which is only ever held for a few pointer updates and is
+// taken after a shard's lock, never before it. Write-backs are serialized
+// by incore_sync_lock, so two of them never read, patch and write the same
+// inode-table block at once. Each inode also has a lock of its own, taken
+// with ilock() by whoever changes it or, for a directory, its entries.
+//
+// Switching the table to another image, resizing it and the test helpers
+// below expect no other thread to be using it.
+#define INODE_TABLE_MAX_CHUNKS 32
 
-// allocate a previously free inode in the inode map
-struct inode *ialloc(void) {
-    unsigned char buffer[BLOCK_SIZE];
-    // call bread() to get the inode map
-    unsigned char *inode_map = bread(FREE_INODE_MAP_NUM, buffer);
+struct incore_shard {
+    pthread_mutex_t lock;
+    struct inode **hash;
+    int hash_size;          // a power of two, or 0 before the first insert
+    int count;              // inodes in the hash
+    unsigned long drops;    // bumped every time an inode leaves the hash
+};
 
-    // call find_free() to locate a free inode
-    int byte_index = find_free(inode_map);
-    if(byte_index == -1) {
+static struct inode *incore_chunks[INODE_TABLE_MAX_CHUNKS];
+static int incore_chunk_size[INODE_TABLE_MAX_CHUNKS];
+static int incore_nchunks = 0;
+static int incore_slots = 0;            // slots allocated so far
+static int incore_in_use = 0;
+static int incore_max = INODE_TABLE_DEFAULT_MAX;
+static struct incore_shard incore_shards[INODE_TABLE_SHARDS];
+static pthread_once_t incore_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t incore_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t incore_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct inode *incore_free_list = NULL;
+static struct inode *incore_lru_head = NULL;   // most recently released
+static struct inode *incore_lru_tail = NULL;
+static int incore_cached = 0;           // released inodes still loaded
+static struct image *incore_img = NULL; // image the loaded inodes came from
+static struct inode *incore_dirty_list = NULL;  // changed, not yet written back
+static int incore_ndirty = 0;
+static unsigned long incore_writeback_blocks = 0;
+
+static void incore_init(void) {
+    for(int s = 0; s < INODE_TABLE_SHARDS; s++) {
+        pthread_mutex_init(&incore_shards[s].lock, NULL);
+    }
+}
+
+// the shard whose hash holds inode_num
+static struct incore_shard *incore_shard(unsigned int inode_num) {
+    pthread_once(&incore_once, incore_init);
+    return &incore_shards[inode_num % INODE_TABLE_SHARDS];
+}
+
+static unsigned int incore_bucket(unsigned int inode_num, int hash_size) {
+    return ((inode_num / INODE_TABLE_SHARDS) * 2654435761u) & (hash_size - 1);
+}
+
+// Takes every lock of the table, for the operations that rework all of it
+static void incore_lock_all(void) {
+    for(int s = 0; s < INODE_TABLE_SHARDS; s++) {
+        pthread_mutex_lock(&incore_shard(s)->lock);
+    }
+    pthread_mutex_lock(&incore_lock);
+}
+
+static void incore_unlock_all(void) {
+    pthread_mutex_unlock(&incore_lock);
+    for(int s = INODE_TABLE_SHARDS - 1; s >= 0; s--) {
+        pthread_mutex_unlock(&incore_shards[s].lock);
+    }
+}
+
+// Returns 1 if in points into the in-core table
+static int find_incore_slot(const struct inode *in) {
+    // chunks are published by incore_grow() before the count that covers them
+    int nchunks = __atomic_load_n(&incore_nchunks, __ATOMIC_ACQUIRE);
+    for(int c = 0; c < nchunks; c++) {
+        if(in >= incore_chunks[c] && in < incore_chunks[c] + incore_chunk_size[c]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Rebuilds a shard's hash index with size buckets. Without memory for the
+// new one the old one is kept, just with longer chains.
+static void incore_rehash(struct incore_shard *s, int size) {
+    struct inode **table = calloc(size, sizeof(struct inode *));
+    if(table == NULL) {
+        if(s->hash_size > 0) {
+            return;
+        }
+        perror("Error allocating inode hash\n");
+        exit(EXIT_FAILURE);
+    }
+    for(int b = 0; b < s->hash_size; b++) {
+        while(s->hash[b] != NULL) {
+            struct inode *in = s->hash[b];
+            s->hash[b] = in->hash_next;
+            unsigned int nb = incore_bucket(in->inode_num, size);
+            in->hash_next = table[nb];
+            table[nb] = in;
+        }
+    }
+    free(s->hash);
+    s->hash = table;
+    s->hash_size = size;
+}
+
+// Called with the shard's lock held, as are the other incore_hash_*()s
+static struct inode *incore_hash_find(struct incore_shard *s, unsigned int inode_num) {
+    if(s->hash_size == 0) {
         return NULL;
     }
+    for(struct inode *in = s->hash[incore_bucket(inode_num, s->hash_size)]; in != NULL; in = in->hash_next) {
+        if(in->inode_num == inode_num) {
+            return in;
+        }
+    }
+    return NULL;
+}
+
+static void incore_hash_insert(struct incore_shard *s, struct inode *in) {
+    // keep about one bucket per inode
+    if(s->count >= s->hash_size) {
+        incore_rehash(s, s->hash_size == 0 ? 16 : s->hash_size * 2);
+    }
+    unsigned int b = incore_bucket(in->inode_num, s->hash_size);
+    in->hash_next = s->hash[b];
+    s->hash[b] = in;
+    s->count++;
+}
+
+static void incore_hash_remove(struct incore_shard *s, struct inode *in) {
+    struct inode **p = s->hash_size > 0 ? &s->hash[incore_bucket(in->inode_num, s->hash_size)] : NULL;
+    while(p != NULL && *p != NULL && *p != in) {
+        p = &(*p)->hash_next;
+    }
+    if(p != NULL && *p != NULL) {
+        *p = in->hash_next;
+        s->count--;
+        s->drops++;
+    }
+    in->hash_next = NULL;
+}
+
+// The list helpers below are called with incore_lock held
+static void incore_lru_push(struct inode *in) {
+    in->lru_prev = NULL;
+    in->lru_next = incore_lru_head;
+    if(incore_lru_head != NULL) {
+        incore_lru_head->lru_prev = in;
+    } else {
+        incore_lru_tail = in;
+    }
+    incore_lru_head = in;
+    incore_cached++;
+}
+
+static void incore_lru_remove(struct inode *in) {
+    if(in->lru_prev != NULL) {
+        in->lru_prev->lru_next = in->lru_next;
+    } else {
+        incore_lru_head = in->lru_next;
+    }
+    if(in->lru_next != NULL) {
+        in->lru_next->lru_prev = in->lru_prev;
+    } else {
+        incore_lru_tail = in->lru_prev;
+    }
+    in->lru_prev = NULL;
+    in->lru_next = NULL;
+    incore_cached--;
+}
+
+// Unloads a released inode and puts its slot back on the free list. Called
+// with every lock of the table held.
+static void incore_drop(struct inode *in) {
+    incore_lru_remove(in);
+    incore_hash_remove(incore_shard(in->inode_num), in);
+    in->valid = 0;
+    in->free_next = incore_free_list;
+    incore_free_list = in;
+}
+
+// Adds a chunk of slots to the table, as big as everything so far.
+// Returns -1 if the table is already at its configured size.
+static int incore_grow(void) {
+    if(incore_slots >= incore_max || incore_nchunks == INODE_TABLE_MAX_CHUNKS) {
+        return -1;
+    }
+    int n = incore_slots == 0 ? MAX_SYS_OPEN_FILES : incore_slots;
+    if(n > incore_max - incore_slots) {
+        n = incore_max - incore_slots;
+    }
+    struct inode *chunk = calloc(n, sizeof(struct inode));
+    if(chunk == NULL) {
+        return -1;
+    }
+
+    for(int i = n - 1; i >= 0; i--) {
+        pthread_mutex_init(&chunk[i].lock, NULL);
+        chunk[i].free_next = incore_free_list;
+        incore_free_list = &chunk[i];
+    }
+    incore_chunks[incore_nchunks] = chunk;
+    incore_chunk_size[incore_nchunks] = n;
+    __atomic_store_n(&incore_nchunks, incore_nchunks + 1, __ATOMIC_RELEASE);
+    incore_slots += n;
+    return 0;
+}
+
+// Sets how many inodes may be in core at once. The table only grows up to
+// this as inodes are opened. Shrinking below the slots already allocated
+// is only possible while no inode is in use, and releases the whole table.
+// Returns 0, or -1 if the size is invalid or inodes are still in use.
+int inode_table_resize(int max_entries) {
+    if(max_entries <= 0) {
+        return -1;
+    }
+    if(max_entries < incore_slots) {
+        if(incore_in_use > 0) {
+            return -1;
+        }
+        if(incore_img != NULL) {
+            isync_image(incore_img);
+        }
+        incore_lock_all();
+        for(int c = 0; c < incore_nchunks; c++) {
+            for(int i = 0; i < incore_chunk_size[c]; i++) {
+                pthread_mutex_destroy(&incore_chunks[c][i].lock);
+            }
+            free(incore_chunks[c]);
+        }
+        for(int s = 0; s < INODE_TABLE_SHARDS; s++) {
+            free(incore_shards[s].hash);
+            incore_shards[s].hash = NULL;
+            incore_shards[s].hash_size = 0;
+            incore_shards[s].count = 0;
+        }
+        incore_lru_head = NULL;
+        incore_lru_tail = NULL;
+        incore_cached = 0;
+        incore_nchunks = 0;
+        incore_slots = 0;
+        incore_free_list = NULL;
+        incore_unlock_all();
+    }
+    incore_max = max_entries;
+    return 0;
+}
+
+void inode_table_get_stats(struct inode_table_stats *stats) {
+    pthread_mutex_lock(&incore_lock);
+    stats->slots = incore_slots;
+    stats->in_use = incore_in_use;
+    stats->cached = incore_cached;
+    stats->dirty = incore_ndirty;
+    stats->writeback_blocks = incore_writeback_blocks;
+    stats->max = incore_max;
+    pthread_mutex_unlock(&incore_lock);
+}
+
+// the inode map only covers the inodes the inode table has room for
+static void inode_map_layout(struct image *img, int *first_block, int *nbits) {
+    *first_block = img->sb.inode_map_start;
+    *nbits = img->sb.ninodes;
+}
 
-    // call set_free() to mark it as non-free
-    set_free(inode_map, byte_index, 1);
+// resident copy of the free inode map, with its search summary
+static struct freemap inode_free_map = FREEMAP_INIT(inode_map_layout);
 
-    // call bwrite() to save the inode back out to disk
-    bwrite(FREE_INODE_MAP_NUM, inode_map);
+// the inode-table block of the image holding inode_num
+static int inode_block_num(struct image *img, int inode_num) {
+    return img->sb.inode_table_start + inode_num / INODES_PER_BLOCK;
+}
+
+// allocate a previously free inode in the inode map
+struct inode *ialloc(void) {
+    // find a free inode in the resident inode map, mark it as non-free
+    // and save the map back out to disk
+    int byte_index = freemap_alloc(&inode_free_map);
+    if(byte_index == -1) {
+        return NULL;
+    }
 
     // Get an in-core version of the inode
     struct inode *incore_inode = iget(byte_index);
     if(incore_inode == NULL) {
+        // out of in-core slots, so hand the inode back
+        ifree(byte_index);
         return NULL;
     }
 
@@ -37,137 +317,656 @@ struct inode *ialloc(void) {
     incore_inode->flags = 0;
     incore_inode->owner_id = 0;
     incore_inode->permissions = 0;
-    incore_inode->inode_num = byte_index;
     for (int i = 0; i < INODE_PTR_COUNT; i++) {
         incore_inode->block_ptr[i] = 0;
     }
-    write_inode(incore_inode);
+    incore_inode->indirect = 0;
+    imark_dirty(incore_inode);
 
     return incore_inode;
 }
 
-// Loops through incore array and finds the first inode with ref_count of 0
-struct inode *find_incore_free(void) {
-    for(int i = 0; i < MAX_SYS_OPEN_FILES; i++) {
-        if(incore[i].ref_count == 0) {
-            // return &incore[i];
-            return incore + i;
+// Allocates n inodes with one pass over the inode map, which is written back
+// once for the whole batch. Each comes back initialized and in-core, as from
+// ialloc(). Returns n, or -1 if fewer than n inodes could be allocated.
+int ialloc_many(struct inode **inodes, int n) {
+    int *inode_nums = malloc(n * sizeof(int));
+    if(inode_nums == NULL || freemap_alloc_many(&inode_free_map, inode_nums, n, 0) == -1) {
+        free(inode_nums);
+        return -1;
+    }
+
+    for(int i = 0; i < n; i++) {
+        inodes[i] = iget(inode_nums[i]);
+        if(inodes[i] == NULL) {
+            // out of in-core slots, so hand back everything from here on
+            for(int j = 0; j < i; j++) {
+                iput(inodes[j]);
+            }
+            freemap_free_many(&inode_free_map, inode_nums, n);
+            free(inode_nums);
+            return -1;
+        }
+        inodes[i]->size = 0;
+        inodes[i]->flags = 0;
+        inodes[i]->owner_id = 0;
+        inodes[i]->permissions = 0;
+        for(int j = 0; j < INODE_PTR_COUNT; j++) {
+            inodes[i]->block_ptr[j] = 0;
         }
+        inodes[i]->indirect = 0;
+        imark_dirty(inodes[i]);
     }
-    return NULL;
+    free(inode_nums);
+    return n;
 }
 
-// Takes an inode number and searches through incore array for that inode number and returns it if that inode is not being used
+// mark an inode free again in the inode map
+void ifree(int inode_num) {
+    freemap_free(&inode_free_map, inode_num);
+}
+
+// mark every inode in inode_nums free again, writing the map back once
+void ifree_many(const int *inode_nums, int n) {
+    freemap_free_many(&inode_free_map, inode_nums, n);
+}
+
+// Returns the slot the next newly loaded inode would take without growing
+// the table: an unused slot from the free list, or else the least recently
+// released inode. Returns NULL if every slot allocated so far is in use.
+struct inode *find_incore_free(void) {
+    pthread_mutex_lock(&incore_lock);
+    if(incore_free_list == NULL && incore_slots == 0) {
+        incore_grow();
+    }
+    struct inode *in = incore_free_list != NULL ? incore_free_list : incore_lru_tail;
+    pthread_mutex_unlock(&incore_lock);
+    return in;
+}
+
+// Looks an inode number up in the hash index and returns its in-core inode,
+// whether in use or released but still loaded, or NULL if it is not loaded
 struct inode *find_incore(unsigned int inode_num) {
-    for(int i = 0; i < MAX_SYS_OPEN_FILES; i++) {
-        if(incore[i].ref_count > 0 && incore[i].inode_num == inode_num) {
-            // return &incore[i];
-            return incore + i;
+    struct incore_shard *s = incore_shard(inode_num);
+    pthread_mutex_lock(&s->lock);
+    struct inode *in = incore_hash_find(s, inode_num);
+    pthread_mutex_unlock(&s->lock);
+    return in;
+}
+
+// Unloads every released inode that came from img and forgets any unsaved
+// changes, because the image is being closed or rewritten. Call
+// isync_image() first to keep the changes. Inodes still held stay with
+// their holders until iput(), but are never found again.
+void inode_forget_image(struct image *img) {
+    incore_lock_all();
+    if(img != incore_img) {
+        incore_unlock_all();
+        return;
+    }
+    while(incore_dirty_list != NULL) {
+        struct inode *in = incore_dirty_list;
+        incore_dirty_list = in->dirty_next;
+        in->dirty_next = NULL;
+        in->dirty = 0;
+        in->dirty_listed = 0;
+    }
+    incore_ndirty = 0;
+    while(incore_lru_tail != NULL) {
+        incore_drop(incore_lru_tail);
+    }
+    for(int c = 0; c < incore_nchunks; c++) {
+        for(int i = 0; i < incore_chunk_size[c]; i++) {
+            struct inode *in = &incore_chunks[c][i];
+            if(in->valid) {
+                incore_hash_remove(incore_shard(in->inode_num), in);
+                in->valid = 0;
+            }
         }
     }
-    return NULL;
+    incore_img = NULL;
+    incore_unlock_all();
 }
 
 // Takes a pointer to an empty struct inode that data will be read into.
 // Maps inode_num to a block and offset.
-// Reads the data from disk into the block, then unpacks the data into the inode in.
+// Unpacks the data straight out of the cached block into the inode in.
 void read_inode(struct inode *in, int inode_num) {
-    int block_num = inode_num / INODES_PER_BLOCK + INODE_FIRST_BLOCK;
+    int block_num = inode_block_num(image_current(), inode_num);
     int block_offset = inode_num % INODES_PER_BLOCK;
     int block_offset_bytes = block_offset * INODE_SIZE;
-    unsigned char block[BLOCK_SIZE];
-    bread(block_num, block);
+    const unsigned char *block = bread_ref(block_num);
 
-    in->size = read_u32(block + block_offset_bytes);
-    in->owner_id = read_u16(block + block_offset_bytes + 4);
-    in->permissions = read_u8(block + block_offset_bytes + 6);
-    in->flags = read_u8(block + block_offset_bytes + 7);
-    in->link_count = read_u8(block + block_offset_bytes + 8);
-    
-    for(int i = 0; i < INODE_PTR_COUNT; i++) {
-        in->block_ptr[i] = read_u16(block + block_offset_bytes + 9 + (i * 2));
-    }
+    decode_inode(block + block_offset_bytes, in);
+    brelse(block);
+}
+
+// Packs the inode's fields into its slot of an inode-table block
+void pack_inode(unsigned char *block, const struct inode *in) {
+    encode_inode(block + (in->inode_num % INODES_PER_BLOCK) * INODE_SIZE, in);
 }
 
 // Stores the inode data pointed to by in on disk.
 // The inode_num field in the struct holds the number of the inode to be written.
-// Maps the inode number to a block and offset.
-// Reads the data from disk and packs the inode fields into the block.
-// Writes the block back out to disk.
+// Reads the inode-table block holding it, packs the inode fields into the
+// block and writes the block back, leaving the other inodes in it alone.
 void write_inode(struct inode *in) {
-    int inode_num = in->inode_num;
-    int block_num = inode_num / INODES_PER_BLOCK + INODE_FIRST_BLOCK;
-    int block_offset = inode_num % INODES_PER_BLOCK;
-    int block_offset_bytes = block_offset * INODE_SIZE;
+    int block_num = inode_block_num(image_current(), in->inode_num);
     unsigned char block[BLOCK_SIZE];
 
-    write_u32(block + block_offset_bytes, in->size);
-    write_u16(block + block_offset_bytes + 4, in->owner_id);
-    write_u8(block + block_offset_bytes + 6, in->permissions);
-    write_u8(block + block_offset_bytes + 7, in->flags);
-    write_u8(block + block_offset_bytes + 8, in->link_count);
+    // not while a write-back has the same block half patched
+    pthread_mutex_lock(&incore_sync_lock);
+    bread(block_num, block);
+    pack_inode(block, in);
+    bwrite(block_num, block);
+    pthread_mutex_unlock(&incore_sync_lock);
+}
 
-    for(int i = 0; i < INODE_PTR_COUNT; i++) {
-        write_u16(block + block_offset_bytes + 9 + (i * 2), in->block_ptr[i]);
+static void inode_fields_save(struct inode_fields *f, const struct inode *in) {
+    f->size = in->size;
+    f->owner_id = in->owner_id;
+    f->permissions = in->permissions;
+    f->flags = in->flags;
+    f->link_count = in->link_count;
+    memcpy(f->block_ptr, in->block_ptr, sizeof(f->block_ptr));
+    f->indirect = in->indirect;
+}
+
+static void inode_fields_load(struct inode *in, const struct inode_fields *f) {
+    in->size = f->size;
+    in->owner_id = f->owner_id;
+    in->permissions = f->permissions;
+    in->flags = f->flags;
+    in->link_count = f->link_count;
+    memcpy(in->block_ptr, f->block_ptr, sizeof(in->block_ptr));
+    in->indirect = f->indirect;
+}
+
+// Queues a changed in-core inode for write-back. Called with incore_lock
+// held, by the thread that changed it.
+static void incore_mark_dirty(struct inode *in) {
+    in->dirty = 1;
+    if(!find_incore_slot(in)) {
+        return;
+    }
+    // the write-back takes this copy, so it never reads an inode that
+    // another thread is in the middle of changing
+    inode_fields_save(&in->saved, in);
+    if(!in->dirty_listed) {
+        in->dirty_listed = 1;
+        in->dirty_next = incore_dirty_list;
+        incore_dirty_list = in;
+        incore_ndirty++;
+    }
+}
+
+// Records that an in-core inode has changed. It is written back, together
+// with every other changed inode in the same inode-table block, on the next
+// isync() or when its slot is needed, as it is at this call: call it again
+// after every change.
+void imark_dirty(struct inode *in) {
+    pthread_mutex_lock(&incore_lock);
+    incore_mark_dirty(in);
+    pthread_mutex_unlock(&incore_lock);
+}
+
+// Maps the index-th block of the inode's data to its block number: the
+// first INODE_PTR_COUNT through the direct pointers, the rest through the
+// indirect block. Returns 0 for a block that has not been allocated.
+int bmap(struct inode *in, int index) {
+    if(index < 0 || index >= INODE_MAX_BLOCKS) {
+        return 0;
+    }
+    if(index < INODE_PTR_COUNT) {
+        return in->block_ptr[index];
+    }
+    if(in->indirect == 0) {
+        return 0;
+    }
+    const unsigned char *block = bread_ref(in->indirect);
+    int block_num = read_u32(block + (index - INODE_PTR_COUNT) * 4);
+    brelse(block);
+    return block_num;
+}
+
+// Points the index-th block of the inode's data at block_num, allocating
+// the indirect block the first time it is needed.
+// Returns 0, or -1 if index is out of range or there is no block for it.
+int bmap_set(struct inode *in, int index, int block_num) {
+    if(index < 0 || index >= INODE_MAX_BLOCKS) {
+        return -1;
+    }
+    if(index < INODE_PTR_COUNT) {
+        in->block_ptr[index] = block_num;
+        imark_dirty(in);
+        return 0;
+    }
+
+    unsigned char block[BLOCK_SIZE] = {0};
+    if(in->indirect == 0) {
+        int indirect = alloc_near(in->block_ptr[INODE_PTR_COUNT - 1]);
+        if(indirect == -1) {
+            return -1;
+        }
+        in->indirect = indirect;
+        imark_dirty(in);
+    } else {
+        bread(in->indirect, block);
+    }
+    write_u32(block + (index - INODE_PTR_COUNT) * 4, block_num);
+    bwrite(in->indirect, block);
+    return 0;
+}
+
+static int compare_inode_num(const void *a, const void *b) {
+    const struct inode *x = *(struct inode * const *)a;
+    const struct inode *y = *(struct inode * const *)b;
+    return (x->inode_num > y->inode_num) - (x->inode_num < y->inode_num);
+}
+
+// Writes every changed in-core inode of img back. The inodes are grouped
+// by inode-table block, and each block is written once, with the whole
+// batch going through bread_many_img()/bwrite_many_img(). A block with
+// some inodes unchanged is read and unpacked with decode_inode_block()
+// first; one whose every inode changed is not read at all. Either way the
+// block is packed again in one encode_inode_block(). An inode stays dirty
+// until its block is written, so its slot cannot be reused under the
+// write-back, and one changed again meanwhile is queued for the next one.
+static void incore_write_back(struct image *img) {
+    pthread_mutex_lock(&incore_sync_lock);
+    pthread_mutex_lock(&incore_lock);
+    if(img != incore_img || incore_ndirty == 0) {
+        pthread_mutex_unlock(&incore_lock);
+        pthread_mutex_unlock(&incore_sync_lock);
+        return;
+    }
+    int n = incore_ndirty;
+    struct inode **dirty = malloc(n * sizeof(struct inode *));
+    struct inode_fields *saved = malloc(n * sizeof(struct inode_fields));
+    int *block_nums = malloc(n * sizeof(int));
+    int *block_first = malloc((n + 1) * sizeof(int));
+    unsigned char *whole = malloc(n);
+    unsigned char **blocks = malloc(n * sizeof(unsigned char *));
+    unsigned char *data = malloc((size_t)n * BLOCK_SIZE);
+    int *read_nums = malloc(n * sizeof(int));
+    unsigned char **read_blocks = malloc(n * sizeof(unsigned char *));
+    struct inode *staged = malloc(INODES_PER_BLOCK * sizeof(struct inode));
+    if(dirty == NULL || saved == NULL || block_nums == NULL || block_first == NULL || whole == NULL ||
+            blocks == NULL || data == NULL || read_nums == NULL || read_blocks == NULL || staged == NULL) {
+        perror("Error allocating inode write-back\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int i = 0;
+    while(incore_dirty_list != NULL) {
+        struct inode *in = incore_dirty_list;
+        incore_dirty_list = in->dirty_next;
+        in->dirty_next = NULL;
+        in->dirty_listed = 0;
+        dirty[i++] = in;
+    }
+    incore_ndirty = 0;
+    qsort(dirty, n, sizeof(struct inode *), compare_inode_num);
+    for(i = 0; i < n; i++) {
+        saved[i] = dirty[i]->saved;
+    }
+    pthread_mutex_unlock(&incore_lock);
+
+    // dirty[block_first[b]] up to dirty[block_first[b + 1]] live in block b
+    int nblocks = 0;
+    int slots = 0;
+    for(i = 0; i < n; i++) {
+        int block_num = inode_block_num(img, dirty[i]->inode_num);
+        if(nblocks == 0 || block_nums[nblocks - 1] != block_num) {
+            block_nums[nblocks] = block_num;
+            block_first[nblocks] = i;
+            blocks[nblocks] = data + (size_t)nblocks * BLOCK_SIZE;
+            nblocks++;
+            slots = 0;
+        }
+        if(i == block_first[nblocks - 1] || dirty[i]->inode_num != dirty[i - 1]->inode_num) {
+            slots++;
+        }
+        whole[nblocks - 1] = slots == INODES_PER_BLOCK;
+    }
+    block_first[nblocks] = n;
+
+    int nread = 0;
+    for(int b = 0; b < nblocks; b++) {
+        if(!whole[b]) {
+            read_nums[nread] = block_nums[b];
+            read_blocks[nread] = blocks[b];
+            nread++;
+        }
+    }
+    bread_many_img(img, read_nums, read_blocks, nread);
+    for(int b = 0; b < nblocks; b++) {
+        if(whole[b]) {
+            // every slot is replaced below; this only clears the spare bytes
+            memset(blocks[b], 0, BLOCK_SIZE);
+        } else {
+            decode_inode_block(blocks[b], staged);
+        }
+        for(i = block_first[b]; i < block_first[b + 1]; i++) {
+            inode_fields_load(&staged[dirty[i]->inode_num % INODES_PER_BLOCK], &saved[i]);
+        }
+        encode_inode_block(blocks[b], staged);
+    }
+    bwrite_many_img(img, block_nums, blocks, nblocks);
+
+    pthread_mutex_lock(&incore_lock);
+    for(i = 0; i < n; i++) {
+        if(!dirty[i]->dirty_listed) {
+            dirty[i]->dirty = 0;
+        }
+    }
+    incore_writeback_blocks += nblocks;
+    pthread_mutex_unlock(&incore_lock);
+    pthread_mutex_unlock(&incore_sync_lock);
+
+    free(dirty);
+    free(saved);
+    free(block_nums);
+    free(block_first);
+    free(whole);
+    free(blocks);
+    free(data);
+    free(read_nums);
+    free(read_blocks);
+    free(staged);
+}
+
+// Writes every changed in-core inode of img back. Outside an operation
+// this waits for the open ones to end and holds new ones off meanwhile, so
+// what is written holds whole operations, and goes into the journal with
+// them; inside one, the inodes join this thread's transaction.
+void isync_image(struct image *img) {
+    int exclusive = journal_begin_exclusive(img);
+    incore_write_back(img);
+    journal_end_exclusive(img, exclusive);
+}
+
+// Writes every changed in-core inode of the current image back
+void isync(void) {
+    isync_image(image_current());
+}
+
+// Takes another reference to a loaded inode. Called with its shard's lock held.
+static void incore_hold(struct inode *in) {
+    if(in->ref_count == 0) {
+        pthread_mutex_lock(&incore_lock);
+        incore_lru_remove(in);
+        incore_in_use++;
+        pthread_mutex_unlock(&incore_lock);
+    }
+    in->ref_count++;
+}
+
+// Takes a slot for an inode about to be loaded: a never-used one, then a
+// new chunk, and only then the least recently released inode, which is
+// written back first if it changed. Returns NULL if every slot is in use.
+static struct inode *incore_take_slot(struct image *img) {
+    for(;;) {
+        pthread_mutex_lock(&incore_lock);
+        if(incore_free_list == NULL) {
+            incore_grow();
+        }
+        struct inode *slot = incore_free_list;
+        if(slot != NULL) {
+            incore_free_list = slot->free_next;
+            slot->free_next = NULL;
+            pthread_mutex_unlock(&incore_lock);
+            return slot;
+        }
+        struct inode *victim = incore_lru_tail;
+        if(victim == NULL) {
+            pthread_mutex_unlock(&incore_lock);
+            return NULL;
+        }
+        if(!victim->valid) {
+            // left over from a forgotten image, so in no shard
+            incore_lru_remove(victim);
+            pthread_mutex_unlock(&incore_lock);
+            return victim;
+        }
+        unsigned int victim_num = victim->inode_num;
+        pthread_mutex_unlock(&incore_lock);
+
+        // the victim's shard lock comes first, and by the time it is held
+        // the victim may have been picked up again; then try the next one
+        struct incore_shard *s = incore_shard(victim_num);
+        pthread_mutex_lock(&s->lock);
+        pthread_mutex_lock(&incore_lock);
+        int still = incore_lru_tail == victim && victim->inode_num == victim_num;
+        int dirty = still && victim->dirty;
+        if(still && !dirty) {
+            incore_lru_remove(victim);
+            incore_hash_remove(s, victim);
+            victim->valid = 0;
+        }
+        pthread_mutex_unlock(&incore_lock);
+        pthread_mutex_unlock(&s->lock);
+        if(still && !dirty) {
+            return victim;
+        }
+        if(dirty) {
+            // write the victim back along with every other pending change
+            isync_image(img);
+        }
     }
-    bwrite(block_num, block);
 }
 
 // Returns a pointer to an in-core inode for a given inode number.
 // If inode is already in-core, increments the ref_count field and returns a pointer.
 // If inode wasn't in-core, allocate space for it, load it up, set ref_count to 1, and return the pointer.
+// A released inode that is still loaded is picked back up without any I/O.
 struct inode *iget(int inode_num) {
-    struct inode *incore_found = find_incore(inode_num);
+    struct image *img = image_current();
+    if(img != incore_img) {
+        if(incore_img != NULL) {
+            isync_image(incore_img);
+            inode_forget_image(incore_img);
+        }
+        incore_img = img;
+    }
+
+    struct incore_shard *s = incore_shard(inode_num);
+    pthread_mutex_lock(&s->lock);
+    struct inode *incore_found = incore_hash_find(s, inode_num);
     if(incore_found != NULL) {
-        incore_found->ref_count++;
+        incore_hold(incore_found);
+        pthread_mutex_unlock(&s->lock);
         return incore_found;
     }
-    struct inode *incore_free = find_incore_free();
+    unsigned long drops = s->drops;
+    pthread_mutex_unlock(&s->lock);
+
+    // the shard is not held while making room, which can mean writing
+    // inodes back, or while the inode is read
+    struct inode *incore_free = incore_take_slot(img);
     if(incore_free == NULL) {
         return NULL;
     }
     read_inode(incore_free, inode_num);
-
     incore_free->ref_count = 1;
     incore_free->inode_num = inode_num;
+    incore_free->ra_next = 0;
+    incore_free->ra_window = 0;
+    incore_free->ra_end = 0;
+
+    pthread_mutex_lock(&s->lock);
+    incore_found = incore_hash_find(s, inode_num);
+    if(incore_found != NULL) {
+        // another thread loaded it first; use theirs
+        incore_hold(incore_found);
+        pthread_mutex_lock(&incore_lock);
+        incore_free->ref_count = 0;
+        incore_free->free_next = incore_free_list;
+        incore_free_list = incore_free;
+        pthread_mutex_unlock(&incore_lock);
+        pthread_mutex_unlock(&s->lock);
+        return incore_found;
+    }
+    if(s->drops != drops) {
+        // it may have been loaded, changed, written back and unloaded
+        // since it was read
+        read_inode(incore_free, inode_num);
+    }
+    incore_free->valid = 1;
+    incore_hash_insert(s, incore_free);
+    pthread_mutex_lock(&incore_lock);
+    incore_in_use++;
+    pthread_mutex_unlock(&incore_lock);
+    pthread_mutex_unlock(&s->lock);
     return incore_free;
 }
 
-// Frees the inode if it isn't being used.
+
+// Releases a reference to the inode. When the last one goes, the inode
+// stays loaded for a later iget(); if it was changed it is queued for the
+// next batched write-back. An inode outside the table is written right away.
 void iput(struct inode *in) {
-    if(in->ref_count == 0) {
+    if(!find_incore_slot(in)) {
+        if(in->ref_count == 0) {
+            return;
+        }
+        in->ref_count--;
+        if(in->ref_count == 0 && in->dirty) {
+            write_inode(in);
+            in->dirty = 0;
+        }
         return;
     }
-    in->ref_count--;
-    if(in->ref_count == 0) {
-        write_inode(in);
+
+    struct incore_shard *s = incore_shard(in->inode_num);
+    pthread_mutex_lock(&s->lock);
+    if(in->ref_count > 0 && --in->ref_count == 0) {
+        pthread_mutex_lock(&incore_lock);
+        // an inode left over from a forgotten image has nowhere to go
+        if(!in->valid) {
+            in->dirty = 0;
+        }
+        if(in->dirty) {
+            incore_mark_dirty(in);
+        }
+        incore_lru_push(in);
+        incore_in_use--;
+        pthread_mutex_unlock(&incore_lock);
     }
+    pthread_mutex_unlock(&s->lock);
 }
 
+// Locks an in-core inode against other threads: a directory while its
+// entries are looked up or changed, a file while its size and blocks are.
+// Only one inode is locked at a time, so there is no order to keep. An
+// inode outside the table belongs to its caller alone and is not locked.
+void ilock(struct inode *in) {
+    if(find_incore_slot(in)) {
+        pthread_mutex_lock(&in->lock);
+    }
+}
+
+void iunlock(struct inode *in) {
+    if(find_incore_slot(in)) {
+        pthread_mutex_unlock(&in->lock);
+    }
+}
+
+// Resolves a path, one component at a time, to an in-core inode that the
+// caller must iput(). Paths are taken relative to the root directory, and
+// "." and ".." are ordinary directory entries. Returns NULL if a component
+// does not exist or a component before the last is not a directory.
 struct inode *namei(char *path) {
-    (void)path;
-    struct inode *root_inode = iget(ROOT_INODE_NUM);
-    if (root_inode == NULL) {
-        return NULL;
+    struct inode *in = iget(ROOT_INODE_NUM);
+    const char *p = path;
+    while(in != NULL) {
+        while(*p == '/') {
+            p++;
+        }
+        if(*p == '\0') {
+            break;
+        }
+        const char *end = strchr(p, '/');
+        size_t len = end != NULL ? (size_t)(end - p) : strlen(p);
+        if(len >= DCACHE_NAME_LEN || in->flags != INODE_FLAG_DIR) {
+            iput(in);
+            return NULL;
+        }
+        char name[DCACHE_NAME_LEN];
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len;
+
+        ilock(in);
+        int inode_num = directory_lookup(in, name);
+        iunlock(in);
+        iput(in);
+        if(inode_num == -1) {
+            return NULL;
+        }
+        in = iget(inode_num);
     }
-    return root_inode;
+    return in;
 }
 
 // Helper functions for testing
+// Rebuilds the index and lists from the slots' ref_counts; slots with no
+// references end up unused rather than cached
+static void reset_incore_lists(void) {
+    incore_free_list = NULL;
+    incore_lru_head = NULL;
+    incore_lru_tail = NULL;
+    incore_cached = 0;
+    incore_in_use = 0;
+    for(int s = 0; s < INODE_TABLE_SHARDS; s++) {
+        struct incore_shard *shard = incore_shard(s);
+        for(int h = 0; h < shard->hash_size; h++) {
+            shard->hash[h] = NULL;
+        }
+        shard->count = 0;
+    }
+    for(int c = incore_nchunks - 1; c >= 0; c--) {
+        for(int i = incore_chunk_size[c] - 1; i >= 0; i--) {
+            struct inode *in = &incore_chunks[c][i];
+            in->lru_prev = NULL;
+            in->lru_next = NULL;
+            in->valid = in->ref_count > 0;
+            if(in->valid) {
+                incore_hash_insert(incore_shard(in->inode_num), in);
+                incore_in_use++;
+            } else {
+                in->free_next = incore_free_list;
+                incore_free_list = in;
+            }
+        }
+    }
+}
+
 void fill_incore_for_test(void) {
-    for(int i = 0; i < MAX_SYS_OPEN_FILES; i++) {
-        incore[i].ref_count = 1;
-        incore[i].inode_num = i+1;
+    if(incore_slots == 0) {
+        incore_grow();
+    }
+    int n = 0;
+    for(int c = 0; c < incore_nchunks; c++) {
+        for(int i = 0; i < incore_chunk_size[c]; i++) {
+            incore_chunks[c][i].ref_count = 1;
+            incore_chunks[c][i].inode_num = ++n;
+        }
     }
+    reset_incore_lists();
 }
 
 void set_free_in_incore(void) {
-    incore[9].ref_count = 0;
+    incore_chunks[0][9].ref_count = 0;
     // inode_num should be 10
+    reset_incore_lists();
 }
 
 void free_all_incore(void) {
-    for(int i = 0; i < MAX_SYS_OPEN_FILES; i++) {
-        incore[i].ref_count = 0;
+    for(int c = 0; c < incore_nchunks; c++) {
+        for(int i = 0; i < incore_chunk_size[c]; i++) {
+            incore_chunks[c][i].ref_count = 0;
+        }
     }
-}
\ No newline at end of file
+    reset_incore_lists();
+}
@@ -1,14 +1,39 @@
 #ifndef INODE_H
 #define INODE_H
 
-#define INODE_PTR_COUNT 16
-#define MAX_SYS_OPEN_FILES 64
+#include <pthread.h>
+
+#define INODE_PTR_COUNT 12
+#define MAX_SYS_OPEN_FILES 64            // slots in the first chunk of the in-core table
+#define INODE_TABLE_DEFAULT_MAX 65536
+#define INODE_TABLE_SHARDS 16          // separately locked parts of the in-core hash index
 #define INODE_SIZE 64
-#define INODE_FIRST_BLOCK 3
-#define FREE_INODE_MAP_NUM 1 
+#define INODE_PTR_OFFSET 9          // u32 direct block pointers
+#define INODE_INDIRECT_OFFSET 57    // u32 after the direct block pointers
 #define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+// the default geometry; an image's own is in its superblock
+#define FREE_INODE_MAP_NUM 1
+#define INODE_FIRST_BLOCK 3
+#define INODE_TABLE_BLOCKS 4
+#define NUM_INODES (INODE_TABLE_BLOCKS * INODES_PER_BLOCK)
+#define INODE_PTRS_PER_INDIRECT (BLOCK_SIZE / 4)
+#define INODE_MAX_BLOCKS (INODE_PTR_COUNT + INODE_PTRS_PER_INDIRECT)
 #define ROOT_INODE_NUM 0
+#define INODE_FLAG_FILE 1
+#define INODE_FLAG_DIR 2
 
+struct image;
+
+// the fields of an inode that are kept on disk
+struct inode_fields {
+    unsigned int size;
+    unsigned short owner_id;
+    unsigned char permissions;
+    unsigned char flags;
+    unsigned char link_count;
+    unsigned int block_ptr[INODE_PTR_COUNT];
+    unsigned int indirect;
+};
 
 struct inode {
     unsigned int size;
@@ -16,20 +41,57 @@ struct inode {
     unsigned char permissions;
     unsigned char flags;
     unsigned char link_count;
-    unsigned short block_ptr[INODE_PTR_COUNT];
+    unsigned int block_ptr[INODE_PTR_COUNT];
+    unsigned int indirect;      // block of u32 pointers past the direct ones, or 0
     // in-core only
     unsigned int ref_count;  
     unsigned int inode_num;
+    unsigned char valid;        // slot holds a loaded inode
+    unsigned char dirty;        // changed since it was last written back
+    unsigned char dirty_listed; // queued for the next isync()
+    struct inode *hash_next;
+    struct inode *free_next;
+    struct inode *lru_prev;     // released inodes, most recent first
+    struct inode *lru_next;
+    struct inode *dirty_next;
+    int ra_next;                // block a sequential reader would read next
+    int ra_window;              // readahead window in blocks
+    int ra_end;                 // block after the last one read ahead
+    struct inode_fields saved;  // on-disk fields as of the last imark_dirty()
+    pthread_mutex_t lock;       // taken with ilock()
+};
+
+struct inode_table_stats {
+    int slots;      // in-core slots allocated so far
+    int in_use;
+    int cached;     // released but still loaded
+    int dirty;      // waiting for write-back
+    unsigned long writeback_blocks;     // inode-table blocks written by isync()
+    int max;        // most slots the table may grow to
 };
 
 struct inode *ialloc(void);
+int ialloc_many(struct inode **inodes, int n);
+void ifree(int inode_num);
+void ifree_many(const int *inode_nums, int n);
 struct inode *find_incore_free(void);
 struct inode *find_incore(unsigned int inode_num);
 void read_inode(struct inode *in, int inode_num);
+void pack_inode(unsigned char *block, const struct inode *in);
 void write_inode(struct inode *in);
+void imark_dirty(struct inode *in);
+int bmap(struct inode *in, int index);
+int bmap_set(struct inode *in, int index, int block_num);
+void isync(void);
+void isync_image(struct image *img);
 struct inode *iget(int inode_num);
 void iput(struct inode *in);
+void ilock(struct inode *in);
+void iunlock(struct inode *in);
 struct inode *namei(char *path);
+int inode_table_resize(int max_entries);
+void inode_forget_image(struct image *img);
+void inode_table_get_stats(struct inode_table_stats *stats);
 
 //testing
 void fill_incore_for_test(void);
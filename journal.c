@@ -0,0 +1,617 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "image.h"
+#include "block.h"
+#include "bcache.h"
+#include "inode.h"
+#include "pack.h"
+#include "journal.h"
+
+// Metadata journal
+//
+// mkfs() reserves a fixed region of the image for a write-ahead log:
+//
+//   block 0:     header: u32 magic, u32 sequence number of the first
+//                transaction to replay
+//   blocks 1...: transactions, one after the other, each a descriptor
+//                (u32 magic, u32 sequence, u32 count, count u32 block
+//                numbers), the new contents of those blocks, and a commit
+//                block (u32 magic, u32 sequence, u32 count, u32 checksum)
+//
+// Operations wrapped in journal_begin()/journal_end() join the running
+// transaction: the blocks they write are held here, where reads still see
+// them, instead of going to the block cache. Many operations are grouped
+// into one transaction, which is committed with a single sequential write
+// and one fdatasync(); only then are its blocks handed to the cache to be
+// written home. The checksum lets a transaction go out in one write, since
+// a torn one is never replayed. File data is not journaled: whatever was
+// written home since the last sync is synced before a commit, so committed
+// metadata never points at data that is not on disk yet.
+//
+// When the journal fills up it is checkpointed: every cached block is
+// written home and synced, and the header moves past everything logged so
+// far. Until then a logged block keeps joining transactions even when it
+// is written outside one, so replay can never bring back an older copy.
+//
+// Operations from many threads share the running transaction, which only
+// commits once none of them is open. When it is due to commit, new
+// operations wait in journal_begin() for the open ones to end, the last of
+// which commits it for all of them. A transaction that outgrows the
+// journal meanwhile is held in memory and goes out in pieces at commit.
+//
+// The changed inodes are written back into the running transaction by the
+// last operation to end, with new ones held off, so it only ever takes
+// inodes between whole operations. Anyone else writing them back outside
+// an operation first waits for the open ones to end the same way, through
+// journal_begin_exclusive().
+
+// block number -> slot in the running transaction, open addressing
+struct block_index {
+    int *keys;              // -1 for an empty bucket
+    int *slots;
+    int size;               // a power of two, or 0 before first use
+    int count;
+};
+
+struct journal {
+    pthread_mutex_t lock;
+    int start;              // first block of the region, the header
+    int nblocks;
+    int max_blocks;         // most blocks one transaction can hold
+    unsigned int seq;       // sequence number of the running transaction
+    int head;               // next unused block of the region
+    int handles;            // journal_begin()s not yet ended
+    int ops;                // operations in the running transaction
+    int waiting;            // threads waiting for the open operations to end
+    int exclusive;          // the one open operation holds new ones off
+    unsigned long home_writes;  // blocks sent home past the journal since the last sync
+    unsigned long drains;   // times the last open operation has ended
+    pthread_cond_t idle;    // signalled when it does
+    // the running transaction: its blocks and their latest contents
+    int count;
+    int cap;
+    int *block_nums;
+    unsigned char *data;
+    struct block_index running;
+    struct block_index logged;  // blocks logged since the last checkpoint
+    struct journal_stats stats;
+};
+
+static int journal_batch = JOURNAL_DEFAULT_BATCH;
+static __thread int journal_depth = 0;  // this thread's open operations
+
+// Sets how many operations are grouped into one transaction before it is
+// committed on its own
+void journal_set_batch(int ops) {
+    journal_batch = ops > 0 ? ops : 1;
+}
+
+// Returns the most blocks one transaction of the current image can hold,
+// or 0 if it has no journal
+int journal_max_blocks(void) {
+    struct journal *j = image_current()->journal;
+    return j == NULL ? 0 : j->max_blocks;
+}
+
+static unsigned int block_index_bucket(const struct block_index *ix, int key) {
+    return ((unsigned int)key * 2654435761u) & (ix->size - 1);
+}
+
+// Returns the slot recorded for key, or -1 if there is none
+static int block_index_find(const struct block_index *ix, int key) {
+    if(ix->size == 0) {
+        return -1;
+    }
+    for(unsigned int b = block_index_bucket(ix, key); ix->keys[b] != -1; b = (b + 1) & (ix->size - 1)) {
+        if(ix->keys[b] == key) {
+            return ix->slots[b];
+        }
+    }
+    return -1;
+}
+
+static void block_index_put(struct block_index *ix, int key, int slot) {
+    if((ix->count + 1) * 2 > ix->size) {
+        struct block_index grown = {0};
+        grown.size = ix->size == 0 ? 64 : ix->size * 2;
+        grown.keys = malloc(grown.size * sizeof(int));
+        grown.slots = malloc(grown.size * sizeof(int));
+        if(grown.keys == NULL || grown.slots == NULL) {
+            perror("Error allocating journal index\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(grown.keys, 0xff, grown.size * sizeof(int));
+        for(int b = 0; b < ix->size; b++) {
+            if(ix->keys[b] != -1) {
+                block_index_put(&grown, ix->keys[b], ix->slots[b]);
+            }
+        }
+        free(ix->keys);
+        free(ix->slots);
+        *ix = grown;
+    }
+    unsigned int b = block_index_bucket(ix, key);
+    while(ix->keys[b] != -1 && ix->keys[b] != key) {
+        b = (b + 1) & (ix->size - 1);
+    }
+    if(ix->keys[b] == -1) {
+        ix->count++;
+    }
+    ix->keys[b] = key;
+    ix->slots[b] = slot;
+}
+
+static void block_index_clear(struct block_index *ix) {
+    if(ix->size > 0) {
+        memset(ix->keys, 0xff, ix->size * sizeof(int));
+    }
+    ix->count = 0;
+}
+
+static void block_index_release(struct block_index *ix) {
+    free(ix->keys);
+    free(ix->slots);
+    memset(ix, 0, sizeof(struct block_index));
+}
+
+static unsigned int journal_checksum(const unsigned char *desc, const unsigned char *data, int count) {
+    // FNV-1a over the descriptor and every logged block
+    unsigned int h = 2166136261u;
+    for(int i = 0; i < BLOCK_SIZE; i++) {
+        h = (h ^ desc[i]) * 16777619u;
+    }
+    for(size_t i = 0; i < (size_t)count * BLOCK_SIZE; i++) {
+        h = (h ^ data[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Records where replay starts and waits for it to reach the disk
+static void journal_write_header(struct image *img, struct journal *j) {
+    unsigned char block[BLOCK_SIZE] = {0};
+    write_u32(block, JOURNAL_MAGIC);
+    write_u32(block + 4, j->seq);
+    block_write_raw(img, j->start, block);
+    block_sync_raw(img);
+}
+
+// Writes every cached or mapped block home and waits for it to reach the
+// disk along with everything else written to the image
+static void journal_sync_home(struct image *img, struct journal *j) {
+    bcache_sync(img);
+    if(img->map != NULL && msync(img->map, (size_t)img->map_blocks * BLOCK_SIZE, MS_SYNC) == -1) {
+        perror("Error syncing image\n");
+        exit(EXIT_FAILURE);
+    }
+    block_sync_raw(img);
+    j->home_writes = 0;
+}
+
+// Writes every block logged so far home and syncs it, so the journal can
+// start over from its first block
+static void journal_checkpoint(struct image *img, struct journal *j) {
+    journal_sync_home(img, j);
+    journal_write_header(img, j);
+    j->head = 1;
+    block_index_clear(&j->logged);
+    j->stats.checkpoints++;
+}
+
+// Writes count blocks of the running transaction, from slot first on, to
+// the journal as one transaction with one write and one fdatasync(), then
+// lets them go home
+static void journal_write_transaction(struct image *img, struct journal *j, int first, int count) {
+    if(j->head + count + 2 > j->nblocks) {
+        journal_checkpoint(img, j);
+    } else if(j->home_writes > 0) {
+        // the data the transaction's metadata points at goes first
+        journal_sync_home(img, j);
+    }
+
+    const unsigned char *data = j->data + (size_t)first * BLOCK_SIZE;
+    unsigned char desc[BLOCK_SIZE] = {0};
+    unsigned char commit[BLOCK_SIZE] = {0};
+    write_u32(desc, JOURNAL_DESC_MAGIC);
+    write_u32(desc + 4, j->seq);
+    write_u32(desc + 8, count);
+    write_u32_many(desc + 12, (const unsigned int *)j->block_nums + first, count);
+    write_u32(commit, JOURNAL_COMMIT_MAGIC);
+    write_u32(commit + 4, j->seq);
+    write_u32(commit + 8, count);
+    write_u32(commit + 12, journal_checksum(desc, data, count));
+
+    int n = count + 2;
+    int *nums = malloc(n * sizeof(int));
+    unsigned char **blocks = malloc(n * sizeof(unsigned char *));
+    if(nums == NULL || blocks == NULL) {
+        perror("Error allocating journal commit\n");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < n; i++) {
+        nums[i] = j->start + j->head + i;
+    }
+    blocks[0] = desc;
+    for(int i = 0; i < count; i++) {
+        blocks[i + 1] = (unsigned char *)data + (size_t)i * BLOCK_SIZE;
+    }
+    blocks[n - 1] = commit;
+    block_rw_many_raw(img, nums, blocks, n, 1);
+    block_sync_raw(img);
+
+    // the transaction is durable, so its blocks may now reach their homes
+    for(int i = first; i < first + count; i++) {
+        block_write_home(img, j->block_nums[i], j->data + (size_t)i * BLOCK_SIZE);
+        block_index_put(&j->logged, j->block_nums[i], 0);
+    }
+    j->head += n;
+    j->seq++;
+    j->stats.commits++;
+    j->stats.blocks += count;
+    free(nums);
+    free(blocks);
+}
+
+// Commits the running transaction. Called with the lock held and no
+// operation open, so it only ever holds whole operations. One that grew
+// past max_blocks is written as several transactions, the only case in
+// which a crash can leave part of an operation behind.
+static void journal_commit_locked(struct image *img, struct journal *j) {
+    j->ops = 0;
+    for(int first = 0; first < j->count; first += j->max_blocks) {
+        int count = j->count - first < j->max_blocks ? j->count - first : j->max_blocks;
+        journal_write_transaction(img, j, first, count);
+    }
+    j->count = 0;
+    block_index_clear(&j->running);
+}
+
+// Writes every committed transaction in the journal home, stopping at the
+// first one that is missing, left over from before a checkpoint, or torn
+static void journal_replay(struct image *img, struct journal *j) {
+    int *nums = malloc((j->max_blocks + 1) * sizeof(int));
+    unsigned char **blocks = malloc((j->max_blocks + 1) * sizeof(unsigned char *));
+    unsigned char *data = malloc((size_t)(j->max_blocks + 1) * BLOCK_SIZE);
+    if(nums == NULL || blocks == NULL || data == NULL) {
+        perror("Error allocating journal replay\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned char desc[BLOCK_SIZE];
+    int pos = 1;
+    while(pos + 3 <= j->nblocks) {
+        block_read_raw(img, j->start + pos, desc);
+        int count = read_u32(desc + 8);
+        if(read_u32(desc) != JOURNAL_DESC_MAGIC || read_u32(desc + 4) != j->seq ||
+                count < 1 || count > j->max_blocks || pos + count + 2 > j->nblocks) {
+            break;
+        }
+        for(int i = 0; i <= count; i++) {
+            nums[i] = j->start + pos + 1 + i;
+            blocks[i] = data + (size_t)i * BLOCK_SIZE;
+        }
+        block_rw_many_raw(img, nums, blocks, count + 1, 0);
+        const unsigned char *commit = blocks[count];
+        if(read_u32(commit) != JOURNAL_COMMIT_MAGIC || read_u32(commit + 4) != j->seq ||
+                (int)read_u32(commit + 8) != count || read_u32(commit + 12) != journal_checksum(desc, data, count)) {
+            break;
+        }
+        read_u32_many(desc + 12, (unsigned int *)nums, count);
+        block_rw_many_raw(img, nums, blocks, count, 1);
+        pos += count + 2;
+        j->seq++;
+        j->stats.replayed++;
+    }
+    if(j->stats.replayed > 0) {
+        block_sync_raw(img);
+        journal_write_header(img, j);
+    }
+    free(nums);
+    free(blocks);
+    free(data);
+}
+
+// Sets up the journal of an image that has one, replaying whatever was
+// committed but may not have reached home before the image was last
+// closed. Returns 0, or -1 if the journal could not be set up.
+int journal_load(struct image *img) {
+    img->journal = NULL;
+    if(img->sb.journal_blocks == 0) {
+        return 0;
+    }
+    struct journal *j = calloc(1, sizeof(struct journal));
+    if(j == NULL) {
+        perror("Error allocating journal\n");
+        return -1;
+    }
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->idle, NULL);
+    j->start = img->sb.journal_start;
+    j->nblocks = img->sb.journal_blocks;
+    j->max_blocks = j->nblocks - 3 < JOURNAL_DESC_MAX_BLOCKS ? j->nblocks - 3 : JOURNAL_DESC_MAX_BLOCKS;
+    j->head = 1;
+
+    // the journal of a freshly made image reads back as zeros
+    unsigned char header[BLOCK_SIZE];
+    block_read_raw(img, j->start, header);
+    j->seq = read_u32(header) == JOURNAL_MAGIC ? read_u32(header + 4) : 1;
+    journal_replay(img, j);
+    img->journal = j;
+    return 0;
+}
+
+static void journal_free(struct journal *j) {
+    block_index_release(&j->running);
+    block_index_release(&j->logged);
+    free(j->block_nums);
+    free(j->data);
+    pthread_cond_destroy(&j->idle);
+    pthread_mutex_destroy(&j->lock);
+    free(j);
+}
+
+// Commits what is left and checkpoints, so the image has nothing to
+// replay, then frees the journal. Called when the image is closed.
+void journal_destroy(struct image *img) {
+    struct journal *j = img->journal;
+    if(j == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&j->lock);
+    journal_commit_locked(img, j);
+    if(j->head > 1) {
+        journal_checkpoint(img, j);
+    }
+    pthread_mutex_unlock(&j->lock);
+    img->journal = NULL;
+    journal_free(j);
+}
+
+// Throws the journal and its running transaction away without writing
+// anything, because the image is being rewritten
+void journal_forget_image(struct image *img) {
+    if(img->journal != NULL) {
+        journal_free(img->journal);
+        img->journal = NULL;
+    }
+}
+
+// Called for every block written through the block layer. Returns 1 if
+// the block joined the running transaction, because this thread has an
+// operation open or the block is in the transaction or logged already, or
+// 0 if it should go straight home. What other threads write outside an
+// operation stays out of the journal, and so does file data (metadata 0)
+// unless the block last held metadata that is still logged.
+int journal_capture(struct image *img, int block_num, const unsigned char *block, int metadata) {
+    struct journal *j = img->journal;
+    if(j == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&j->lock);
+    int slot = block_index_find(&j->running, block_num);
+    if(slot == -1 && (journal_depth == 0 || !metadata) && block_index_find(&j->logged, block_num) == -1) {
+        j->home_writes++;
+        pthread_mutex_unlock(&j->lock);
+        return 0;
+    }
+    if(slot == -1) {
+        // with an operation open the transaction grows past max_blocks
+        // rather than commit half of it; journal_begin() holds new ones off
+        if(j->count >= j->max_blocks && j->handles == 0) {
+            journal_commit_locked(img, j);
+        }
+        if(j->count == j->cap) {
+            j->cap = j->cap == 0 ? 16 : j->cap * 2;
+            j->block_nums = realloc(j->block_nums, j->cap * sizeof(int));
+            j->data = realloc(j->data, (size_t)j->cap * BLOCK_SIZE);
+            if(j->block_nums == NULL || j->data == NULL) {
+                perror("Error allocating journal transaction\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        slot = j->count++;
+        j->block_nums[slot] = block_num;
+        block_index_put(&j->running, block_num, slot);
+    }
+    memcpy(j->data + (size_t)slot * BLOCK_SIZE, block, BLOCK_SIZE);
+    pthread_mutex_unlock(&j->lock);
+    return 1;
+}
+
+// Copies the block's contents in the running transaction into block.
+// Returns 1, or 0 if the block is not in it.
+int journal_read(struct image *img, int block_num, unsigned char *block) {
+    struct journal *j = img->journal;
+    if(j == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&j->lock);
+    int slot = block_index_find(&j->running, block_num);
+    if(slot != -1) {
+        memcpy(block, j->data + (size_t)slot * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return slot != -1;
+}
+
+int journal_contains(struct image *img, int block_num) {
+    struct journal *j = img->journal;
+    if(j == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&j->lock);
+    int slot = block_index_find(&j->running, block_num);
+    pthread_mutex_unlock(&j->lock);
+    return slot != -1;
+}
+
+// Commits the running transaction of the given image now. Operations other
+// threads have open are waited for; one this thread is in the middle of
+// keeps the transaction open. Returns 1 if a transaction was committed,
+// which also synced everything written to the image before it, or 0.
+int journal_commit_img(struct image *img) {
+    struct journal *j = img->journal;
+    if(j == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&j->lock);
+    if(journal_depth == 0) {
+        j->waiting++;
+        while(j->handles > 0) {
+            pthread_cond_wait(&j->idle, &j->lock);
+        }
+        j->waiting--;
+    }
+    int committed = j->handles == 0 && j->count > 0;
+    if(committed) {
+        journal_commit_locked(img, j);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return committed;
+}
+
+// Whether the running transaction should take no more operations
+static int journal_due(const struct journal *j) {
+    return j->count > j->max_blocks / 2 || j->ops >= journal_batch || j->waiting > 0;
+}
+
+// Starts an operation whose block writes must reach the image together.
+// Operations may nest; the outermost journal_end() closes it.
+void journal_begin(void) {
+    struct image *img = image_current();
+    struct journal *j = img->journal;
+    if(j == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&j->lock);
+    if(journal_depth == 0) {
+        while(j->exclusive || (j->handles > 0 && journal_due(j))) {
+            pthread_cond_wait(&j->idle, &j->lock);
+        }
+        // rather than risk the operation not fitting, start a new transaction
+        if(j->handles == 0 && j->count > j->max_blocks / 2) {
+            journal_commit_locked(img, j);
+        }
+    }
+    journal_depth++;
+    j->handles++;
+    pthread_mutex_unlock(&j->lock);
+}
+
+// Starts an operation that runs with no other open, for writing the
+// changed inodes back from outside one: waits for the open operations to
+// end and keeps new ones out until journal_end_exclusive(). Returns 1, or
+// 0 without waiting if the image has no journal or this thread already
+// has an operation open, whose transaction the writes then join.
+int journal_begin_exclusive(struct image *img) {
+    struct journal *j = img->journal;
+    if(j == NULL || journal_depth > 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&j->lock);
+    j->waiting++;
+    while(j->handles > 0 || j->exclusive) {
+        pthread_cond_wait(&j->idle, &j->lock);
+    }
+    j->waiting--;
+    j->exclusive = 1;
+    journal_depth++;
+    j->handles++;
+    pthread_mutex_unlock(&j->lock);
+    return 1;
+}
+
+// Ends what journal_begin_exclusive() started if it returned 1, and lets
+// new operations in again
+void journal_end_exclusive(struct image *img, int exclusive) {
+    struct journal *j = img->journal;
+    if(!exclusive) {
+        return;
+    }
+    pthread_mutex_lock(&j->lock);
+    journal_depth--;
+    j->handles--;
+    j->exclusive = 0;
+    if(j->count >= j->max_blocks) {
+        journal_commit_locked(img, j);
+    }
+    pthread_cond_broadcast(&j->idle);
+    pthread_mutex_unlock(&j->lock);
+}
+
+// Ends an operation. Once journal_set_batch() operations have gathered
+// the transaction is committed. Under IMAGE_DURABLE_EACH_OP every
+// operation is committed before it returns, which is all it takes to make
+// it durable: one fdatasync() for any data it wrote and one for the
+// commit. Operations that end together share them.
+void journal_end(void) {
+    struct image *img = image_current();
+    struct journal *j = img->journal;
+    if(j == NULL) {
+        image_op_done(img);
+        return;
+    }
+    pthread_mutex_lock(&j->lock);
+    if(journal_depth == 1 && j->handles == 1) {
+        // the last one open writes every ended operation's inodes back,
+        // still inside its own operation, before another can begin
+        j->exclusive = 1;
+        pthread_mutex_unlock(&j->lock);
+        isync_image(img);
+        pthread_mutex_lock(&j->lock);
+        j->exclusive = 0;
+    }
+    journal_depth--;
+    j->handles--;
+    j->ops++;
+    j->stats.ops++;
+    int done = j->handles == 0;
+    int each_op = img->durability == IMAGE_DURABLE_EACH_OP;
+    if(done) {
+        if(j->ops >= journal_batch || each_op || j->count >= j->max_blocks) {
+            journal_commit_locked(img, j);
+        }
+        j->drains++;
+        pthread_cond_broadcast(&j->idle);
+    } else if(each_op && journal_depth == 0) {
+        // the last operation to end commits this one too
+        unsigned long drains = j->drains;
+        j->waiting++;
+        while(j->drains == drains) {
+            pthread_cond_wait(&j->idle, &j->lock);
+        }
+        j->waiting--;
+    }
+    pthread_mutex_unlock(&j->lock);
+    if(done && !each_op) {
+        image_op_done(img);
+    }
+}
+
+// Makes every operation ended so far durable
+void journal_commit(void) {
+    journal_commit_img(image_current());
+}
+
+void journal_get_stats(struct journal_stats *stats) {
+    struct journal *j = image_current()->journal;
+    if(j == NULL) {
+        memset(stats, 0, sizeof(struct journal_stats));
+        return;
+    }
+    pthread_mutex_lock(&j->lock);
+    *stats = j->stats;
+    pthread_mutex_unlock(&j->lock);
+}
+
+void journal_reset_stats(void) {
+    struct journal *j = image_current()->journal;
+    if(j == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&j->lock);
+    memset(&j->stats, 0, sizeof(struct journal_stats));
+    pthread_mutex_unlock(&j->lock);
+}
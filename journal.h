@@ -0,0 +1,40 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_MAGIC 0x4a524e4c            // "JRNL", the journal's header block
+#define JOURNAL_DESC_MAGIC 0x4a444553       // "JDES", starts a transaction
+#define JOURNAL_COMMIT_MAGIC 0x4a434d54     // "JCMT", ends a transaction
+#define JOURNAL_DEFAULT_BLOCKS 64           // reserved by mkfs() unless told otherwise
+#define JOURNAL_MIN_BLOCKS 4                // header, descriptor, one block and commit
+#define JOURNAL_DEFAULT_BATCH 64            // operations grouped into one commit
+#define JOURNAL_DESC_MAX_BLOCKS ((BLOCK_SIZE - 12) / 4)
+
+struct image;
+struct journal;
+
+struct journal_stats {
+    unsigned long ops;          // transactions closed with journal_end()
+    unsigned long commits;      // group commits written to the journal
+    unsigned long blocks;       // metadata blocks written to the journal
+    unsigned long checkpoints;  // times the journal was emptied
+    unsigned long replayed;     // committed transactions replayed when the image was opened
+};
+
+int journal_load(struct image *img);
+void journal_destroy(struct image *img);
+void journal_forget_image(struct image *img);
+int journal_capture(struct image *img, int block_num, const unsigned char *block, int metadata);
+int journal_read(struct image *img, int block_num, unsigned char *block);
+int journal_contains(struct image *img, int block_num);
+int journal_commit_img(struct image *img);
+void journal_begin(void);
+void journal_end(void);
+int journal_begin_exclusive(struct image *img);
+void journal_end_exclusive(struct image *img, int exclusive);
+void journal_commit(void);
+void journal_set_batch(int ops);
+int journal_max_blocks(void);
+void journal_get_stats(struct journal_stats *stats);
+void journal_reset_stats(void);
+
+#endif
@@ -1,14 +1,19 @@
 #include <stdio.h>
 #include "mkfs.h"
 
+#define LS_BATCH 64
+
 void ls(void) {
     struct directory *dir;
-    struct directory_entry ent;
+    struct directory_entry ents[LS_BATCH];
+    int n;
 
     dir = directory_open(0);
 
-    while (directory_get(dir, &ent) != -1) {
-        printf("%d %s\n", ent.inode_num, ent.name);
+    while ((n = directory_get_many(dir, ents, LS_BATCH)) > 0) {
+        for (int i = 0; i < n; i++) {
+            printf("%d %s\n", ents[i].inode_num, ents[i].name);
+        }
     }
 
     directory_close(dir);
@@ -1,83 +1,142 @@
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include "image.h"
 #include "block.h"
+#include "bcache.h"
 #include "inode.h"
 #include "pack.h"
+#include "free.h"
 #include "mkfs.h"
+#include "dcache.h"
+#include "dir.h"
+#include "readahead.h"
+#include "superblock.h"
+#include "journal.h"
 
 #define BLOCK_SIZE 4096
 
 
 
 // Call image_open() to open image to use
-// then call mkfs() to create the starting file system in that image
-
-// write 1024 blocks of all zero bytes, sequentially, using the write() call
-// mark data blocks 0-6 as allocated by calling alloc() 7 times
-void mkfs(void){
-
-    // create a block and set all bytes to 0
-    char block[BLOCK_SIZE] = {0};
+// then call mkfs() to create the starting file system in that image,
+// or mkfs_opts() to choose its geometry
+
+void mkfs_default_opts(struct mkfs_opts *opts) {
+    opts->nblocks = NUM_BLOCKS;
+    opts->ninodes = NUM_INODES;
+    opts->block_size = BLOCK_SIZE;
+    opts->preallocate = 0;
+    opts->journal_blocks = JOURNAL_DEFAULT_BLOCKS;
+}
 
-    // loop through 1024 blocks, setting every block to a block of all 0 bytes
-    for(int i = 0; i < NUM_BLOCKS; i++) {
-        ssize_t bytes_written = write(image_fd, block, BLOCK_SIZE);
-        if (bytes_written == -1) {
-            perror("Failed to write block");
-            exit(EXIT_FAILURE);
-        } else if (bytes_written < BLOCK_SIZE) {
-            fprintf(stderr, "Failed to write full block\n");
+// sizes the image file to the geometry, dropping whatever it held: sparse
+// by default, or with every block reserved up front if preallocate is set
+static void mkfs_size_image(struct image *img, off_t size, int preallocate) {
+    // a mapped image must not shrink under its mapping
+    if(img->map != NULL && size < (off_t)img->map_blocks * BLOCK_SIZE) {
+        size = (off_t)img->map_blocks * BLOCK_SIZE;
+    }
+    if(ftruncate(img->fd, 0) == -1 || ftruncate(img->fd, size) == -1) {
+        perror("Error sizing image in mkfs\n");
+        exit(EXIT_FAILURE);
+    }
+    if(preallocate) {
+        int err = posix_fallocate(img->fd, 0, size);
+        if(err != 0) {
+            fprintf(stderr, "Error preallocating image in mkfs: %s\n", strerror(err));
             exit(EXIT_FAILURE);
         }
     }
+}
 
-    // loop through the first 7 blocks, marking them as allocated
-    for(int i = 0; i < 7; i++) {
-        int byte_index = alloc();
-        if(byte_index == -1) {
-            fprintf(stderr, "Error allocating block number %d\n", i);
-            exit(EXIT_FAILURE);
-        }
+// Builds a fresh file system in the image: sizes the image file, which
+// leaves every block reading as zeros, then fills in the few metadata
+// blocks that are not all zeros in memory and writes them with one
+// vectored write. Those are the superblock, the start of the inode map and
+// block map, the root inode's inode-table block and the root directory.
+// The journal region is left zeroed.
+// opts may be NULL to get mkfs_default_opts().
+// Returns 0, or -1 if the geometry cannot be laid out.
+int mkfs_opts(struct mkfs_opts *opts) {
+    struct mkfs_opts defaults;
+    if(opts == NULL) {
+        mkfs_default_opts(&defaults);
+        opts = &defaults;
+    }
+    struct superblock sb;
+    if(superblock_layout(&sb, opts->nblocks, opts->ninodes, opts->block_size, opts->journal_blocks) == -1) {
+        fprintf(stderr, "Error in mkfs: cannot lay out %u blocks and %u inodes\n", opts->nblocks, opts->ninodes);
+        return -1;
     }
 
-    // create the root directory
-    // get a new inode
-    struct inode *root_inode = ialloc();
-    if (root_inode == NULL) {
-        fprintf(stderr, "Error allocating inode in mkfs");
+    // the image is about to be rewritten, so nothing cached is still valid,
+    // and the flusher must not sync it halfway
+    struct image *img = image_current();
+    pthread_mutex_lock(&img->flush_lock);
+    journal_forget_image(img);
+    bcache_invalidate(img);
+    freemap_forget_image(img);
+    inode_forget_image(img);
+    dcache_forget_image(img);
+    mkfs_size_image(img, (off_t)sb.nblocks * BLOCK_SIZE, opts->preallocate);
+    img->sb = sb;
+
+    // the metadata blocks and the root directory's block are marked in use;
+    // they fill the start of the block map
+    int used = sb.data_start + 1;
+    int map_blocks = (used + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8);
+
+    // everything up to the end of those block map blocks, then the first
+    // inode-table block and the root directory
+    int nblocks = sb.block_map_start + map_blocks + 2;
+    int *block_nums = malloc(nblocks * sizeof(int));
+    unsigned char **blocks = malloc(nblocks * sizeof(unsigned char *));
+    unsigned char *data = calloc(nblocks, BLOCK_SIZE);
+    if(block_nums == NULL || blocks == NULL || data == NULL) {
+        perror("Error allocating mkfs\n");
         exit(EXIT_FAILURE);
     }
+    for(int i = 0; i < nblocks; i++) {
+        block_nums[i] = i < nblocks - 2 ? i : (i == nblocks - 2 ? (int)sb.inode_table_start : (int)sb.data_start);
+        blocks[i] = data + (size_t)i * BLOCK_SIZE;
+    }
+    unsigned char *inode_table = blocks[nblocks - 2];
+    unsigned char *dir_data_block = blocks[nblocks - 1];
 
-    // get a new block
-    int block_num = alloc();
-    if (block_num == -1) {
-        fprintf(stderr, "Error allocating block in mkfs");
-        exit(EXIT_FAILURE);
+    superblock_pack(blocks[SUPERBLOCK_NUM], &sb);
+    set_free(blocks[sb.inode_map_start], ROOT_INODE_NUM, 1);
+    for(int i = 0; i < used; i++) {
+        set_free(blocks[sb.block_map_start], i, 1);
     }
 
-    // initialize root inode
-    root_inode->flags = 2;
-    root_inode->size = DIR_ENTRY_SIZE * 2;
-    root_inode->link_count = 1;
-    root_inode->block_ptr[0] = block_num;
-
-    // array to populate with new directory data
-    unsigned char dir_data_block[BLOCK_SIZE];
-    int entry_num = 0;
-    write_u16(dir_data_block + (entry_num * DIR_ENTRY_SIZE), root_inode->inode_num);
-    strcpy((char *)dir_data_block + (entry_num * DIR_ENTRY_SIZE) + DIR_NAME_OFFSET, ".");
-
-    entry_num = 1;
-    write_u16(dir_data_block + (entry_num * DIR_ENTRY_SIZE), root_inode->inode_num);
-    strcpy((char *)dir_data_block + (entry_num * DIR_ENTRY_SIZE) + DIR_NAME_OFFSET, "..");
-
-    // write the dir data block back out to disk
-    iput(root_inode);
-    bwrite(block_num, dir_data_block);
-    
+    // the root directory, holding "." and ".."
+    struct inode root_inode = {0};
+    root_inode.inode_num = ROOT_INODE_NUM;
+    root_inode.flags = INODE_FLAG_DIR;
+    root_inode.size = DIR_ENTRY_SIZE * 2;
+    root_inode.link_count = 1;
+    root_inode.block_ptr[0] = sb.data_start;
+    pack_inode(inode_table, &root_inode);
+
+    struct directory_entry entries[2] = {{ROOT_INODE_NUM, "."}, {ROOT_INODE_NUM, ".."}};
+    encode_dir_block(dir_data_block, entries, 2);
+
+    block_rw_many_raw(img, block_nums, blocks, nblocks, 1);
+
+    free(block_nums);
+    free(blocks);
+    free(data);
+    // the journal is all zeros, which reads back as an empty one
+    int ret = journal_load(img);
+    pthread_mutex_unlock(&img->flush_lock);
+    return ret;
+}
+
+void mkfs(void) {
+    mkfs_opts(NULL);
 }
 
 struct directory *directory_open(int inode_num) {
@@ -93,40 +152,75 @@ struct directory *directory_open(int inode_num) {
     // in struct, set the inode pointer to point to the inode returned by iget()
     dir->inode = dir_inode;
 
-    // initialize offset to 0
+    // initialize offset to 0, with no block pinned yet
     dir->offset = 0;
+    dir->block = NULL;
+    dir->block_index = -1;
 
     // return the pointer to the struct
     return dir;
 }
 
-int directory_get(struct directory *dir, struct directory_entry *ent) {
-    // If offset is greater than or equal to the dir size, we must be off the end of the dir
-    if(dir->offset >= dir->inode->size) {
-        return -1;
-    }
-
-    // Compute the block in the dir we need to read
+// Makes sure the directory block holding the entry at dir->offset is the
+// pinned one, so walking a block's entries costs a single block lookup
+static const unsigned char *directory_pin(struct directory *dir) {
     int data_block_index = dir->offset / BLOCK_SIZE;
-    int data_block_num = dir->inode->block_ptr[data_block_index];
-
-    // read the block containing the dir entry into memory
-    unsigned char block[BLOCK_SIZE] = {0};
-    bread(data_block_num, block);
+    if(dir->block == NULL || dir->block_index != data_block_index) {
+        if(dir->block != NULL) {
+            brelse(dir->block);
+        }
+        readahead(dir->inode, data_block_index, 1, (dir->inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        dir->block = bread_ref(directory_block_num(dir->inode, data_block_index));
+        dir->block_index = data_block_index;
+    }
+    return dir->block;
+}
 
-    // Compute the offset of the dir entry in the block we just read
-    int offset_in_block = dir->offset % BLOCK_SIZE;
+int directory_get(struct directory *dir, struct directory_entry *ent) {
+    return directory_get_many(dir, ent, 1) == 1 ? 0 : -1;
+}
 
-    // Extract the directory entry from the raw data in the block into the dir entry passed in
-    ent->inode_num = read_u16(block + offset_in_block);
-    strcpy(ent->name, (char *) block + offset_in_block + DIR_NAME_OFFSET);
+// Reads up to max entries into ents, decoding a whole pinned block's worth
+// at a time. Returns how many were read, 0 at the end of the directory.
+int directory_get_many(struct directory *dir, struct directory_entry *ents, int max) {
+    int n = 0;
+    while(n < max && dir->offset < dir->inode->size) {
+        const unsigned char *block = directory_pin(dir);
+        unsigned int block_end = (dir->offset / BLOCK_SIZE + 1) * BLOCK_SIZE;
+        if(block_end > dir->inode->size) {
+            block_end = dir->inode->size;
+        }
+        int count = (block_end - dir->offset) / DIR_ENTRY_SIZE;
+        if(count > max - n) {
+            count = max - n;
+        }
+        decode_dir_block(block + dir->offset % BLOCK_SIZE, &ents[n], count);
+        dir->offset += count * DIR_ENTRY_SIZE;
+        n += count;
+    }
+    return n;
+}
 
-    dir->offset += DIR_ENTRY_SIZE;
+// Returns a cookie for the current position, which directory_seek() can
+// return to, even on a directory opened later on
+unsigned int directory_tell(struct directory *dir) {
+    return dir->offset;
+}
 
+// Moves to a position from directory_tell(). Returns 0, or -1 if the
+// cookie does not fall on an entry of this directory.
+int directory_seek(struct directory *dir, unsigned int cookie) {
+    if(cookie % DIR_ENTRY_SIZE != 0 || cookie > dir->inode->size) {
+        return -1;
+    }
+    dir->offset = cookie;
     return 0;
 }
 
 void directory_close(struct directory *d) {
+    if(d->block != NULL) {
+        brelse(d->block);
+    }
     iput(d->inode);
     free(d);
 }
@@ -3,11 +3,21 @@
 
 #define DIR_ENTRY_SIZE 32
 #define DIR_NAME_OFFSET 2
-#define NUM_BLOCKS 1024
+#define NUM_BLOCKS 1024             // blocks in the default geometry
+
+struct mkfs_opts {
+    unsigned int nblocks;
+    unsigned int ninodes;
+    unsigned int block_size;    // must match BLOCK_SIZE
+    int preallocate;            // reserve every block up front instead of leaving the image sparse
+    unsigned int journal_blocks;    // size of the metadata journal, 0 for none
+};
 
 struct directory {
     struct inode *inode;
     unsigned int offset;
+    const unsigned char *block;     // pinned directory block, or NULL
+    int block_index;                // which of the directory's blocks is pinned
 };
 
 struct directory_entry {
@@ -15,9 +25,14 @@ struct directory_entry {
     char name[16];
 };
 
+void mkfs_default_opts(struct mkfs_opts *opts);
+int mkfs_opts(struct mkfs_opts *opts);
 void mkfs(void);
 struct directory *directory_open(int inode_num);
 int directory_get(struct directory *dir, struct directory_entry *ent);
+int directory_get_many(struct directory *dir, struct directory_entry *ents, int max);
+unsigned int directory_tell(struct directory *dir);
+int directory_seek(struct directory *dir, unsigned int cookie);
 void directory_close(struct directory *d);
 
 #endif
\ No newline at end of file
@@ -1,45 +1,72 @@
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "pack.h"
+#include "bcache.h"
+#include "inode.h"
+#include "mkfs.h"
 
-unsigned int read_u32(void *addr)
+// Everything on disk is big-endian. Single values are loaded with memcpy()
+// and byte-swapped with the compiler's builtins, which turn into one load
+// and one bswap/movbe. Runs of u32s, like an inode's block pointers, are
+// swapped 4 at a time with an SSSE3 byte shuffle where the CPU has one.
+
+static int simd_level = -1;     // PACK_SIMD_*, -1 until first use
+
+static unsigned int be32(unsigned int value)
 {
-    unsigned char *bytes = addr;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap32(value);
+#else
+    return value;
+#endif
+}
 
-    return (bytes[0] << 24) |
-        (bytes[1] << 16) |
-        (bytes[2] << 8) |
-        (bytes[3] << 0);
+static unsigned short be16(unsigned short value)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap16(value);
+#else
+    return value;
+#endif
 }
 
-unsigned short read_u16(void *addr)
+unsigned int read_u32(const void *addr)
 {
-    unsigned char *bytes = addr;
+    unsigned int value;
 
-    return (bytes[0] << 8) | (bytes[1] << 0);
+    memcpy(&value, addr, 4);
+    return be32(value);
 }
 
-unsigned char read_u8(void *addr)
+unsigned short read_u16(const void *addr)
 {
-    unsigned char *bytes = addr;
+    unsigned short value;
+
+    memcpy(&value, addr, 2);
+    return be16(value);
+}
+
+unsigned char read_u8(const void *addr)
+{
+    const unsigned char *bytes = addr;
 
     return bytes[0];
 }
 
 void write_u32(void *addr, unsigned long value)
 {
-    unsigned char *bytes = addr;
+    unsigned int bytes = be32(value);
 
-    bytes[0] = (value >> 24) & 0xff;
-    bytes[1] = (value >> 16) & 0xff;
-    bytes[2] = (value >> 8) & 0xff;
-    bytes[3] = value & 0xff;
+    memcpy(addr, &bytes, 4);
 }
 
 void write_u16(void *addr, unsigned int value)
 {
-    unsigned char *bytes = addr;
+    unsigned short bytes = be16(value);
 
-    bytes[0] = (value >> 8) & 0xff;
-    bytes[1] = value & 0xff;
+    memcpy(addr, &bytes, 2);
 }
 
 void write_u8(void *addr, unsigned char value)
@@ -49,3 +76,206 @@ void write_u8(void *addr, unsigned char value)
     bytes[0] = value;
 }
 
+static void swap_u32_scalar(const unsigned char *src, unsigned char *dst, int n)
+{
+    for(int i = 0; i < n; i++) {
+        unsigned int value;
+        memcpy(&value, src + i * 4, 4);
+        value = be32(value);
+        memcpy(dst + i * 4, &value, 4);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// reverses the bytes of each u32 in 16 bytes at a time; src and dst need
+// not be aligned
+__attribute__((target("ssse3")))
+static void swap_u32_ssse3(const unsigned char *src, unsigned char *dst, int n)
+{
+    const __m128i reverse = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    int i = 0;
+    for(; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_shuffle_epi8(v, reverse));
+    }
+    swap_u32_scalar(src + i * 4, dst + i * 4, n - i);
+}
+#endif
+
+// Picks the widest byte shuffle the CPU supports, capped at level.
+// Returns the level actually in use.
+int pack_use_simd(int level)
+{
+    int best = PACK_SIMD_NONE;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("ssse3")) {
+        best = PACK_SIMD_SSSE3;
+    }
+#endif
+    simd_level = level < best ? level : best;
+    return simd_level;
+}
+
+// converts n u32s between big-endian and host order
+static void swap_u32(const void *src, void *dst, int n)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if(simd_level == -1) {
+        pack_use_simd(PACK_SIMD_SSSE3);
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if(simd_level == PACK_SIMD_SSSE3) {
+        swap_u32_ssse3(src, dst, n);
+        return;
+    }
+#endif
+    swap_u32_scalar(src, dst, n);
+#else
+    memmove(dst, src, (size_t)n * 4);
+#endif
+}
+
+void read_u32_many(const void *addr, unsigned int *values, int n)
+{
+    swap_u32(addr, values, n);
+}
+
+void write_u32_many(void *addr, const unsigned int *values, int n)
+{
+    swap_u32(values, addr, n);
+}
+
+// Unpacks one inode-table slot into the on-disk fields of in
+void decode_inode(const unsigned char *slot, struct inode *in)
+{
+    in->size = read_u32(slot);
+    in->owner_id = read_u16(slot + 4);
+    in->permissions = slot[6];
+    in->flags = slot[7];
+    in->link_count = slot[8];
+    read_u32_many(slot + INODE_PTR_OFFSET, in->block_ptr, INODE_PTR_COUNT);
+    in->indirect = read_u32(slot + INODE_INDIRECT_OFFSET);
+}
+
+// Packs the on-disk fields of in into one inode-table slot
+void encode_inode(unsigned char *slot, const struct inode *in)
+{
+    write_u32(slot, in->size);
+    write_u16(slot + 4, in->owner_id);
+    slot[6] = in->permissions;
+    slot[7] = in->flags;
+    slot[8] = in->link_count;
+    write_u32_many(slot + INODE_PTR_OFFSET, in->block_ptr, INODE_PTR_COUNT);
+    write_u32(slot + INODE_INDIRECT_OFFSET, in->indirect);
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// Whole-block versions that keep the shuffle mask in a register and swap
+// each slot's 12 block pointers with three shuffles
+__attribute__((target("ssse3")))
+static void decode_inode_block_ssse3(const unsigned char *block, struct inode *inodes)
+{
+    const __m128i reverse = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    for(int i = 0; i < INODES_PER_BLOCK; i++) {
+        const unsigned char *slot = block + i * INODE_SIZE;
+        struct inode *in = &inodes[i];
+        unsigned int size, indirect;
+        unsigned short owner_id;
+        memcpy(&size, slot, 4);
+        memcpy(&owner_id, slot + 4, 2);
+        memcpy(&indirect, slot + INODE_INDIRECT_OFFSET, 4);
+        in->size = __builtin_bswap32(size);
+        in->owner_id = __builtin_bswap16(owner_id);
+        in->permissions = slot[6];
+        in->flags = slot[7];
+        in->link_count = slot[8];
+        for(int j = 0; j < INODE_PTR_COUNT; j += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(slot + INODE_PTR_OFFSET + j * 4));
+            _mm_storeu_si128((__m128i *)&in->block_ptr[j], _mm_shuffle_epi8(v, reverse));
+        }
+        in->indirect = __builtin_bswap32(indirect);
+    }
+}
+
+__attribute__((target("ssse3")))
+static void encode_inode_block_ssse3(unsigned char *block, const struct inode *inodes)
+{
+    const __m128i reverse = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    for(int i = 0; i < INODES_PER_BLOCK; i++) {
+        unsigned char *slot = block + i * INODE_SIZE;
+        const struct inode *in = &inodes[i];
+        unsigned int size = __builtin_bswap32(in->size);
+        unsigned short owner_id = __builtin_bswap16(in->owner_id);
+        unsigned int indirect = __builtin_bswap32(in->indirect);
+        memcpy(slot, &size, 4);
+        memcpy(slot + 4, &owner_id, 2);
+        slot[6] = in->permissions;
+        slot[7] = in->flags;
+        slot[8] = in->link_count;
+        for(int j = 0; j < INODE_PTR_COUNT; j += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)&in->block_ptr[j]);
+            _mm_storeu_si128((__m128i *)(slot + INODE_PTR_OFFSET + j * 4), _mm_shuffle_epi8(v, reverse));
+        }
+        memcpy(slot + INODE_INDIRECT_OFFSET, &indirect, 4);
+    }
+}
+#define HAVE_INODE_BLOCK_SSSE3
+#endif
+
+// Unpacks all INODES_PER_BLOCK inodes of an inode-table block
+void decode_inode_block(const unsigned char *block, struct inode *inodes)
+{
+    if(simd_level == -1) {
+        pack_use_simd(PACK_SIMD_SSSE3);
+    }
+#ifdef HAVE_INODE_BLOCK_SSSE3
+    if(simd_level == PACK_SIMD_SSSE3) {
+        decode_inode_block_ssse3(block, inodes);
+        return;
+    }
+#endif
+    for(int i = 0; i < INODES_PER_BLOCK; i++) {
+        decode_inode(block + i * INODE_SIZE, &inodes[i]);
+    }
+}
+
+void encode_inode_block(unsigned char *block, const struct inode *inodes)
+{
+    if(simd_level == -1) {
+        pack_use_simd(PACK_SIMD_SSSE3);
+    }
+#ifdef HAVE_INODE_BLOCK_SSSE3
+    if(simd_level == PACK_SIMD_SSSE3) {
+        encode_inode_block_ssse3(block, inodes);
+        return;
+    }
+#endif
+    for(int i = 0; i < INODES_PER_BLOCK; i++) {
+        encode_inode(block + i * INODE_SIZE, &inodes[i]);
+    }
+}
+
+// Unpacks the first n entries of a directory block. Names are copied 16
+// bytes at a time and always come back terminated.
+void decode_dir_block(const unsigned char *block, struct directory_entry *ents, int n)
+{
+    for(int i = 0; i < n; i++) {
+        const unsigned char *entry = block + i * DIR_ENTRY_SIZE;
+        ents[i].inode_num = read_u16(entry);
+        memcpy(ents[i].name, entry + DIR_NAME_OFFSET, sizeof(ents[i].name));
+        ents[i].name[sizeof(ents[i].name) - 1] = '\0';
+    }
+}
+
+// Packs n entries into the start of a directory block, clearing the
+// unused bytes of each entry
+void encode_dir_block(unsigned char *block, const struct directory_entry *ents, int n)
+{
+    memset(block, 0, (size_t)n * DIR_ENTRY_SIZE);
+    for(int i = 0; i < n; i++) {
+        unsigned char *entry = block + i * DIR_ENTRY_SIZE;
+        write_u16(entry, ents[i].inode_num);
+        strncpy((char *)entry + DIR_NAME_OFFSET, ents[i].name, sizeof(ents[i].name) - 1);
+    }
+}
@@ -1,11 +1,28 @@
 #ifndef PACK_H
 #define PACK_H
 
-unsigned int read_u32(void *addr);
-unsigned short read_u16(void *addr);
-unsigned char read_u8(void *addr);
+#define PACK_SIMD_NONE 0
+#define PACK_SIMD_SSSE3 1
+
+struct inode;
+struct directory_entry;
+
+unsigned int read_u32(const void *addr);
+unsigned short read_u16(const void *addr);
+unsigned char read_u8(const void *addr);
 void write_u32(void *addr, unsigned long value);
 void write_u16(void *addr, unsigned int value);
 void write_u8(void *addr, unsigned char value);
 
+void read_u32_many(const void *addr, unsigned int *values, int n);
+void write_u32_many(void *addr, const unsigned int *values, int n);
+int pack_use_simd(int level);
+
+void decode_inode(const unsigned char *slot, struct inode *in);
+void encode_inode(unsigned char *slot, const struct inode *in);
+void decode_inode_block(const unsigned char *block, struct inode *inodes);
+void encode_inode_block(unsigned char *block, const struct inode *inodes);
+void decode_dir_block(const unsigned char *block, struct directory_entry *ents, int n);
+void encode_dir_block(unsigned char *block, const struct directory_entry *ents, int n);
+
 #endif
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "image.h"
+#include "block.h"
+#include "inode.h"
+#include "readahead.h"
+
+// Sequential readahead, tracked per in-core inode. Each read of a file's or
+// directory's blocks is reported here. A read that starts where the last
+// one ended doubles the inode's window, up to readahead_max; any other read
+// halves it, and below READAHEAD_MIN_BLOCKS readahead stops. While the
+// window is open, the blocks after the read are brought into the buffer
+// cache with one batched read, and topped up again once the reader gets
+// within half a window of the end of what was read ahead.
+
+static int readahead_max = READAHEAD_DEFAULT_MAX_BLOCKS;
+static struct readahead_stats stats;      // shared by every thread, so updated atomically
+
+// Sets the largest readahead window in blocks; 0 turns readahead off
+void readahead_set_max(int blocks) {
+    readahead_max = blocks > 0 ? blocks : 0;
+}
+
+// Records a read of count blocks from block first of the inode's data,
+// which has nblocks blocks in all, and reads ahead if it looks sequential
+void readahead(struct inode *in, int first, int count, int nblocks) {
+    // never read ahead more than a quarter of the cache, or it evicts itself
+    struct image *img = image_current();
+    int max = readahead_max;
+    if(img->map == NULL && max > img->cache.nblocks / 4) {
+        max = img->cache.nblocks / 4;
+    }
+
+    if(first == in->ra_next) {
+        __atomic_fetch_add(&stats.sequential, 1, __ATOMIC_RELAXED);
+        in->ra_window = in->ra_window == 0 ? READAHEAD_MIN_BLOCKS : in->ra_window * 2;
+    } else {
+        __atomic_fetch_add(&stats.random, 1, __ATOMIC_RELAXED);
+        in->ra_window /= 2;
+        in->ra_end = 0;
+    }
+    if(in->ra_window > max) {
+        in->ra_window = max;
+    }
+    in->ra_next = first + count;
+    if(in->ra_window < READAHEAD_MIN_BLOCKS) {
+        return;
+    }
+
+    // wait until the reader is halfway through the last window
+    int start = in->ra_next > in->ra_end ? in->ra_next : in->ra_end;
+    if(start - in->ra_next > in->ra_window / 2) {
+        return;
+    }
+    int end = in->ra_next + in->ra_window;
+    if(end > nblocks) {
+        end = nblocks;
+    }
+    if(start >= end) {
+        return;
+    }
+
+    int *block_nums = malloc((end - start) * sizeof(int));
+    if(block_nums == NULL) {
+        return;
+    }
+    int n = 0;
+    for(int i = start; i < end; i++) {
+        int block_num = bmap(in, i);
+        if(block_num != 0) {
+            block_nums[n++] = block_num;
+        }
+    }
+    bprefetch_many(block_nums, n);
+    free(block_nums);
+
+    in->ra_end = end;
+    __atomic_fetch_add(&stats.windows, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.blocks, n, __ATOMIC_RELAXED);
+}
+
+void readahead_get_stats(struct readahead_stats *out) {
+    *out = stats;
+}
+
+void readahead_reset_stats(void) {
+    memset(&stats, 0, sizeof(stats));
+}
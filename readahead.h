@@ -0,0 +1,21 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_DEFAULT_MAX_BLOCKS 32
+
+struct inode;
+
+struct readahead_stats {
+    unsigned long sequential;   // reads that continued where the last one ended
+    unsigned long random;
+    unsigned long windows;      // readaheads issued
+    unsigned long blocks;       // blocks asked for by those readaheads
+};
+
+void readahead(struct inode *in, int first, int count, int nblocks);
+void readahead_set_max(int blocks);
+void readahead_get_stats(struct readahead_stats *stats);
+void readahead_reset_stats(void);
+
+#endif
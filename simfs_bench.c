@@ -0,0 +1,573 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "image.h"
+#include "block.h"
+#include "aio.h"
+#include "free.h"
+#include "mkfs.h"
+#include "inode.h"
+#include "pack.h"
+#include "file.h"
+#include "dir.h"
+
+// Microbenchmarks for the simfs library.
+// Run all of them with `make bench`, or name the ones to run:
+//   ./simfs_bench aio
+
+#define BENCH_IMAGE "bench_image.dat"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, long ops, double seconds) {
+    printf("  %-36s %10ld ops %9.3f s %12.0f ops/s\n", name, ops, seconds, ops / seconds);
+}
+
+// ---- random 4 KiB reads: synchronous vs asynchronous ----
+
+#define AIO_BENCH_BLOCKS 16384      // 64 MiB image
+#define AIO_BENCH_READS 50000
+
+static void make_bench_image(struct image *img, int nblocks) {
+    unsigned char *block = malloc(BLOCK_SIZE);
+    for(int i = 0; i < nblocks; i++) {
+        memset(block, i & 0xff, BLOCK_SIZE);
+        block_write_raw(img, i, block);
+    }
+    free(block);
+    fsync(img->fd);
+}
+
+// ask the kernel to forget the image's pages so every run starts cold
+static void drop_image_cache(struct image *img) {
+    posix_fadvise(img->fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// the block layer's original read path: lseek() to the block, then read()
+static double bench_lseek_read(struct image *img, const int *block_nums, int count) {
+    unsigned char block[BLOCK_SIZE];
+    double start = now();
+    for(int i = 0; i < count; i++) {
+        lseek(img->fd, (off_t)block_nums[i] * BLOCK_SIZE, SEEK_SET);
+        if(read(img->fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
+            perror("Error reading block");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return now() - start;
+}
+
+static double bench_pread(struct image *img, const int *block_nums, int count) {
+    unsigned char block[BLOCK_SIZE];
+    double start = now();
+    for(int i = 0; i < count; i++) {
+        block_read_raw(img, block_nums[i], block);
+    }
+    return now() - start;
+}
+
+static double bench_aio(struct image *img, const int *block_nums, int count, struct aio_opts *opts, int *backend) {
+    struct aio_engine *e = aio_create(img, opts);
+    if(e == NULL) {
+        fprintf(stderr, "Error creating aio engine\n");
+        exit(EXIT_FAILURE);
+    }
+    *backend = aio_backend(e);
+
+    int depth = opts->queue_depth;
+    struct aio_request *reqs = calloc(depth, sizeof(struct aio_request));
+    struct aio_request **free_reqs = calloc(depth, sizeof(struct aio_request *));
+    struct aio_request **done = calloc(depth, sizeof(struct aio_request *));
+    unsigned char *blocks = malloc((size_t)depth * BLOCK_SIZE);
+    for(int i = 0; i < depth; i++) {
+        reqs[i].block = blocks + (size_t)i * BLOCK_SIZE;
+        free_reqs[i] = &reqs[i];
+    }
+    int nfree = depth;
+
+    double start = now();
+    int submitted = 0;
+    int reaped = 0;
+    while(reaped < count) {
+        while(submitted < count && nfree > 0) {
+            struct aio_request *req = free_reqs[--nfree];
+            req->op = AIO_READ;
+            req->block_num = block_nums[submitted];
+            if(aio_submit(e, req) == -1) {
+                free_reqs[nfree++] = req;
+                break;
+            }
+            submitted++;
+        }
+        int n = aio_reap(e, done, 1, depth);
+        for(int i = 0; i < n; i++) {
+            if(done[i]->result != 0) {
+                fprintf(stderr, "Error in async read: %d\n", done[i]->result);
+                exit(EXIT_FAILURE);
+            }
+            free_reqs[nfree++] = done[i];
+        }
+        reaped += n;
+    }
+    double elapsed = now() - start;
+
+    aio_destroy(e);
+    free(reqs);
+    free(free_reqs);
+    free(done);
+    free(blocks);
+    return elapsed;
+}
+
+static void bench_random_reads(void) {
+    printf("random 4 KiB reads, %d blocks (%d MiB image), %d reads\n",
+           AIO_BENCH_BLOCKS, AIO_BENCH_BLOCKS * BLOCK_SIZE / (1024 * 1024), AIO_BENCH_READS);
+
+    struct image *img = image_attach(BENCH_IMAGE, 1);
+    make_bench_image(img, AIO_BENCH_BLOCKS);
+
+    int *block_nums = malloc(AIO_BENCH_READS * sizeof(int));
+    srand(1);
+    for(int i = 0; i < AIO_BENCH_READS; i++) {
+        block_nums[i] = rand() % AIO_BENCH_BLOCKS;
+    }
+
+    drop_image_cache(img);
+    report("sync lseek+read", AIO_BENCH_READS, bench_lseek_read(img, block_nums, AIO_BENCH_READS));
+    drop_image_cache(img);
+    report("sync pread", AIO_BENCH_READS, bench_pread(img, block_nums, AIO_BENCH_READS));
+
+    int depths[] = {1, 8, 32, 128};
+    int backends[] = {AIO_BACKEND_URING, AIO_BACKEND_THREADS};
+    for(int b = 0; b < 2; b++) {
+        for(unsigned d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+            struct aio_opts opts;
+            aio_default_opts(&opts);
+            opts.backend = backends[b];
+            opts.queue_depth = depths[d];
+            opts.batch_size = depths[d] >= 4 ? depths[d] / 4 : 1;
+            opts.threads = depths[d] < 16 ? depths[d] : 16;
+
+            int backend;
+            drop_image_cache(img);
+            double elapsed = bench_aio(img, block_nums, AIO_BENCH_READS, &opts, &backend);
+            char name[64];
+            snprintf(name, sizeof(name), "aio %s qd=%d batch=%d",
+                     backend == AIO_BACKEND_URING ? "io_uring" : "threads",
+                     opts.queue_depth, opts.batch_size);
+            report(name, AIO_BENCH_READS, elapsed);
+        }
+    }
+
+    free(block_nums);
+    image_detach(img);
+    remove(BENCH_IMAGE);
+}
+
+// ---- free map scanning ----
+
+#define BITMAP_BENCH_SCANS 20000
+
+// find_free() as it was: one byte at a time, 8 bit tests per byte
+static int find_free_bytewise(const unsigned char *block) {
+    for(int i = 0; i < BLOCK_SIZE; i++) {
+        for(int j = 0; j < 8; j++) {
+            if(!(block[i] & (1 << j))) {
+                return i * 8 + j;
+            }
+        }
+    }
+    return -1;
+}
+
+// fills the map from the front so that roughly percent of it is in use,
+// like a map an allocator that always takes the lowest free bit leaves behind
+static void fill_map(unsigned char *block, double percent) {
+    int nbits = BLOCK_SIZE * 8;
+    int used = (int)(nbits * percent / 100.0);
+    memset(block, 0, BLOCK_SIZE);
+    for(int i = 0; i < used; i++) {
+        set_free(block, i, 1);
+    }
+}
+
+static void bench_bitmap(void) {
+    printf("free map scans, %d scans of a %d-bit map\n", BITMAP_BENCH_SCANS, BLOCK_SIZE * 8);
+    unsigned char *block = malloc(BLOCK_SIZE);
+    double fills[] = {0, 50, 90, 99, 99.9, 100};
+    const char *levels[] = {"scalar", "sse2", "avx2"};
+    volatile int sink = 0;
+
+    for(unsigned f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+        fill_map(block, fills[f]);
+        printf(" %.1f%% full\n", fills[f]);
+
+        double start = now();
+        for(int i = 0; i < BITMAP_BENCH_SCANS; i++) {
+            sink += find_free_bytewise(block);
+        }
+        report("find_free bytewise (old)", BITMAP_BENCH_SCANS, now() - start);
+
+        for(int level = BITMAP_SIMD_NONE; level <= BITMAP_SIMD_AVX2; level++) {
+            if(bitmap_use_simd(level) != level) {
+                continue;
+            }
+            char name[64];
+            start = now();
+            for(int i = 0; i < BITMAP_BENCH_SCANS; i++) {
+                sink += find_free(block);
+            }
+            snprintf(name, sizeof(name), "find_free %s", levels[level]);
+            report(name, BITMAP_BENCH_SCANS, now() - start);
+        }
+
+        start = now();
+        for(int i = 0; i < BITMAP_BENCH_SCANS; i++) {
+            sink += find_next_free(block, i % (BLOCK_SIZE * 8));
+        }
+        report("find_next_free from hint", BITMAP_BENCH_SCANS, now() - start);
+
+        start = now();
+        for(int i = 0; i < BITMAP_BENCH_SCANS; i++) {
+            sink += count_free(block);
+        }
+        report("count_free popcount", BITMAP_BENCH_SCANS, now() - start);
+    }
+    bitmap_use_simd(BITMAP_SIMD_AVX2);
+    free(block);
+}
+
+// ---- mkfs against image size ----
+
+#define MKFS_BENCH_RUNS 5
+#define MKFS_BENCH_ZERO_FILL_MAX (1 << 14)     // 64 MiB; past that the old way takes too long
+#define MKFS_BENCH_PREALLOCATE_MAX (1 << 18)    // 1 GiB
+
+// how mkfs used to start: every block of the image written with zeros
+static void zero_fill(struct image *img, unsigned int nblocks) {
+    unsigned char *block = calloc(1, BLOCK_SIZE);
+    int block_nums[1024];
+    unsigned char *blocks[1024];
+    for(unsigned int i = 0; i < nblocks; i += 1024) {
+        int n = nblocks - i < 1024 ? nblocks - i : 1024;
+        for(int j = 0; j < n; j++) {
+            block_nums[j] = i + j;
+            blocks[j] = block;
+        }
+        block_rw_many_raw(img, block_nums, blocks, n, 1);
+    }
+    free(block);
+}
+
+static void bench_mkfs(void) {
+    printf("mkfs, %d runs per image size\n", MKFS_BENCH_RUNS);
+    unsigned int sizes[] = {1 << 10, 1 << 14, 1 << 18, 1 << 20, 1 << 22};
+    for(unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        struct mkfs_opts opts;
+        mkfs_default_opts(&opts);
+        opts.nblocks = sizes[s];
+        opts.ninodes = sizes[s] / 16 < 65536 ? sizes[s] / 16 : 65536;
+        printf(" %u MiB\n", sizes[s] / (1024 * 1024 / BLOCK_SIZE));
+
+        char name[64];
+        for(int preallocate = 0; preallocate <= 1; preallocate++) {
+            // preallocating really writes the whole image on some file systems
+            if(preallocate && sizes[s] > MKFS_BENCH_PREALLOCATE_MAX) {
+                continue;
+            }
+            opts.preallocate = preallocate;
+            double elapsed = 0;
+            for(int run = 0; run < MKFS_BENCH_RUNS; run++) {
+                image_open(BENCH_IMAGE, 1);
+                double start = now();
+                mkfs_opts(&opts);
+                fsync(image_current()->fd);
+                elapsed += now() - start;
+                image_close();
+            }
+            snprintf(name, sizeof(name), "mkfs %s", preallocate ? "preallocated" : "sparse");
+            report(name, MKFS_BENCH_RUNS, elapsed);
+        }
+
+        if(sizes[s] <= MKFS_BENCH_ZERO_FILL_MAX) {
+            double elapsed = 0;
+            for(int run = 0; run < MKFS_BENCH_RUNS; run++) {
+                image_open(BENCH_IMAGE, 1);
+                double start = now();
+                zero_fill(image_current(), sizes[s]);
+                fsync(image_current()->fd);
+                elapsed += now() - start;
+                image_close();
+            }
+            report("zero-fill every block (old)", MKFS_BENCH_RUNS, elapsed);
+        }
+    }
+    remove(BENCH_IMAGE);
+}
+
+// ---- inode-table and directory block codecs ----
+
+#define PACK_BENCH_BLOCKS 200000
+
+// how read_inode() used to unpack each slot: a read_u32()/read_u16() call
+// per field and per block pointer
+static void old_decode_inode_block(const unsigned char *block, struct inode *inodes) {
+    for(int i = 0; i < INODES_PER_BLOCK; i++) {
+        const unsigned char *slot = block + i * INODE_SIZE;
+        inodes[i].size = read_u32(slot);
+        inodes[i].owner_id = read_u16(slot + 4);
+        inodes[i].permissions = read_u8(slot + 6);
+        inodes[i].flags = read_u8(slot + 7);
+        inodes[i].link_count = read_u8(slot + 8);
+        for(int j = 0; j < INODE_PTR_COUNT; j++) {
+            inodes[i].block_ptr[j] = read_u32(slot + INODE_PTR_OFFSET + j * 4);
+        }
+        inodes[i].indirect = read_u32(slot + INODE_INDIRECT_OFFSET);
+    }
+}
+
+static void bench_pack(void) {
+    printf("block codecs, %d blocks each\n", PACK_BENCH_BLOCKS);
+    static struct inode inodes[INODES_PER_BLOCK];
+    static struct directory_entry ents[BLOCK_SIZE / DIR_ENTRY_SIZE];
+    unsigned char *block = malloc(BLOCK_SIZE);
+    for(int i = 0; i < BLOCK_SIZE; i++) {
+        block[i] = (unsigned char)(i * 131 + 7);
+    }
+    volatile unsigned int sink = 0;
+    char name[64];
+
+    double start = now();
+    for(int i = 0; i < PACK_BENCH_BLOCKS; i++) {
+        block[0] = i;
+        old_decode_inode_block(block, inodes);
+        sink += inodes[i % INODES_PER_BLOCK].block_ptr[i % INODE_PTR_COUNT];
+    }
+    report("decode inode block per field (old)", PACK_BENCH_BLOCKS, now() - start);
+
+    const char *levels[] = {"scalar", "ssse3"};
+    for(int level = PACK_SIMD_NONE; level <= PACK_SIMD_SSSE3; level++) {
+        if(pack_use_simd(level) != level) {
+            continue;
+        }
+        start = now();
+        for(int i = 0; i < PACK_BENCH_BLOCKS; i++) {
+            block[0] = i;
+            decode_inode_block(block, inodes);
+            sink += inodes[i % INODES_PER_BLOCK].block_ptr[i % INODE_PTR_COUNT];
+        }
+        snprintf(name, sizeof(name), "decode_inode_block %s", levels[level]);
+        report(name, PACK_BENCH_BLOCKS, now() - start);
+
+        start = now();
+        for(int i = 0; i < PACK_BENCH_BLOCKS; i++) {
+            inodes[i % INODES_PER_BLOCK].size = i;
+            encode_inode_block(block, inodes);
+            sink += block[i % BLOCK_SIZE];
+        }
+        snprintf(name, sizeof(name), "encode_inode_block %s", levels[level]);
+        report(name, PACK_BENCH_BLOCKS, now() - start);
+    }
+    pack_use_simd(PACK_SIMD_SSSE3);
+
+    int nents = BLOCK_SIZE / DIR_ENTRY_SIZE;
+    for(int i = 0; i < nents; i++) {
+        ents[i].inode_num = i;
+        snprintf(ents[i].name, sizeof(ents[i].name), "name%d", i);
+    }
+    start = now();
+    for(int i = 0; i < PACK_BENCH_BLOCKS; i++) {
+        ents[i % nents].inode_num = i & 0xffff;
+        encode_dir_block(block, ents, nents);
+        sink += block[i % BLOCK_SIZE];
+    }
+    report("encode_dir_block", PACK_BENCH_BLOCKS, now() - start);
+
+    start = now();
+    for(int i = 0; i < PACK_BENCH_BLOCKS; i++) {
+        block[0] = i;
+        decode_dir_block(block, ents, nents);
+        sink += ents[i % nents].inode_num;
+    }
+    report("decode_dir_block", PACK_BENCH_BLOCKS, now() - start);
+    free(block);
+}
+
+// ---- durability modes: per-operation latency and throughput ----
+
+#define DURABILITY_BENCH_OPS 2000
+#define DURABILITY_BENCH_BLOCKS 16384
+#define DURABILITY_BENCH_INODES 4096
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Each operation creates a file and writes a block to it, like a service
+// storing small records. Explicit mode syncs once at the end.
+static void bench_durability_mode(const char *name, int durability, int sync_ms, int sync_writes) {
+    struct image_opts opts;
+    image_default_opts(&opts);
+    opts.durability = durability;
+    opts.sync_ms = sync_ms;
+    opts.sync_writes = sync_writes;
+    image_open_opts(BENCH_IMAGE, 1, &opts);
+    struct mkfs_opts mopts;
+    mkfs_default_opts(&mopts);
+    mopts.nblocks = DURABILITY_BENCH_BLOCKS;
+    mopts.ninodes = DURABILITY_BENCH_INODES;
+    mkfs_opts(&mopts);
+
+    struct image *img = image_current();
+    unsigned char data[BLOCK_SIZE];
+    memset(data, 0xAB, BLOCK_SIZE);
+    double *latency = malloc(DURABILITY_BENCH_OPS * sizeof(double));
+    char path[32];
+    unsigned long sync_calls = img->sync_calls;
+    double start = now();
+    for(int i = 0; i < DURABILITY_BENCH_OPS; i++) {
+        double op_start = now();
+        sprintf(path, "/r%d", i);
+        file_create(path);
+        struct file *f = file_open(path);
+        file_write(f, data, BLOCK_SIZE);
+        file_close(f);
+        latency[i] = now() - op_start;
+    }
+    if(durability == IMAGE_DURABLE_EXPLICIT) {
+        image_sync();
+    }
+    double elapsed = now() - start;
+    unsigned long syncs = img->sync_calls - sync_calls;
+    image_close();
+
+    qsort(latency, DURABILITY_BENCH_OPS, sizeof(double), compare_double);
+    double total = 0;
+    for(int i = 0; i < DURABILITY_BENCH_OPS; i++) {
+        total += latency[i];
+    }
+    report(name, DURABILITY_BENCH_OPS, elapsed);
+    printf("    latency mean %8.1f us  p99 %8.1f us  max %8.1f us  %6lu fdatasync\n",
+           total / DURABILITY_BENCH_OPS * 1e6, latency[DURABILITY_BENCH_OPS * 99 / 100] * 1e6,
+           latency[DURABILITY_BENCH_OPS - 1] * 1e6, syncs);
+    free(latency);
+}
+
+static void bench_durability(void) {
+    printf("durability modes, %d create + 4 KiB write operations\n", DURABILITY_BENCH_OPS);
+    bench_durability_mode("none", IMAGE_DURABLE_NONE, 0, 0);
+    bench_durability_mode("each operation", IMAGE_DURABLE_EACH_OP, 0, 0);
+    bench_durability_mode("periodic, 10 ms", IMAGE_DURABLE_PERIODIC, 10, 1 << 30);
+    bench_durability_mode("periodic, 256 writes", IMAGE_DURABLE_PERIODIC, 1 << 30, 256);
+    bench_durability_mode("explicit, one sync at the end", IMAGE_DURABLE_EXPLICIT, 0, 0);
+    remove(BENCH_IMAGE);
+}
+
+// ---- directory_make() from many threads, each into its own parent ----
+
+#define MKDIR_BENCH_DIRS 4096       // split between the threads
+#define MKDIR_BENCH_MAX_THREADS 32
+#define MKDIR_BENCH_BLOCKS 16384
+#define MKDIR_BENCH_INODES 8192
+
+struct mkdir_bench_arg {
+    int thread_num;
+    int ndirs;
+};
+
+static void *mkdir_bench_thread(void *p) {
+    struct mkdir_bench_arg *arg = p;
+    char path[32];
+    for(int i = 0; i < arg->ndirs; i++) {
+        sprintf(path, "/p%d/d%d", arg->thread_num, i);
+        directory_make(path);
+    }
+    return NULL;
+}
+
+static void bench_mkdir_threads(const char *mode, int durability) {
+    for(int nthreads = 1; nthreads <= MKDIR_BENCH_MAX_THREADS; nthreads *= 2) {
+        struct image_opts opts;
+        image_default_opts(&opts);
+        opts.durability = durability;
+        image_open_opts(BENCH_IMAGE, 1, &opts);
+        struct mkfs_opts mopts;
+        mkfs_default_opts(&mopts);
+        mopts.nblocks = MKDIR_BENCH_BLOCKS;
+        mopts.ninodes = MKDIR_BENCH_INODES;
+        mkfs_opts(&mopts);
+
+        pthread_t threads[MKDIR_BENCH_MAX_THREADS];
+        struct mkdir_bench_arg args[MKDIR_BENCH_MAX_THREADS];
+        char path[32];
+        for(int i = 0; i < nthreads; i++) {
+            sprintf(path, "/p%d", i);
+            directory_make(path);
+            args[i].thread_num = i;
+            args[i].ndirs = MKDIR_BENCH_DIRS / nthreads;
+        }
+        double start = now();
+        for(int i = 0; i < nthreads; i++) {
+            pthread_create(&threads[i], NULL, mkdir_bench_thread, &args[i]);
+        }
+        for(int i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        if(durability == IMAGE_DURABLE_EXPLICIT) {
+            image_sync();
+        }
+        double elapsed = now() - start;
+        image_close();
+
+        char name[64];
+        sprintf(name, "%s, %d thread%s", mode, nthreads, nthreads > 1 ? "s" : "");
+        report(name, (long)args[0].ndirs * nthreads, elapsed);
+    }
+}
+
+static void bench_mkdir(void) {
+    printf("directory_make(), %d directories spread over each thread's own parent\n", MKDIR_BENCH_DIRS);
+    bench_mkdir_threads("explicit sync", IMAGE_DURABLE_EXPLICIT);
+    bench_mkdir_threads("each operation durable", IMAGE_DURABLE_EACH_OP);
+    remove(BENCH_IMAGE);
+}
+
+struct bench {
+    const char *name;
+    void (*run)(void);
+};
+
+static struct bench benches[] = {
+    {"aio", bench_random_reads},
+    {"bitmap", bench_bitmap},
+    {"durability", bench_durability},
+    {"mkdir", bench_mkdir},
+    {"mkfs", bench_mkfs},
+    {"pack", bench_pack},
+};
+
+int main(int argc, char **argv) {
+    int nbenches = sizeof(benches) / sizeof(benches[0]);
+    for(int i = 0; i < nbenches; i++) {
+        int selected = argc < 2;
+        for(int j = 1; j < argc; j++) {
+            selected = selected || strcmp(argv[j], benches[i].name) == 0;
+        }
+        if(selected) {
+            benches[i].run();
+            printf("\n");
+        }
+    }
+    return 0;
+}
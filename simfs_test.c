@@ -4,15 +4,23 @@
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "ctest.h"
 #include "image.h"
 #include "block.h"
+#include "bcache.h"
 #include "free.h"
 #include "inode.h"
 #include "mkfs.h"
 #include "pack.h"
 #include "ls.h"
 #include "dir.h"
+#include "aio.h"
+#include "dcache.h"
+#include "file.h"
+#include "readahead.h"
+#include "superblock.h"
+#include "journal.h"
 
 #define BLOCK_SIZE 4096
 #define TEST_BLOCK_NUM 3
@@ -36,6 +44,17 @@ void setup(void)
     mkfs();
 }
 
+// like setup(), with an image of nblocks blocks and ninodes inodes
+void setup_geometry(unsigned int nblocks, unsigned int ninodes)
+{
+    struct mkfs_opts opts;
+    image_open(TEST_IMAGE, 1);
+    mkfs_default_opts(&opts);
+    opts.nblocks = nblocks;
+    opts.ninodes = ninodes;
+    mkfs_opts(&opts);
+}
+
 void teardown(void)
 {
     image_close();
@@ -44,14 +63,14 @@ void teardown(void)
 
 void test_non_existent_image_open_and_close(void) {
     setup();
-    CTEST_ASSERT(image_fd != -1, "Test opening non-existent file");
+    CTEST_ASSERT(image_current() != NULL, "Test opening non-existent file");
     CTEST_ASSERT(image_close() != -1, "Test closing newly made file");
     teardown();
 }
 
 void test_existing_image_open_and_close(void) {
     setup();
-    CTEST_ASSERT(image_fd != -1, "Test opening existing file");
+    CTEST_ASSERT(image_current() != NULL, "Test opening existing file");
     CTEST_ASSERT(image_close() != -1, "Test closing existing file");
     teardown();
 }
@@ -59,12 +78,12 @@ void test_existing_image_open_and_close(void) {
 /// Need truncated image_open testing
 
 void test_image_open_fail(void) {
-    image_fd = image_open(NULL, 0);
-    CTEST_ASSERT(image_fd == -1, "Test failure of image_open");
+    int fd = image_open(NULL, 0);
+    CTEST_ASSERT(fd == -1, "Test failure of image_open");
 }
 
 void test_image_close_fail(void) {
-    image_fd = 123456789;
+    // nothing is open after the failed image_open() above
     CTEST_ASSERT(image_close() == -1, "Test failure of image_close");
 }
 
@@ -87,6 +106,349 @@ void test_bwrite_and_bread(void) {
     teardown();
 }
 
+void test_bcache_hits_and_misses(void) {
+    setup();
+    unsigned char block[BLOCK_SIZE];
+    struct bcache_stats st;
+
+    bcache_reset_stats(image_current());
+    bread(TEST_BLOCK_NUM + 10, block);
+    bread(TEST_BLOCK_NUM + 10, block);
+    bcache_get_stats(image_current(), &st);
+    CTEST_ASSERT(st.misses == 1, "Testing first bread() of a block misses the cache");
+    CTEST_ASSERT(st.hits == 1, "Testing second bread() of a block hits the cache");
+    teardown();
+}
+
+void test_bcache_write_back(void) {
+    setup();
+    unsigned char block[BLOCK_SIZE];
+    unsigned char on_disk[BLOCK_SIZE];
+
+    generate_block(block, BLOCK_SIZE);
+    bwrite(TEST_BLOCK_NUM, block);
+    pread(image_current()->fd, on_disk, BLOCK_SIZE, TEST_BLOCK_NUM * BLOCK_SIZE);
+    CTEST_ASSERT(memcmp(block, on_disk, BLOCK_SIZE) != 0, "Testing bwrite() is held in the cache");
+
+    bsync();
+    pread(image_current()->fd, on_disk, BLOCK_SIZE, TEST_BLOCK_NUM * BLOCK_SIZE);
+    CTEST_ASSERT(memcmp(block, on_disk, BLOCK_SIZE) == 0, "Testing bsync() writes dirty blocks out");
+    teardown();
+}
+
+void test_bcache_lru_eviction(void) {
+    setup();
+    unsigned char block1[BLOCK_SIZE];
+    unsigned char block2[BLOCK_SIZE];
+    unsigned char on_disk[BLOCK_SIZE];
+    struct bcache_stats st;
+
+    bcache_init(image_current(), 2);
+    bcache_reset_stats(image_current());
+    generate_block(block1, BLOCK_SIZE);
+    bwrite(20, block1);
+    bread(21, block2);
+    bread(20, block2);
+    // block 21 is now least recently used, so reading 22 evicts it, not 20
+    bread(22, block2);
+    bread(20, block2);
+    bcache_get_stats(image_current(), &st);
+    CTEST_ASSERT(st.hits == 2, "Testing recently used blocks stay cached");
+    CTEST_ASSERT(st.evictions == 1, "Testing least recently used block is evicted");
+
+    // pushing block 20 out writes it back
+    bread(21, block2);
+    bread(22, block2);
+    pread(image_current()->fd, on_disk, BLOCK_SIZE, 20 * BLOCK_SIZE);
+    CTEST_ASSERT(memcmp(block1, on_disk, BLOCK_SIZE) == 0, "Testing evicted dirty block is written back");
+
+    teardown();
+}
+
+#define IO_THREADS 8
+#define IO_THREAD_BLOCKS 16
+#define IO_THREAD_ROUNDS 50
+#define TEST_IMAGE_2 "inode_test_image_2.dat"
+
+struct io_thread_arg {
+    struct image *imgs[2];
+    int thread_num;
+    int mismatches;
+};
+
+// fills a block with a pattern that identifies who wrote it and when
+static void fill_pattern(unsigned char *block, int image_num, int block_num, int round) {
+    for(int i = 0; i < BLOCK_SIZE; i++) {
+        block[i] = (unsigned char)(image_num * 131 + block_num * 31 + round * 7 + i);
+    }
+}
+
+static void *io_thread(void *p) {
+    struct io_thread_arg *arg = p;
+    unsigned char expected[BLOCK_SIZE];
+    unsigned char got[BLOCK_SIZE];
+
+    for(int round = 0; round < IO_THREAD_ROUNDS; round++) {
+        for(int j = 0; j < IO_THREAD_BLOCKS; j++) {
+            int block_num = arg->thread_num * IO_THREAD_BLOCKS + j;
+            for(int k = 0; k < 2; k++) {
+                fill_pattern(expected, k, block_num, round);
+                bwrite_img(arg->imgs[k], block_num, expected);
+            }
+        }
+        for(int j = 0; j < IO_THREAD_BLOCKS; j++) {
+            int block_num = arg->thread_num * IO_THREAD_BLOCKS + j;
+            for(int k = 0; k < 2; k++) {
+                fill_pattern(expected, k, block_num, round);
+                bread_img(arg->imgs[k], block_num, got);
+                if(memcmp(expected, got, BLOCK_SIZE) != 0) {
+                    arg->mismatches++;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+void test_threaded_block_io(void) {
+    struct image *imgs[2];
+    imgs[0] = image_attach(TEST_IMAGE, 1);
+    imgs[1] = image_attach(TEST_IMAGE_2, 1);
+    // a tiny cache on one image forces evictions to race with lookups,
+    // the other image goes straight to pread()/pwrite()
+    bcache_init(imgs[0], 8);
+    bcache_init(imgs[1], 0);
+
+    pthread_t threads[IO_THREADS];
+    struct io_thread_arg args[IO_THREADS];
+    for(int i = 0; i < IO_THREADS; i++) {
+        args[i].imgs[0] = imgs[0];
+        args[i].imgs[1] = imgs[1];
+        args[i].thread_num = i;
+        args[i].mismatches = 0;
+        pthread_create(&threads[i], NULL, io_thread, &args[i]);
+    }
+    int mismatches = 0;
+    for(int i = 0; i < IO_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        mismatches += args[i].mismatches;
+    }
+    CTEST_ASSERT(mismatches == 0, "Testing concurrent block I/O on two images has no cross-talk");
+
+    // everything should also have landed in the right place on disk
+    bsync_img(imgs[0]);
+    unsigned char expected[BLOCK_SIZE];
+    unsigned char got[BLOCK_SIZE];
+    int bad = 0;
+    for(int b = 0; b < IO_THREADS * IO_THREAD_BLOCKS; b++) {
+        for(int k = 0; k < 2; k++) {
+            fill_pattern(expected, k, b, IO_THREAD_ROUNDS - 1);
+            pread(imgs[k]->fd, got, BLOCK_SIZE, (off_t)b * BLOCK_SIZE);
+            if(memcmp(expected, got, BLOCK_SIZE) != 0) {
+                bad++;
+            }
+        }
+    }
+    CTEST_ASSERT(bad == 0, "Testing concurrent block I/O leaves correct data on disk");
+
+    CTEST_ASSERT(image_detach(imgs[0]) != -1, "Testing detaching first image");
+    CTEST_ASSERT(image_detach(imgs[1]) != -1, "Testing detaching second image");
+    remove(TEST_IMAGE);
+    remove(TEST_IMAGE_2);
+}
+
+void test_bread_ref_pins_cache_buffer(void) {
+    setup();
+    unsigned char block[BLOCK_SIZE];
+    unsigned char scratch[BLOCK_SIZE];
+
+    bcache_init(image_current(), 2);
+    generate_block(block, BLOCK_SIZE);
+    bwrite(20, block);
+    const unsigned char *ref = bread_ref(20);
+    CTEST_ASSERT(memcmp(ref, block, BLOCK_SIZE) == 0, "Testing bread_ref() sees cached data");
+
+    // churn the rest of the cache; the pinned buffer must not be reused
+    bread(21, scratch);
+    bread(22, scratch);
+    bread(23, scratch);
+    CTEST_ASSERT(memcmp(ref, block, BLOCK_SIZE) == 0, "Testing bread_ref() buffer is pinned");
+
+    // dropping the cache leaves it with its holder, and nobody else finds it
+    bcache_invalidate(image_current());
+    bread(20, scratch);
+    bread(21, scratch);
+    bread(22, scratch);
+    CTEST_ASSERT(memcmp(ref, block, BLOCK_SIZE) == 0, "Testing bcache_invalidate() keeps a pinned buffer");
+    bread(20, scratch);
+    CTEST_ASSERT(memcmp(scratch, block, BLOCK_SIZE) != 0, "Testing an invalidated pinned buffer is not found again");
+    brelse(ref);
+    teardown();
+}
+
+void test_mmap_image(void) {
+    struct image_opts opts;
+    image_default_opts(&opts);
+    opts.mode = IMAGE_MODE_MMAP;
+    image_open_opts(TEST_IMAGE, 1, &opts);
+    mkfs();
+
+    struct image *img = image_current();
+    CTEST_ASSERT(img->map != NULL, "Testing image is memory-mapped");
+
+    const unsigned char *ref = bread_ref(20);
+    CTEST_ASSERT(ref == img->map + 20 * BLOCK_SIZE, "Testing bread_ref() points into the mapping");
+
+    unsigned char block[BLOCK_SIZE];
+    unsigned char on_disk[BLOCK_SIZE];
+    generate_block(block, BLOCK_SIZE);
+    bwrite(20, block);
+    CTEST_ASSERT(memcmp(ref, block, BLOCK_SIZE) == 0, "Testing bwrite() is visible through bread_ref()");
+    brelse(ref);
+
+    bsync();
+    pread(img->fd, on_disk, BLOCK_SIZE, 20 * BLOCK_SIZE);
+    CTEST_ASSERT(memcmp(block, on_disk, BLOCK_SIZE) == 0, "Testing bsync() msyncs the mapping");
+
+    // the file system layers work unchanged on top of the mapping
+    struct directory *dir;
+    struct directory_entry ent;
+    directory_make("/foo");
+    dir = directory_open(0);
+    directory_get(dir, &ent);
+    directory_get(dir, &ent);
+    directory_get(dir, &ent);
+    CTEST_ASSERT(strcmp(ent.name, "foo") == 0, "Testing directory_make() on a memory-mapped image");
+    directory_close(dir);
+    teardown();
+}
+
+void test_bwrite_many_and_bread_many(void) {
+    setup();
+    struct image *img = image_current();
+    bcache_init(img, 0);
+
+    // two runs: 40-43 and 50, listed out of order
+    int block_nums[5] = {42, 50, 40, 43, 41};
+    unsigned char *blocks[5];
+    unsigned char *read_blocks[5];
+    for(int i = 0; i < 5; i++) {
+        blocks[i] = malloc(BLOCK_SIZE);
+        read_blocks[i] = malloc(BLOCK_SIZE);
+        generate_block(blocks[i], BLOCK_SIZE);
+    }
+
+    unsigned long write_calls = img->write_calls;
+    bwrite_many(block_nums, blocks, 5);
+    CTEST_ASSERT(img->write_calls - write_calls == 2, "Testing bwrite_many() merges contiguous blocks into one write");
+
+    unsigned long read_calls = img->read_calls;
+    bread_many(block_nums, read_blocks, 5);
+    CTEST_ASSERT(img->read_calls - read_calls == 2, "Testing bread_many() merges contiguous blocks into one read");
+    int same = 1;
+    for(int i = 0; i < 5; i++) {
+        same = same && memcmp(blocks[i], read_blocks[i], BLOCK_SIZE) == 0;
+    }
+    CTEST_ASSERT(same, "Testing bread_many() scatters blocks back to the right buffers");
+
+    // with a cache, a second bread_many() is served without any I/O
+    bcache_init(img, BCACHE_DEFAULT_BLOCKS);
+    bread_many(block_nums, read_blocks, 5);
+    read_calls = img->read_calls;
+    bread_many(block_nums, read_blocks, 5);
+    CTEST_ASSERT(img->read_calls == read_calls, "Testing bread_many() fills the block cache");
+
+    // and dirty cached blocks go out as one run on bsync()
+    bwrite_many(block_nums, blocks, 5);
+    write_calls = img->write_calls;
+    bsync();
+    CTEST_ASSERT(img->write_calls - write_calls == 2, "Testing bsync() merges contiguous dirty blocks");
+
+    for(int i = 0; i < 5; i++) {
+        free(blocks[i]);
+        free(read_blocks[i]);
+    }
+    teardown();
+}
+
+#define AIO_TEST_BLOCKS 200
+
+// writes AIO_TEST_BLOCKS blocks through the engine, reads them back through
+// it and returns how many did not round-trip
+static int aio_round_trip(struct aio_engine *e) {
+    static struct aio_request reqs[AIO_TEST_BLOCKS];
+    static unsigned char blocks[AIO_TEST_BLOCKS][BLOCK_SIZE];
+    struct aio_request *done[AIO_TEST_BLOCKS];
+    int bad = 0;
+
+    for(int op = AIO_WRITE; op >= AIO_READ; op--) {
+        int submitted = 0;
+        int reaped = 0;
+        while(reaped < AIO_TEST_BLOCKS) {
+            while(submitted < AIO_TEST_BLOCKS) {
+                struct aio_request *req = &reqs[submitted];
+                req->op = op;
+                req->block_num = submitted;
+                req->block = blocks[submitted];
+                if(op == AIO_WRITE) {
+                    fill_pattern(req->block, 0, submitted, 1);
+                } else {
+                    memset(req->block, 0, BLOCK_SIZE);
+                }
+                if(aio_submit(e, req) == -1) {
+                    break;
+                }
+                submitted++;
+            }
+            int n = aio_reap(e, done, 1, AIO_TEST_BLOCKS);
+            for(int i = 0; i < n; i++) {
+                if(done[i]->result != 0) {
+                    bad++;
+                }
+            }
+            reaped += n;
+        }
+    }
+
+    unsigned char expected[BLOCK_SIZE];
+    for(int i = 0; i < AIO_TEST_BLOCKS; i++) {
+        fill_pattern(expected, 0, i, 1);
+        if(memcmp(expected, blocks[i], BLOCK_SIZE) != 0) {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+void test_aio_engines(void) {
+    struct image *img = image_attach(TEST_IMAGE, 1);
+    struct aio_opts opts;
+    aio_default_opts(&opts);
+    opts.queue_depth = 32;
+    opts.batch_size = 8;
+
+    struct aio_engine *e = aio_create(img, &opts);
+    CTEST_ASSERT(e != NULL, "Testing creating the default aio engine");
+    CTEST_ASSERT(aio_round_trip(e) == 0, "Testing blocks round-trip through the default aio engine");
+    aio_destroy(e);
+
+    opts.backend = AIO_BACKEND_THREADS;
+    e = aio_create(img, &opts);
+    CTEST_ASSERT(e != NULL && aio_backend(e) == AIO_BACKEND_THREADS, "Testing creating the thread-pool aio engine");
+    CTEST_ASSERT(aio_round_trip(e) == 0, "Testing blocks round-trip through the thread-pool aio engine");
+    aio_destroy(e);
+
+    // what went through the engines is on disk for the synchronous path too
+    unsigned char expected[BLOCK_SIZE];
+    unsigned char got[BLOCK_SIZE];
+    fill_pattern(expected, 0, AIO_TEST_BLOCKS - 1, 1);
+    bread_img(img, AIO_TEST_BLOCKS - 1, got);
+    CTEST_ASSERT(memcmp(expected, got, BLOCK_SIZE) == 0, "Testing aio writes are visible to bread()");
+
+    image_detach(img);
+    remove(TEST_IMAGE);
+}
+
 void test_setting_with_set_free(void) {
     setup();
     unsigned char block[2] = {0x00, 0x00};
@@ -124,6 +486,61 @@ void test_find_free_one_bit_clear(void) {
     teardown();
 }
 
+void test_find_next_free(void) {
+    unsigned char block[BLOCK_SIZE];
+    memset(block, 0xFF, BLOCK_SIZE);
+    set_free(block, 5, 0);
+    set_free(block, 700, 0);
+    set_free(block, 32767, 0);
+    CTEST_ASSERT(find_next_free(block, 0) == 5, "Testing find_next_free() from the start");
+    CTEST_ASSERT(find_next_free(block, 6) == 700, "Testing find_next_free() skips bits before the hint");
+    CTEST_ASSERT(find_next_free(block, 701) == 32767, "Testing find_next_free() finds the last bit");
+    set_free(block, 32767, 1);
+    CTEST_ASSERT(find_next_free(block, 701) == -1, "Testing find_next_free() with nothing free past the hint");
+}
+
+void test_count_free(void) {
+    unsigned char block[BLOCK_SIZE];
+    memset(block, 0xFF, BLOCK_SIZE);
+    CTEST_ASSERT(count_free(block) == 0, "Testing count_free() on a full map");
+    set_free(block, 3, 0);
+    set_free(block, 9000, 0);
+    CTEST_ASSERT(count_free(block) == 2, "Testing count_free() on a nearly full map");
+    memset(block, 0, BLOCK_SIZE);
+    CTEST_ASSERT(count_free(block) == BLOCK_SIZE * 8, "Testing count_free() on an empty map");
+    // a map whose length is not a whole number of words
+    CTEST_ASSERT(bitmap_count_clear(block, 100) == 100, "Testing bitmap_count_clear() on a partial word");
+    block[12] = 0x0F;
+    CTEST_ASSERT(bitmap_find_clear(block, 100, 96) == -1, "Testing bitmap_find_clear() stops at the end of the map");
+}
+
+void test_bitmap_simd_levels_agree(void) {
+    unsigned char *block = malloc(BLOCK_SIZE);
+    int agree = 1;
+    for(int trial = 0; trial < 200; trial++) {
+        // fill most of the map from the front, then sprinkle a few holes
+        memset(block, 0xFF, BLOCK_SIZE);
+        int holes = rand() % 4;
+        for(int i = 0; i < holes; i++) {
+            set_free(block, rand() % (BLOCK_SIZE * 8), 0);
+        }
+        int hint = rand() % (BLOCK_SIZE * 8);
+        int expected[2] = {-2, -2};
+        for(int level = BITMAP_SIMD_NONE; level <= BITMAP_SIMD_AVX2; level++) {
+            bitmap_use_simd(level);
+            int got[2] = {find_free(block), find_next_free(block, hint)};
+            if(expected[0] == -2) {
+                expected[0] = got[0];
+                expected[1] = got[1];
+            }
+            agree = agree && got[0] == expected[0] && got[1] == expected[1];
+        }
+    }
+    bitmap_use_simd(BITMAP_SIMD_AVX2);
+    CTEST_ASSERT(agree, "Testing scalar and SIMD bitmap scans agree");
+    free(block);
+}
+
 void test_ialloc_no_free_inode(void) {
     setup();
     unsigned char inode_map[BLOCK_SIZE];
@@ -134,6 +551,25 @@ void test_ialloc_no_free_inode(void) {
     teardown();
 }
 
+void test_ialloc_out_of_slots(void) {
+    setup();
+    inode_table_resize(MAX_SYS_OPEN_FILES);
+    struct inode *held[MAX_SYS_OPEN_FILES];
+    int nheld = 0;
+    while(nheld < MAX_SYS_OPEN_FILES && (held[nheld] = iget(100 + nheld)) != NULL) {
+        nheld++;
+    }
+    CTEST_ASSERT(ialloc() == NULL, "Testing ialloc() with every in-core slot in use");
+    for(int i = 0; i < nheld; i++) {
+        iput(held[i]);
+    }
+    struct inode *in = ialloc();
+    CTEST_ASSERT(in != NULL && in->inode_num == 1, "Testing a failed ialloc() hands its inode back");
+    iput(in);
+    inode_table_resize(INODE_TABLE_DEFAULT_MAX);
+    teardown();
+}
+
 void test_ialloc_free_inode_found(void) {
     setup();
     unsigned char inode_map[BLOCK_SIZE];
@@ -173,12 +609,190 @@ void test_alloc_free_block_found(void) {
     teardown();
 }
 
+void test_alloc_summary_nearly_full(void) {
+    // one block map block's worth of blocks
+    setup_geometry(BLOCK_SIZE * 8, NUM_INODES);
+    unsigned char block_map[BLOCK_SIZE];
+    memset(block_map, 0xFF, BLOCK_SIZE);
+    set_free(block_map, 30000, 0);
+    set_free(block_map, 31000, 0);
+    bwrite(FREE_BLOCK_MAP_NUM, block_map);
+
+    CTEST_ASSERT(alloc() == 30000, "Testing alloc() finds a free block in a nearly full map");
+    CTEST_ASSERT(alloc() == 31000, "Testing alloc() finds the last free block");
+    CTEST_ASSERT(alloc() == -1, "Testing alloc() on a map that just filled up");
+    bfree(30000);
+    CTEST_ASSERT(alloc() == 30000, "Testing bfree() makes a block allocatable again");
+
+    bread(FREE_BLOCK_MAP_NUM, block_map);
+    CTEST_ASSERT(find_free(block_map) == -1, "Testing the on-disk block map stays in sync");
+    teardown();
+}
+
+void test_alloc_summary_matches_disk(void) {
+    setup();
+    unsigned char block_map[BLOCK_SIZE];
+    int allocated[500];
+    int nallocated = 0;
+    int in_sync = 1;
+
+    // interleave allocations and frees, checking each allocation against
+    // a plain scan of what is on disk
+    for(int i = 0; i < 2000; i++) {
+        if(nallocated > 0 && (rand() % 3 == 0 || nallocated == 500)) {
+            int victim = rand() % nallocated;
+            bfree(allocated[victim]);
+            allocated[victim] = allocated[--nallocated];
+        } else {
+            bread(FREE_BLOCK_MAP_NUM, block_map);
+            int expected = find_free(block_map);
+            int got = alloc();
+            in_sync = in_sync && got == expected;
+            allocated[nallocated++] = got;
+        }
+    }
+    CTEST_ASSERT(in_sync, "Testing alloc() matches a scan of the on-disk map through allocs and frees");
+    teardown();
+}
+
+void test_alloc_run(void) {
+    setup();
+    unsigned char block_map[BLOCK_SIZE];
+    memset(block_map, 0xFF, BLOCK_SIZE);
+    // free runs of 3 at 100, 8 at 200 and 5 at 300
+    for(int i = 100; i < 103; i++) set_free(block_map, i, 0);
+    for(int i = 200; i < 208; i++) set_free(block_map, i, 0);
+    for(int i = 300; i < 305; i++) set_free(block_map, i, 0);
+    bwrite(FREE_BLOCK_MAP_NUM, block_map);
+
+    struct freemap_stats stats;
+    alloc_stats(&stats);
+    CTEST_ASSERT(stats.free_bits == 16 && stats.free_runs == 3 && stats.largest_run == 8,
+                 "Testing alloc_stats() counts free extents");
+
+    CTEST_ASSERT(alloc_run(4, 0, FREEMAP_BEST_FIT) == 300, "Testing best-fit alloc_run() picks the tightest run");
+    CTEST_ASSERT(alloc_run(4, 0, FREEMAP_FIRST_FIT) == 200, "Testing first-fit alloc_run()");
+    CTEST_ASSERT(alloc_run(3, 250, FREEMAP_FIRST_FIT) == 100, "Testing first-fit alloc_run() wraps past the goal");
+    CTEST_ASSERT(alloc_run(5, 0, FREEMAP_FIRST_FIT) == -1, "Testing alloc_run() when no run is long enough");
+
+    bfree_run(200, 4);
+    CTEST_ASSERT(alloc_run(5, 0, FREEMAP_FIRST_FIT) == 200, "Testing bfree_run() joins free runs back up");
+    CTEST_ASSERT(alloc_near(250) == 304, "Testing alloc_near() takes the next free block after the goal");
+
+    bread(FREE_BLOCK_MAP_NUM, block_map);
+    CTEST_ASSERT(find_free(block_map) == 205, "Testing the on-disk block map matches after runs");
+    teardown();
+}
+
+void test_alloc_many(void) {
+    setup();
+    int block_nums[100];
+    CTEST_ASSERT(alloc_many(block_nums, 100) == 100, "Testing alloc_many()");
+    int first = image_current()->sb.data_start + 1;
+    int in_order = 1;
+    for(int i = 0; i < 100; i++) {
+        in_order = in_order && block_nums[i] == first + i;
+    }
+    CTEST_ASSERT(in_order, "Testing alloc_many() hands out the lowest free blocks");
+
+    unsigned char block_map[BLOCK_SIZE];
+    bread(FREE_BLOCK_MAP_NUM, block_map);
+    CTEST_ASSERT(find_free(block_map) == first + 100, "Testing alloc_many() writes the block map back");
+
+    int freed[2] = {50, 20};
+    bfree_many(freed, 2);
+    bread(FREE_BLOCK_MAP_NUM, block_map);
+    CTEST_ASSERT(find_free(block_map) == 20 && find_next_free(block_map, 21) == 50,
+                 "Testing bfree_many()");
+
+    int too_many[BLOCK_SIZE * 8];
+    CTEST_ASSERT(alloc_many(too_many, BLOCK_SIZE * 8) == -1, "Testing alloc_many() with too few free blocks");
+    CTEST_ASSERT(alloc() == 20, "Testing a failed alloc_many() allocates nothing");
+    teardown();
+}
+
+// leaves the free map loaded for a default-sized image of its own
+void load_small_freemap(void) {
+    image_open("inode_test_small_image.dat", 1);
+    mkfs();
+    alloc();
+    image_close();
+    remove("inode_test_small_image.dat");
+}
+
+void test_free_first_after_open(void) {
+    // an image bigger than the default, with blocks taken past the default's end
+    setup_geometry(NUM_BLOCKS * 2, NUM_INODES);
+    int num = alloc_near(NUM_BLOCKS + 100);
+    int run = alloc_run(4, NUM_BLOCKS + 200, FREEMAP_FIRST_FIT);
+    image_close();
+
+    // nothing touches the block map between opening the image and freeing
+    load_small_freemap();
+    image_open(TEST_IMAGE, 0);
+    bfree(num);
+    CTEST_ASSERT(alloc_near(NUM_BLOCKS + 100) == num, "Testing bfree() as the first operation on a reopened image");
+    image_close();
+
+    load_small_freemap();
+    image_open(TEST_IMAGE, 0);
+    bfree_run(run, 4);
+    CTEST_ASSERT(alloc_run(4, NUM_BLOCKS + 200, FREEMAP_FIRST_FIT) == run,
+                 "Testing bfree_run() as the first operation on a reopened image");
+    teardown();
+}
+
+void test_ialloc_many(void) {
+    setup();
+    struct inode *inodes[10];
+    CTEST_ASSERT(ialloc_many(inodes, 10) == 10, "Testing ialloc_many()");
+    CTEST_ASSERT(inodes[0]->inode_num == 1 && inodes[9]->inode_num == 10 && inodes[9]->ref_count == 1,
+                 "Testing ialloc_many() returns in-core inodes in order");
+
+    unsigned char inode_map[BLOCK_SIZE];
+    bread(FREE_INODE_MAP_NUM, inode_map);
+    CTEST_ASSERT(find_free(inode_map) == 11, "Testing ialloc_many() writes the inode map back");
+
+    int inode_nums[10];
+    for(int i = 0; i < 10; i++) {
+        inode_nums[i] = inodes[i]->inode_num;
+        iput(inodes[i]);
+    }
+    ifree_many(inode_nums, 10);
+    bread(FREE_INODE_MAP_NUM, inode_map);
+    CTEST_ASSERT(find_free(inode_map) == 1, "Testing ifree_many()");
+    teardown();
+}
+
+void test_directory_make_near_parent(void) {
+    setup();
+    // move the root directory's data far from the low free blocks, so a
+    // goal-less allocation would land somewhere else entirely
+    struct inode *root = iget(0);
+    unsigned char block[BLOCK_SIZE];
+    bread(root->block_ptr[0], block);
+    bwrite(600, block);
+    root->block_ptr[0] = 600;
+    unsigned char block_map[BLOCK_SIZE];
+    bread(FREE_BLOCK_MAP_NUM, block_map);
+    set_free(block_map, 600, 1);
+    bwrite(FREE_BLOCK_MAP_NUM, block_map);
+
+    directory_make("/foo");
+    bread(600, block);
+    struct inode *foo = iget(read_u16(block + 2 * DIR_ENTRY_SIZE));
+    CTEST_ASSERT(foo->block_ptr[0] == 601, "Testing directory_make() allocates next to the parent's block");
+    iput(foo);
+    iput(root);
+    teardown();
+}
+
 void test_mkfs(void) {
     setup();
     unsigned char block[BLOCK_SIZE];
     for(int i = 0; i < 7; i++) {
         off_t block_offset = i * BLOCK_SIZE;
-        ssize_t bytes_read = pread(image_fd, block, BLOCK_SIZE, block_offset);
+        ssize_t bytes_read = pread(image_current()->fd, block, BLOCK_SIZE, block_offset);
         if(bytes_read == -1) {
             perror("Error reading block");
             exit(EXIT_FAILURE);
@@ -220,6 +834,156 @@ void test_find_incore(void) {
     teardown();
 }
 
+void test_inode_table_growth(void) {
+    setup();
+    CTEST_ASSERT(inode_table_resize(200000) == 0, "Testing inode_table_resize() growing the table");
+    static struct inode *inodes[150000];
+    int all_found = 1;
+    for(int i = 0; i < 150000; i++) {
+        inodes[i] = iget(i);
+        all_found = all_found && inodes[i] != NULL;
+    }
+    CTEST_ASSERT(all_found, "Testing iget() on far more inodes than the first chunk holds");
+    CTEST_ASSERT(find_incore(123456) == inodes[123456], "Testing find_incore() through the hash index");
+
+    struct inode_table_stats stats;
+    inode_table_get_stats(&stats);
+    CTEST_ASSERT(stats.in_use == 150000 && stats.slots >= 150000 && stats.slots <= 200000,
+                 "Testing the table grows only as far as needed");
+    CTEST_ASSERT(inode_table_resize(100) == -1, "Testing the table cannot shrink while inodes are in use");
+
+    for(int i = 0; i < 150000; i++) {
+        iput(inodes[i]);
+    }
+    CTEST_ASSERT(find_incore(123456) == inodes[123456] && inodes[123456]->ref_count == 0,
+                 "Testing iput() keeps released inodes loaded");
+
+    CTEST_ASSERT(inode_table_resize(100) == 0, "Testing inode_table_resize() shrinking an idle table");
+    for(int i = 0; i < 100; i++) {
+        inodes[i] = iget(i);
+    }
+    CTEST_ASSERT(iget(100) == NULL, "Testing iget() once the table is at its configured size");
+    for(int i = 0; i < 100; i++) {
+        iput(inodes[i]);
+    }
+    inode_table_resize(INODE_TABLE_DEFAULT_MAX);
+    teardown();
+}
+
+void test_inode_cache_hot_cycles(void) {
+    setup();
+    struct image *img = image_current();
+    struct inode *root = iget(ROOT_INODE_NUM);
+    iput(root);
+
+    struct bcache_stats before, after;
+    bcache_get_stats(img, &before);
+    unsigned long writes = img->write_calls;
+    int same_slot = 1;
+    for(int i = 0; i < 1000; i++) {
+        struct inode *in = namei("/");
+        same_slot = same_slot && in == root;
+        iput(in);
+    }
+    bcache_get_stats(img, &after);
+    CTEST_ASSERT(same_slot, "Testing namei() keeps returning the cached root inode");
+    CTEST_ASSERT(after.hits == before.hits && after.misses == before.misses && img->write_calls == writes,
+                 "Testing iget()/iput() cycles on a hot inode cost no I/O");
+
+    // a dirty inode is written back on isync(), not when released
+    root = iget(ROOT_INODE_NUM);
+    root->size += DIR_ENTRY_SIZE;
+    imark_dirty(root);
+    iput(root);
+    struct inode on_disk;
+    read_inode(&on_disk, ROOT_INODE_NUM);
+    CTEST_ASSERT(on_disk.size == DIR_ENTRY_SIZE * 2 && root->dirty, "Testing iput() defers writing a dirty inode");
+    isync();
+    read_inode(&on_disk, ROOT_INODE_NUM);
+    CTEST_ASSERT(on_disk.size == DIR_ENTRY_SIZE * 3 && !root->dirty, "Testing isync() writes back a dirty inode");
+    teardown();
+}
+
+void test_inode_cache_lru(void) {
+    setup();
+    CTEST_ASSERT(inode_table_resize(MAX_SYS_OPEN_FILES) == 0, "Testing inode_table_resize() to one chunk");
+    struct inode *inodes[MAX_SYS_OPEN_FILES];
+    for(int i = 0; i < MAX_SYS_OPEN_FILES; i++) {
+        inodes[i] = iget(i);
+    }
+    // release in order, so inode 0 is the least recently released
+    for(int i = 0; i < MAX_SYS_OPEN_FILES; i++) {
+        iput(inodes[i]);
+    }
+    CTEST_ASSERT(find_incore_free() == inodes[0], "Testing the least recently released inode is evicted first");
+    struct inode *in = iget(1000);
+    CTEST_ASSERT(in == inodes[0] && find_incore(0) == NULL, "Testing iget() reuses the LRU slot when the table is full");
+    CTEST_ASSERT(find_incore(1) == inodes[1], "Testing other released inodes stay loaded");
+    iput(in);
+    inode_table_resize(INODE_TABLE_DEFAULT_MAX);
+    teardown();
+}
+
+void test_isync_batches_blocks(void) {
+    setup();
+    struct inode *inodes[128];
+    CTEST_ASSERT(ialloc_many(inodes, 128) == 128, "Testing ialloc_many() of two blocks' worth of inodes");
+    for(int i = 0; i < 128; i++) {
+        inodes[i]->size = 1000 + i;
+        iput(inodes[i]);
+    }
+
+    struct inode_table_stats before, after;
+    inode_table_get_stats(&before);
+    isync();
+    inode_table_get_stats(&after);
+    // inodes 1-128 live in three inode-table blocks, next to the root inode
+    CTEST_ASSERT(after.writeback_blocks - before.writeback_blocks == 3 && after.dirty == 0,
+                 "Testing isync() writes each inode-table block once");
+
+    struct inode on_disk;
+    read_inode(&on_disk, ROOT_INODE_NUM);
+    CTEST_ASSERT(on_disk.size == DIR_ENTRY_SIZE * 2, "Testing write-back leaves other inodes in the block alone");
+    read_inode(&on_disk, 64);
+    CTEST_ASSERT(on_disk.size == 1063, "Testing isync() wrote the batched inodes");
+    teardown();
+}
+
+void test_isync_whole_block(void) {
+    // uncached, so every block isync() reads is a read call
+    struct image_opts opts;
+    image_default_opts(&opts);
+    opts.cache_blocks = 0;
+    image_open_opts(TEST_IMAGE, 1, &opts);
+    mkfs();
+    struct inode *inodes[127];
+    ialloc_many(inodes, 127);
+    for(int i = 0; i < 127; i++) {
+        iput(inodes[i]);
+    }
+    isync();
+
+    // inodes 64-127 fill the second inode-table block
+    for(int i = 0; i < INODES_PER_BLOCK; i++) {
+        struct inode *in = iget(INODES_PER_BLOCK + i);
+        in->size = 2000 + i;
+        imark_dirty(in);
+        iput(in);
+    }
+    struct image *img = image_current();
+    unsigned long read_calls = img->read_calls;
+    isync();
+    CTEST_ASSERT(img->read_calls == read_calls, "Testing isync() does not read a block whose every inode it writes");
+
+    struct inode first, last, other;
+    read_inode(&first, INODES_PER_BLOCK);
+    read_inode(&last, 2 * INODES_PER_BLOCK - 1);
+    read_inode(&other, ROOT_INODE_NUM);
+    CTEST_ASSERT(first.size == 2000 && last.size == 2000 + INODES_PER_BLOCK - 1 && other.size == DIR_ENTRY_SIZE * 2,
+                 "Testing a whole inode-table block is written back intact");
+    teardown();
+}
+
 void test_read_inode(void) {
     setup();
     struct inode in;
@@ -235,7 +999,7 @@ void test_read_inode(void) {
     write_u8(block + block_offset_bytes + 7, 8);
     write_u8(block + block_offset_bytes + 8, 3);
     for(int i = 0; i < INODE_PTR_COUNT; i++) {
-        write_u16(block + block_offset_bytes + 9 + (i * 2), i + 1);
+        write_u32(block + block_offset_bytes + INODE_PTR_OFFSET + (i * 4), i + 1);
     }
     bwrite(block_num, block);
     read_inode(&in, inode_num);
@@ -245,7 +1009,7 @@ void test_read_inode(void) {
     CTEST_ASSERT(in.flags == 8, "Testing read_inode() flags");
     CTEST_ASSERT(in.link_count == 3, "Testing read_inode() link_count");
     for (int i = 0; i < INODE_PTR_COUNT; i++) {
-        CTEST_ASSERT(in.block_ptr[i] == i + 1, "Testing read_inode() block pointers");
+        CTEST_ASSERT(in.block_ptr[i] == (unsigned int)(i + 1), "Testing read_inode() block pointers");
     }
     teardown();
 }
@@ -275,7 +1039,7 @@ void test_write_inode(void) {
     CTEST_ASSERT(read_u8(block + block_offset_bytes + 7) == 8, "Testing write_inode() flags");
     CTEST_ASSERT(read_u8(block + block_offset_bytes + 8) == 3, "Testing write_inode() link_count");
     for (int i = 0; i < INODE_PTR_COUNT; i++) {
-        CTEST_ASSERT(read_u16(block + block_offset_bytes + 9 + (i * 2)) == i + 1, "Testing write_inode() block pointers");
+        CTEST_ASSERT(read_u32(block + block_offset_bytes + INODE_PTR_OFFSET + (i * 4)) == (unsigned int)(i + 1), "Testing write_inode() block pointers");
     }
     teardown();
 }
@@ -306,6 +1070,7 @@ void test_iput(void) {
         in.block_ptr[i] = i + 1;
     }
     in.ref_count = 1;
+    in.dirty = 1;
     int block_num = in.inode_num / INODES_PER_BLOCK + INODE_FIRST_BLOCK;  
     int block_offset = in.inode_num % INODES_PER_BLOCK;
     int block_offset_bytes = block_offset * INODE_SIZE;
@@ -319,7 +1084,7 @@ void test_iput(void) {
     CTEST_ASSERT(read_u8(block + block_offset_bytes + 7) == 8, "Testing iput() flags");
     CTEST_ASSERT(read_u8(block + block_offset_bytes + 8) == 3, "Testing iput() link_count");
     for (int i = 0; i < INODE_PTR_COUNT; i++) {
-        CTEST_ASSERT(read_u16(block + block_offset_bytes + 9 + (i * 2)) == i + 1, "Testing iput() block pointers");
+        CTEST_ASSERT(read_u32(block + block_offset_bytes + INODE_PTR_OFFSET + (i * 4)) == (unsigned int)(i + 1), "Testing iput() block pointers");
     }
     teardown();
 }
@@ -350,53 +1115,1281 @@ void test_namei(void) {
     teardown();
 }
 
-void test_directory_make(void) {
+void test_namei_components(void) {
     setup();
-    struct directory *dir;
-    struct directory_entry ent;
-
     directory_make("/foo");
-    dir = directory_open(0);
-    directory_get(dir, &ent);
-    directory_get(dir, &ent);
-    directory_get(dir, &ent);
-    CTEST_ASSERT(ent.inode_num == 1, "Testing directory entry inode number after directory_make");
-    CTEST_ASSERT(strcmp(ent.name, "foo") == 0, "Testing directory entry name after directory_make");
+    directory_make("/foo/bar");
+    directory_make("/baz");
 
-    directory_close(dir);
+    struct inode *in = namei("/foo/bar");
+    CTEST_ASSERT(in != NULL && in->inode_num == 2, "Testing namei() on a nested path");
+    iput(in);
+    in = namei("/foo/./bar/../../baz/");
+    CTEST_ASSERT(in != NULL && in->inode_num == 3, "Testing namei() through . and .. entries");
+    iput(in);
+    CTEST_ASSERT(namei("/foo/nope") == NULL, "Testing namei() on a missing component");
+    CTEST_ASSERT(namei("/foo/bar/baz/qux") == NULL, "Testing namei() past a missing directory");
+    CTEST_ASSERT(namei("/averyveryverylongname") == NULL, "Testing namei() on a name too long for an entry");
     teardown();
 }
 
-int main(void) {
-    CTEST_VERBOSE(1);
+void test_dcache(void) {
+    setup();
+    directory_make("/foo");
+    struct inode *in = namei("/foo");
+    iput(in);
 
-    // image.c - image_open(), image_close()
-    test_non_existent_image_open_and_close();
-    test_existing_image_open_and_close();
-    test_image_open_fail();
-    test_image_close_fail();
+    struct dcache_stats stats;
+    dcache_reset_stats();
+    in = namei("/foo");
+    iput(in);
+    dcache_get_stats(&stats);
+    CTEST_ASSERT(stats.hits == 1 && stats.misses == 0, "Testing a repeated lookup is served by the dentry cache");
 
-    // block.c - bread(), bwrite()
-    test_bwrite_and_bread();
+    CTEST_ASSERT(namei("/bar") == NULL, "Testing namei() on a missing name");
+    CTEST_ASSERT(namei("/bar") == NULL, "Testing namei() on a missing name again");
+    dcache_get_stats(&stats);
+    CTEST_ASSERT(stats.negative_hits == 1 && stats.misses == 1, "Testing the dentry cache remembers missing names");
 
-    // free.c - set_free(), find_free()
-    test_setting_with_set_free();
-    test_clearing_with_set_free();
-    test_find_free_all_bits_set();
-    test_find_free_one_bit_clear();
+    directory_make("/bar");
+    in = namei("/bar");
+    CTEST_ASSERT(in != NULL && in->inode_num == 2, "Testing directory_make() replaces a negative entry");
+    iput(in);
 
-    // inode.c, block.c - ialloc(), alloc()
-    test_ialloc_no_free_inode();
-    test_ialloc_free_inode_found();
-    test_alloc_no_free_block();
+    // a fresh file system must not see the old names
+    mkfs();
+    CTEST_ASSERT(namei("/foo") == NULL, "Testing mkfs() invalidates the dentry cache");
+    teardown();
+}
+
+void test_directory_index(void) {
+    setup();
+    directory_set_index_threshold(8);
+    char path[32];
+    int all_made = 1;
+    for(int i = 0; i < 100; i++) {
+        sprintf(path, "/dir%d", i);
+        all_made = all_made && directory_make(path) == 0;
+    }
+    CTEST_ASSERT(all_made, "Testing directory_make() as the parent gets indexed");
+    struct inode *root = iget(ROOT_INODE_NUM);
+    CTEST_ASSERT(directory_index_root(root) != 0, "Testing a directory past the threshold gets an index");
+    CTEST_ASSERT(directory_make("/dir42") == -1, "Testing directory_make() rejects a duplicate name");
+
+    // bypass the dentry cache so lookups go to the index
+    dcache_forget_image(image_current());
+    struct bcache_stats before, after;
+    bcache_get_stats(image_current(), &before);
+    int found = directory_lookup(root, "dir77");
+    bcache_get_stats(image_current(), &after);
+    CTEST_ASSERT(found == 78, "Testing a lookup through the directory index");
+    CTEST_ASSERT(after.hits + after.misses - before.hits - before.misses <= 4,
+                 "Testing an indexed lookup reads only a few blocks");
+    CTEST_ASSERT(directory_lookup(root, "dir100") == -1, "Testing an indexed lookup of a missing name");
+
+    int all_found = 1;
+    dcache_forget_image(image_current());
+    for(int i = 0; i < 100; i++) {
+        sprintf(path, "dir%d", i);
+        all_found = all_found && directory_lookup(root, path) == i + 1;
+    }
+    CTEST_ASSERT(all_found, "Testing every name is reachable through the index");
+    iput(root);
+    directory_set_index_threshold(DIR_INDEX_DEFAULT_THRESHOLD);
+    teardown();
+}
+
+void test_directory_get_many(void) {
+    setup();
+    char path[32];
+    for(int i = 0; i < 100; i++) {
+        sprintf(path, "/d%d", i);
+        directory_make(path);
+    }
+
+    struct directory_entry ents[200];
+    struct bcache_stats before, after;
+    journal_commit();
+    struct directory *dir = directory_open(ROOT_INODE_NUM);
+    bcache_get_stats(image_current(), &before);
+    int n = directory_get_many(dir, ents, 200);
+    bcache_get_stats(image_current(), &after);
+    CTEST_ASSERT(n == 102, "Testing directory_get_many() reads every entry");
+    CTEST_ASSERT(strcmp(ents[0].name, ".") == 0 && strcmp(ents[101].name, "d99") == 0 && ents[101].inode_num == 100,
+                 "Testing directory_get_many() decodes the entries");
+    CTEST_ASSERT(after.hits + after.misses - before.hits - before.misses == 1,
+                 "Testing directory_get_many() reads a block of entries at once");
+    CTEST_ASSERT(directory_get_many(dir, ents, 200) == 0, "Testing directory_get_many() at the end");
+    directory_close(dir);
+
+    // read a few, remember where, and pick up from there on a new handle
+    dir = directory_open(ROOT_INODE_NUM);
+    directory_get_many(dir, ents, 10);
+    unsigned int cookie = directory_tell(dir);
+    directory_close(dir);
+    dir = directory_open(ROOT_INODE_NUM);
+    CTEST_ASSERT(directory_seek(dir, cookie) == 0, "Testing directory_seek() to a cookie");
+    n = directory_get_many(dir, ents, 5);
+    CTEST_ASSERT(n == 5 && strcmp(ents[0].name, "d8") == 0, "Testing iteration resumes at the cookie");
+    CTEST_ASSERT(directory_seek(dir, cookie + 1) == -1, "Testing directory_seek() rejects a bad cookie");
+    directory_close(dir);
+    teardown();
+}
+
+void test_directory_growth(void) {
+    setup();
+    directory_set_prealloc(4);
+    directory_make("/big");
+    struct inode *big = namei("/big");
+    char name[16];
+    int all_added = 1;
+    for(int i = 0; i < 3000; i++) {
+        sprintf(name, "n%d", i);
+        // every entry names the same inode, like hard links
+        all_added = all_added && directory_add_entry(big, name, big->inode_num) == 0;
+    }
+    CTEST_ASSERT(all_added, "Testing a directory grows past its direct block pointers");
+    CTEST_ASSERT(big->size == 3002 * DIR_ENTRY_SIZE && big->indirect != 0, "Testing growth reaches the indirect block");
+
+    int contiguous = 1;
+    for(int i = 1; i < 4; i++) {
+        contiguous = contiguous && bmap(big, i) == bmap(big, 1) + i - 1;
+    }
+    CTEST_ASSERT(contiguous, "Testing each growth step preallocates a contiguous run");
+
+    struct directory *dir = directory_open(big->inode_num);
+    struct directory_entry ents[128];
+    char last[16] = "";
+    int total = 0, n;
+    while((n = directory_get_many(dir, ents, 128)) > 0) {
+        total += n;
+        strcpy(last, ents[n - 1].name);
+    }
+    directory_close(dir);
+    CTEST_ASSERT(total == 3002 && strcmp(last, "n2999") == 0,
+                 "Testing every entry of a grown directory can be listed");
+
+    dcache_forget_image(image_current());
+    CTEST_ASSERT(directory_lookup(big, "n2500") == (int)big->inode_num, "Testing a lookup in a grown directory");
+    iput(big);
+    directory_set_prealloc(DIR_DEFAULT_PREALLOC);
+    teardown();
+}
+
+void test_directory_make_inode_limit(void) {
+    setup();
+    char path[32];
+    int made = 0;
+    for(int i = 0; i < NUM_INODES + 50; i++) {
+        sprintf(path, "/d%d", i);
+        made += directory_make(path) == 0;
+    }
+    CTEST_ASSERT(made == NUM_INODES - 1, "Testing directory_make() stops when the inode table is full");
+
+    // the inode table must not have spilled over into directory blocks
+    struct inode *in = namei("/d0/./.");
+    CTEST_ASSERT(in != NULL && in->inode_num == 1, "Testing directories stay intact after filling the inode table");
+    iput(in);
+    teardown();
+}
+
+void test_directory_make_long_name(void) {
+    setup();
+    CTEST_ASSERT(directory_make("/abcdefghijklmno") == 0, "Testing directory_make() with the longest name that fits");
+    CTEST_ASSERT(directory_make("/abcdefghijklmnop") == -1, "Testing directory_make() refuses a name too long for an entry");
+    CTEST_ASSERT(directory_make("/abcdefghijklmnopq") == -1, "Testing a long name is not truncated onto an existing one");
+    CTEST_ASSERT(file_create("/abcdefghijklmnopq") == -1, "Testing file_create() refuses a name too long for an entry");
+    CTEST_ASSERT(namei("/abcdefghijklmnop") == NULL, "Testing a refused name is not in the directory");
+
+    // refused names must not use up an inode
+    CTEST_ASSERT(directory_make("/b") == 0, "Testing directory_make() after refused names");
+    struct inode *in = namei("/b");
+    CTEST_ASSERT(in != NULL && in->inode_num == 2, "Testing refused names allocate no inode");
+    iput(in);
+    teardown();
+}
+
+void test_directory_small_stays_linear(void) {
+    setup();
+    directory_make("/foo");
+    struct inode *root = iget(ROOT_INODE_NUM);
+    CTEST_ASSERT(directory_index_root(root) == 0, "Testing a tiny directory has no index");
+    iput(root);
+    teardown();
+}
+
+void test_directory_make(void) {
+    setup();
+    struct directory *dir;
+    struct directory_entry ent;
+
+    directory_make("/foo");
+    dir = directory_open(0);
+    directory_get(dir, &ent);
+    directory_get(dir, &ent);
+    directory_get(dir, &ent);
+    CTEST_ASSERT(ent.inode_num == 1, "Testing directory entry inode number after directory_make");
+    CTEST_ASSERT(strcmp(ent.name, "foo") == 0, "Testing directory entry name after directory_make");
+
+    directory_close(dir);
+    teardown();
+}
+
+void test_file_create_and_open(void) {
+    setup();
+    directory_make("/docs");
+    CTEST_ASSERT(file_create("/docs/a.txt") == 0, "Testing file_create()");
+    CTEST_ASSERT(file_create("/docs/a.txt") == -1, "Testing file_create() on an existing name");
+    CTEST_ASSERT(file_create("/nope/a.txt") == -1, "Testing file_create() in a missing directory");
+    CTEST_ASSERT(file_open("/docs/b.txt") == NULL, "Testing file_open() on a missing file");
+    CTEST_ASSERT(file_open("/docs") == NULL, "Testing file_open() on a directory");
+
+    struct file *f = file_open("/docs/a.txt");
+    CTEST_ASSERT(f != NULL && f->inode->size == 0, "Testing file_open() on a new file");
+    char buf[16];
+    CTEST_ASSERT(file_read(f, buf, sizeof(buf)) == 0, "Testing file_read() on an empty file");
+    CTEST_ASSERT(file_write(f, "hello", 5) == 5, "Testing a small file_write()");
+    file_close(f);
+
+    f = file_open("/docs/a.txt");
+    CTEST_ASSERT(file_read(f, buf, sizeof(buf)) == 5 && memcmp(buf, "hello", 5) == 0,
+                 "Testing file_read() sees what was written");
+    file_close(f);
+    teardown();
+}
+
+void test_file_large_sequential(void) {
+    setup();
+    file_create("/big");
+    struct file *f = file_open("/big");
+    int len = 1024 * 1024;          // well past the 16 direct blocks
+    unsigned char *data = malloc(len);
+    unsigned char *back = malloc(len);
+    for(int i = 0; i < len; i++) {
+        data[i] = (unsigned char)(i * 7 + i / BLOCK_SIZE);
+    }
+
+    CTEST_ASSERT(file_write(f, data, len) == len, "Testing a 1 MiB file_write()");
+    int contiguous = 1;
+    for(int i = 1; i < len / BLOCK_SIZE; i++) {
+        contiguous = contiguous && bmap(f->inode, i) == bmap(f->inode, 0) + i;
+    }
+    CTEST_ASSERT(contiguous, "Testing a sequential write lands in one contiguous run");
+    CTEST_ASSERT(f->inode->indirect != 0, "Testing a large file uses the indirect block");
+
+    file_seek(f, 0);
+    CTEST_ASSERT(file_read(f, back, len) == len && memcmp(data, back, len) == 0, "Testing a 1 MiB file_read()");
+
+    // unaligned reads and writes that straddle block boundaries
+    file_seek(f, BLOCK_SIZE - 10);
+    CTEST_ASSERT(file_write(f, "0123456789abcdefghij", 20) == 20, "Testing an unaligned file_write()");
+    memcpy(data + BLOCK_SIZE - 10, "0123456789abcdefghij", 20);
+    file_seek(f, 100);
+    CTEST_ASSERT(file_read(f, back, 3 * BLOCK_SIZE) == 3 * BLOCK_SIZE && memcmp(data + 100, back, 3 * BLOCK_SIZE) == 0,
+                 "Testing an unaligned file_read()");
+
+    file_seek(f, len - 5);
+    CTEST_ASSERT(file_read(f, back, 100) == 5, "Testing file_read() stops at the end of the file");
+    file_close(f);
+    free(data);
+    free(back);
+    teardown();
+}
+
+void test_file_truncate_and_holes(void) {
+    setup();
+    file_create("/t");
+    struct file *f = file_open("/t");
+    unsigned char block[3 * BLOCK_SIZE];
+    memset(block, 0xAB, sizeof(block));
+    file_write(f, block, sizeof(block));
+    file_flush(f);
+
+    struct freemap_stats before, after;
+    alloc_stats(&before);
+    CTEST_ASSERT(file_truncate(f, 100) == 0 && f->inode->size == 100, "Testing file_truncate() shrinking");
+    alloc_stats(&after);
+    CTEST_ASSERT(after.free_bits == before.free_bits + 2, "Testing file_truncate() frees the blocks past the end");
+
+    // grow again: the old bytes past 100 must not come back
+    CTEST_ASSERT(file_truncate(f, 2 * BLOCK_SIZE) == 0, "Testing file_truncate() growing");
+    file_seek(f, 0);
+    file_read(f, block, sizeof(block));
+    int zeros = 1;
+    for(int i = 100; i < 2 * BLOCK_SIZE; i++) {
+        zeros = zeros && block[i] == 0;
+    }
+    CTEST_ASSERT(block[99] == 0xAB && zeros, "Testing a truncated and regrown file reads zeros past the old end");
+
+    // write past the end, leaving a hole
+    file_seek(f, 10 * BLOCK_SIZE);
+    file_write(f, "x", 1);
+    file_flush(f);
+    CTEST_ASSERT(bmap(f->inode, 5) == 0 && f->inode->size == 10 * BLOCK_SIZE + 1, "Testing a write past the end leaves a hole");
+    file_seek(f, 5 * BLOCK_SIZE);
+    memset(block, 1, BLOCK_SIZE);
+    file_read(f, block, BLOCK_SIZE);
+    CTEST_ASSERT(block[0] == 0 && block[BLOCK_SIZE - 1] == 0, "Testing a hole reads back as zeros");
+    file_close(f);
+    teardown();
+}
+
+void test_file_write_image_full(void) {
+    setup();
+    file_create("/full");
+    file_set_write_buffer(0);
+    struct file *f = file_open("/full");
+    file_set_write_buffer(FILE_WRITE_BUFFER_DEFAULT_BLOCKS);
+
+    // take every block, then hand back a few that are not next to each other
+    int taken[NUM_BLOCKS];
+    int ntaken = 0;
+    int num;
+    while((num = alloc()) != -1) {
+        taken[ntaken++] = num;
+    }
+    for(int i = 0; i < 8; i++) {
+        bfree(taken[i * 2]);
+    }
+
+    struct freemap_stats before, after;
+    alloc_stats(&before);
+    unsigned char data[20 * BLOCK_SIZE];
+    memset(data, 0x5A, sizeof(data));
+    file_set_write_buffer(0);
+    CTEST_ASSERT(file_write(f, data, sizeof(data)) == -1, "Testing file_write() on a full image");
+    alloc_stats(&after);
+    CTEST_ASSERT(after.free_bits == before.free_bits, "Testing a failed file_write() frees the blocks it took");
+    CTEST_ASSERT(f->inode->size == 0 && bmap(f->inode, 0) == 0 && f->inode->indirect == 0,
+                 "Testing a failed file_write() leaves the file unmapped");
+    file_close(f);
+    teardown();
+}
+
+// reads the whole file a block at a time from a cold cache and returns
+// the read system calls it took
+static unsigned long cold_block_reads(struct file *f, int nblocks) {
+    struct image *img = image_current();
+    unsigned char block[BLOCK_SIZE];
+    bsync();
+    bcache_invalidate(img);
+    file_seek(f, 0);
+    unsigned long read_calls = img->read_calls;
+    for(int i = 0; i < nblocks; i++) {
+        file_read(f, block, BLOCK_SIZE);
+    }
+    return img->read_calls - read_calls;
+}
+
+void test_readahead_sequential(void) {
+    setup();
+    file_create("/seq");
+    struct file *f = file_open("/seq");
+    int nblocks = 64;
+    unsigned char *data = malloc(nblocks * BLOCK_SIZE);
+    memset(data, 0x5A, nblocks * BLOCK_SIZE);
+    file_write(f, data, nblocks * BLOCK_SIZE);
+
+    readahead_set_max(0);
+    unsigned long without = cold_block_reads(f, nblocks);
+    readahead_set_max(READAHEAD_DEFAULT_MAX_BLOCKS);
+    f->inode->ra_next = f->inode->ra_window = f->inode->ra_end = 0;
+    readahead_reset_stats();
+    unsigned long with = cold_block_reads(f, nblocks);
+
+    struct readahead_stats stats;
+    readahead_get_stats(&stats);
+    CTEST_ASSERT(without >= (unsigned long)nblocks, "Testing block-at-a-time reads without readahead");
+    CTEST_ASSERT(with * 4 < without, "Testing readahead batches sequential reads");
+    CTEST_ASSERT(stats.random == 0 && f->inode->ra_window == READAHEAD_DEFAULT_MAX_BLOCKS,
+                 "Testing the readahead window grows to its maximum");
+
+    file_seek(f, 0);
+    CTEST_ASSERT(file_read(f, data, nblocks * BLOCK_SIZE) == nblocks * BLOCK_SIZE && data[BLOCK_SIZE * 40] == 0x5A,
+                 "Testing data read through readahead");
+    file_close(f);
+    free(data);
+    teardown();
+}
+
+void test_readahead_random(void) {
+    setup();
+    file_create("/rnd");
+    struct file *f = file_open("/rnd");
+    unsigned char block[BLOCK_SIZE];
+    memset(block, 1, BLOCK_SIZE);
+    for(int i = 0; i < 64; i++) {
+        file_write(f, block, BLOCK_SIZE);
+    }
+
+    file_seek(f, 0);
+    for(int i = 0; i < 8; i++) {
+        file_read(f, block, BLOCK_SIZE);
+    }
+    int open_window = f->inode->ra_window;
+
+    readahead_reset_stats();
+    int offsets[] = {50, 3, 41, 17, 60, 9};
+    for(int i = 0; i < 6; i++) {
+        file_seek(f, offsets[i] * BLOCK_SIZE);
+        file_read(f, block, BLOCK_SIZE);
+    }
+    struct readahead_stats stats;
+    readahead_get_stats(&stats);
+    CTEST_ASSERT(open_window >= READAHEAD_MIN_BLOCKS && f->inode->ra_window < READAHEAD_MIN_BLOCKS,
+                 "Testing random reads close the readahead window");
+    CTEST_ASSERT(stats.random == 6 && stats.windows == 3, "Testing the window halves on each random read until it closes");
+    file_close(f);
+    teardown();
+}
+
+// appends to two files in turn, in writes of len bytes, total bytes each
+static void interleaved_appends(struct file *a, struct file *b, int len, int total) {
+    unsigned char chunk[512];
+    for(int done = 0; done < total; done += len) {
+        memset(chunk, done / len, len);
+        file_write(a, chunk, len);
+        memset(chunk, ~(done / len), len);
+        file_write(b, chunk, len);
+    }
+}
+
+static int is_contiguous(struct inode *in, int nblocks) {
+    int contiguous = 1;
+    for(int i = 1; i < nblocks; i++) {
+        contiguous = contiguous && bmap(in, i) == bmap(in, 0) + i;
+    }
+    return contiguous;
+}
+
+void test_file_delayed_allocation(void) {
+    setup();
+    int total = 16 * BLOCK_SIZE;
+    file_create("/a");
+    file_create("/b");
+    file_create("/c");
+    file_create("/d");
+
+    // written straight through, the two files take turns at the allocator
+    file_set_write_buffer(0);
+    struct file *a = file_open("/a");
+    struct file *b = file_open("/b");
+    interleaved_appends(a, b, 512, total);
+    CTEST_ASSERT(!is_contiguous(a->inode, 16), "Testing interleaved write-through appends fragment a file");
+    file_close(a);
+    file_close(b);
+
+    file_set_write_buffer(FILE_WRITE_BUFFER_DEFAULT_BLOCKS);
+    struct file *c = file_open("/c");
+    struct file *d = file_open("/d");
+    interleaved_appends(c, d, 512, total);
+    CTEST_ASSERT(c->inode->size == 0 && bmap(c->inode, 0) == 0, "Testing buffered writes are not given blocks yet");
+    file_close(c);
+    file_close(d);
+
+    c = file_open("/c");
+    d = file_open("/d");
+    CTEST_ASSERT(c->inode->size == (unsigned int)total && is_contiguous(c->inode, 16) && is_contiguous(d->inode, 16),
+                 "Testing delayed allocation gives each file one contiguous run");
+
+    unsigned char *back = malloc(total);
+    int same = file_read(d, back, total) == total;
+    for(int i = 0; i < total; i++) {
+        same = same && back[i] == (unsigned char)~(i / 512);
+    }
+    CTEST_ASSERT(same, "Testing data written through the write buffer");
+    free(back);
+    file_close(c);
+    file_close(d);
+    teardown();
+}
+
+void test_file_write_coalescing(void) {
+    setup();
+    file_create("/log");
+    struct file *f = file_open("/log");
+    struct image *img = image_current();
+    unsigned char line[100];
+    for(int i = 0; i < 100; i++) {
+        memset(line, 'a' + i % 26, sizeof(line));
+        file_write(f, line, sizeof(line));
+    }
+
+    // a read sees what was written before it
+    unsigned char back[100];
+    file_seek(f, 250 * 100);
+    CTEST_ASSERT(file_read(f, back, 100) == 0, "Testing a read past buffered data");
+    file_seek(f, 42 * 100);
+    CTEST_ASSERT(file_read(f, back, 100) == 100 && back[0] == 'a' + 42 % 26 && back[99] == 'a' + 42 % 26,
+                 "Testing a read flushes the write buffer");
+
+    // 100 appends of 100 bytes reach the disk as three whole blocks
+    bsync();
+    unsigned long write_calls = img->write_calls;
+    file_seek(f, 100 * 100);
+    for(int i = 0; i < 100; i++) {
+        file_write(f, line, sizeof(line));
+    }
+    file_flush(f);
+    bsync();
+    CTEST_ASSERT(img->write_calls - write_calls <= 3 && f->inode->size == 200 * 100,
+                 "Testing small appends are coalesced into block writes");
+    file_close(f);
+    teardown();
+}
+
+void test_superblock(void) {
+    setup();
+    struct superblock sb;
+    unsigned char block[BLOCK_SIZE];
+    bread(SUPERBLOCK_NUM, block);
+    CTEST_ASSERT(superblock_unpack(block, &sb) == 0 && sb.nblocks == NUM_BLOCKS && sb.ninodes == NUM_INODES,
+                 "Testing mkfs() writes a superblock");
+    CTEST_ASSERT(sb.inode_map_start == FREE_INODE_MAP_NUM && sb.block_map_start == FREE_BLOCK_MAP_NUM &&
+                 sb.inode_table_start == INODE_FIRST_BLOCK && sb.journal_start == 7 &&
+                 sb.data_start == 7 + JOURNAL_DEFAULT_BLOCKS,
+                 "Testing the default geometry keeps the old layout ahead of the journal");
+
+    struct mkfs_opts opts;
+    mkfs_default_opts(&opts);
+    opts.block_size = 1024;
+    CTEST_ASSERT(mkfs_opts(&opts) == -1, "Testing mkfs_opts() rejects a block size it was not built for");
+    mkfs_default_opts(&opts);
+    opts.ninodes = SUPERBLOCK_MAX_INODES + 1;
+    CTEST_ASSERT(mkfs_opts(&opts) == -1, "Testing mkfs_opts() rejects too many inodes");
+    mkfs_default_opts(&opts);
+    opts.nblocks = 7;
+    CTEST_ASSERT(mkfs_opts(&opts) == -1, "Testing mkfs_opts() rejects an image too small for its metadata");
+
+    // an image without a superblock gets the default geometry
+    memset(block, 0, BLOCK_SIZE);
+    bwrite(SUPERBLOCK_NUM, block);
+    image_close();
+    image_open(TEST_IMAGE, 0);
+    CTEST_ASSERT(image_current()->sb.nblocks == NUM_BLOCKS && image_current()->sb.data_start == 7,
+                 "Testing an image without a superblock");
+    teardown();
+}
+
+void test_large_geometry(void) {
+    unsigned int nblocks = 1 << 20;     // a 4 GiB image
+    setup_geometry(nblocks, SUPERBLOCK_MAX_INODES);
+    struct superblock *sb = &image_current()->sb;
+    CTEST_ASSERT(sb->block_map_blocks == 32 && sb->inode_map_blocks == 2 && sb->inode_table_blocks == 1024,
+                 "Testing multi-block maps and inode table");
+
+    struct freemap_stats stats;
+    alloc_stats(&stats);
+    CTEST_ASSERT(stats.free_bits == (int)(nblocks - sb->data_start - 1), "Testing the block map covers the whole image");
+
+    // a block far past what 16 bits could point at
+    unsigned char data[BLOCK_SIZE];
+    memset(data, 0x3C, BLOCK_SIZE);
+    file_create("/far");
+    struct file *f = file_open("/far");
+    int far = alloc_near(nblocks - 100);
+    bmap_set(f->inode, 0, far);
+    file_write(f, data, BLOCK_SIZE);
+    file_close(f);
+
+    int made = 0;
+    char name[16];
+    for(int i = 0; i < 300; i++) {
+        sprintf(name, "/d%d", i);
+        made += directory_make(name) == 0;
+    }
+
+    image_close();
+    image_open(TEST_IMAGE, 0);
+    f = file_open("/far");
+    memset(data, 0, BLOCK_SIZE);
+    CTEST_ASSERT(far == (int)nblocks - 100 && bmap(f->inode, 0) == far, "Testing 32-bit block pointers");
+    CTEST_ASSERT(file_read(f, data, BLOCK_SIZE) == BLOCK_SIZE && data[0] == 0x3C && data[BLOCK_SIZE - 1] == 0x3C,
+                 "Testing data in a block past 64 Ki");
+    file_close(f);
+    struct inode *in = namei("/d299");
+    CTEST_ASSERT(made == 300 && in != NULL && in->inode_num > NUM_INODES, "Testing more inodes than the default geometry");
+    if(in != NULL) {
+        iput(in);
+    }
+    teardown();
+}
+
+void test_mkfs_sparse(void) {
+    unsigned int nblocks = 1 << 18;     // 1 GiB
+    struct mkfs_opts opts;
+    mkfs_default_opts(&opts);
+    opts.nblocks = nblocks;
+    image_open(TEST_IMAGE, 1);
+    struct image *img = image_current();
+    unsigned long write_calls = img->write_calls;
+    CTEST_ASSERT(mkfs_opts(&opts) == 0 && img->write_calls - write_calls <= 3, "Testing mkfs writes its metadata in a few I/Os");
+
+    struct stat st;
+    fstat(img->fd, &st);
+    CTEST_ASSERT(st.st_size == (off_t)nblocks * BLOCK_SIZE && st.st_blocks * 512 < 1024 * 1024,
+                 "Testing mkfs leaves a sparse image");
+
+    // formatting again throws away what was there
+    file_create("/old");
+    mkfs_opts(&opts);
+    struct inode *in = namei("/old");
+    struct freemap_stats stats;
+    alloc_stats(&stats);
+    CTEST_ASSERT(in == NULL && stats.free_bits == (int)(nblocks - img->sb.data_start - 1), "Testing mkfs over an old image");
+    teardown();
+}
+
+void test_mkfs_preallocate(void) {
+    unsigned int nblocks = 2048;
+    struct mkfs_opts opts;
+    mkfs_default_opts(&opts);
+    opts.nblocks = nblocks;
+    opts.preallocate = 1;
+    image_open(TEST_IMAGE, 1);
+    mkfs_opts(&opts);
+
+    struct stat st;
+    fstat(image_current()->fd, &st);
+    CTEST_ASSERT(st.st_size == (off_t)nblocks * BLOCK_SIZE && st.st_blocks * 512 >= st.st_size,
+                 "Testing mkfs can preallocate the image");
+    CTEST_ASSERT(directory_make("/dir") == 0 && namei("/dir") != NULL, "Testing a preallocated image is usable");
+    teardown();
+}
+
+void test_pack_u32(void) {
+    unsigned char bytes[64];
+    write_u32(bytes + 1, 0xA3B2C1D0);
+    CTEST_ASSERT(bytes[1] == 0xA3 && bytes[4] == 0xD0 && read_u32(bytes + 1) == 0xA3B2C1D0,
+                 "Testing big-endian u32 with the top bit set");
+    write_u16(bytes + 7, 0xBEEF);
+    CTEST_ASSERT(bytes[7] == 0xBE && read_u16(bytes + 7) == 0xBEEF, "Testing big-endian u16");
+
+    // 13 values at an odd address: three shuffles and a scalar tail
+    unsigned int values[13];
+    unsigned int scalar[13];
+    unsigned int shuffled[13];
+    for(int i = 0; i < 13; i++) {
+        values[i] = 0x01020304u * (i + 1) + 0x80000000u;
+    }
+    int agree = 1;
+    for(int level = PACK_SIMD_NONE; level <= PACK_SIMD_SSSE3; level++) {
+        pack_use_simd(level);
+        write_u32_many(bytes + 3, values, 13);
+        for(int i = 0; i < 13; i++) {
+            agree = agree && read_u32(bytes + 3 + i * 4) == values[i];
+        }
+        read_u32_many(bytes + 3, level == PACK_SIMD_NONE ? scalar : shuffled, 13);
+    }
+    pack_use_simd(PACK_SIMD_SSSE3);
+    CTEST_ASSERT(agree && memcmp(scalar, values, sizeof(values)) == 0 && memcmp(shuffled, values, sizeof(values)) == 0,
+                 "Testing bulk u32 codecs agree with read_u32()");
+}
+
+void test_inode_block_codec(void) {
+    static struct inode inodes[INODES_PER_BLOCK];
+    static struct inode back[INODES_PER_BLOCK];
+    unsigned char block[BLOCK_SIZE];
+    memset(inodes, 0, sizeof(inodes));
+    for(int i = 0; i < INODES_PER_BLOCK; i++) {
+        inodes[i].size = 0x80000000u + i * 4099;
+        inodes[i].owner_id = 60000 + i;
+        inodes[i].permissions = i;
+        inodes[i].flags = i % 3;
+        inodes[i].link_count = i + 1;
+        for(int j = 0; j < INODE_PTR_COUNT; j++) {
+            inodes[i].block_ptr[j] = 0x00F00000u + i * 100 + j;
+        }
+        inodes[i].indirect = 0xFFFFFF00u + i;
+    }
+    encode_inode_block(block, inodes);
+    decode_inode_block(block, back);
+
+    int same = 1;
+    for(int i = 0; i < INODES_PER_BLOCK; i++) {
+        same = same && back[i].size == inodes[i].size && back[i].owner_id == inodes[i].owner_id &&
+               back[i].permissions == inodes[i].permissions && back[i].flags == inodes[i].flags &&
+               back[i].link_count == inodes[i].link_count && back[i].indirect == inodes[i].indirect &&
+               memcmp(back[i].block_ptr, inodes[i].block_ptr, sizeof(back[i].block_ptr)) == 0;
+    }
+    CTEST_ASSERT(same, "Testing an inode-table block round-trips");
+
+    unsigned char *slot = block + 5 * INODE_SIZE;
+    CTEST_ASSERT(read_u32(slot) == inodes[5].size && read_u16(slot + 4) == inodes[5].owner_id &&
+                 read_u32(slot + INODE_PTR_OFFSET + 4 * 7) == inodes[5].block_ptr[7] &&
+                 read_u32(slot + INODE_INDIRECT_OFFSET) == inodes[5].indirect,
+                 "Testing the inode-table codec keeps the on-disk layout");
+}
+
+void test_dir_block_codec(void) {
+    static struct directory_entry ents[DIR_ENTRIES_PER_BLOCK];
+    static struct directory_entry back[DIR_ENTRIES_PER_BLOCK];
+    unsigned char block[BLOCK_SIZE];
+    for(int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+        ents[i].inode_num = 65535 - i;
+        sprintf(ents[i].name, "entry%d", i);
+    }
+    strcpy(ents[7].name, "fifteen_chars_x");
+    encode_dir_block(block, ents, DIR_ENTRIES_PER_BLOCK);
+    decode_dir_block(block, back, DIR_ENTRIES_PER_BLOCK);
+
+    int same = 1;
+    for(int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+        same = same && back[i].inode_num == ents[i].inode_num && strcmp(back[i].name, ents[i].name) == 0;
+    }
+    CTEST_ASSERT(same, "Testing a directory block round-trips");
+    CTEST_ASSERT(read_u16(block + 3 * DIR_ENTRY_SIZE) == 65532 &&
+                 strcmp((char *)block + 3 * DIR_ENTRY_SIZE + DIR_NAME_OFFSET, "entry3") == 0,
+                 "Testing the directory codec keeps the on-disk layout");
+}
+
+#define CRASH_IMAGE "inode_test_crash_image.dat"
+
+// Copies the image file the way a crash would leave it: what the library
+// has written to the file so far, and nothing it still holds in memory
+static void copy_image(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb");
+    FILE *out = fopen(to, "wb");
+    char buf[BLOCK_SIZE];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        fwrite(buf, 1, n, out);
+    }
+    fclose(in);
+    fclose(out);
+}
+
+void test_journal_group_commit(void) {
+    setup();
+    struct image *img = image_current();
+    struct journal_stats stats;
+    journal_set_batch(16);
+    journal_reset_stats();
+    unsigned long write_calls = img->write_calls;
+    unsigned long sync_calls = img->sync_calls;
+    char path[32];
+    for(int i = 0; i < 32; i++) {
+        sprintf(path, "/g%d", i);
+        directory_make(path);
+    }
+    journal_get_stats(&stats);
+    CTEST_ASSERT(stats.ops == 32 && stats.commits == 2, "Testing operations are grouped into one commit per batch");
+    CTEST_ASSERT(img->write_calls - write_calls == 2 && img->sync_calls - sync_calls == 2,
+                 "Testing each group commit is one journal write and one fdatasync()");
+    journal_set_batch(JOURNAL_DEFAULT_BATCH);
+    teardown();
+}
+
+void test_journal_replay(void) {
+    setup();
+    journal_set_batch(1000);
+    directory_make("/a");
+    directory_make("/a/b");
+    copy_image(TEST_IMAGE, CRASH_IMAGE);
+
+    // a crash before the commit leaves the image as it was
+    image_open(CRASH_IMAGE, 0);
+    struct inode *root = iget(ROOT_INODE_NUM);
+    CTEST_ASSERT(namei("/a") == NULL && root->size == DIR_ENTRY_SIZE * 2,
+                 "Testing an uncommitted transaction never reaches the image");
+    iput(root);
+
+    // after the commit the new blocks are only in the cache and the journal
+    setup();
+    directory_make("/a");
+    directory_make("/a/b");
+    journal_commit();
+    copy_image(TEST_IMAGE, CRASH_IMAGE);
+    journal_set_batch(JOURNAL_DEFAULT_BATCH);
+
+    image_open(CRASH_IMAGE, 0);
+    struct journal_stats stats;
+    journal_get_stats(&stats);
+    struct inode *in = namei("/a/b");
+    struct freemap_stats free_stats;
+    alloc_stats(&free_stats);
+    CTEST_ASSERT(stats.replayed == 1 && in != NULL && in->flags == INODE_FLAG_DIR,
+                 "Testing a committed transaction is replayed when the image is opened");
+    CTEST_ASSERT(free_stats.free_bits == (int)(NUM_BLOCKS - image_current()->sb.data_start - 3),
+                 "Testing replay brings the block map along with the directories");
+    if(in != NULL) {
+        iput(in);
+    }
+
+    // a torn commit fails its checksum and is ignored
+    setup();
+    journal_set_batch(1000);
+    directory_make("/c");
+    journal_commit();
+    copy_image(TEST_IMAGE, CRASH_IMAGE);
+    journal_set_batch(JOURNAL_DEFAULT_BATCH);
+    long torn = (long)(image_current()->sb.journal_start + 2) * BLOCK_SIZE + 100;
+    FILE *f = fopen(CRASH_IMAGE, "r+b");
+    fseek(f, torn, SEEK_SET);
+    int c = fgetc(f);
+    fseek(f, torn, SEEK_SET);
+    fputc(c ^ 0xFF, f);
+    fclose(f);
+    image_open(CRASH_IMAGE, 0);
+    journal_get_stats(&stats);
+    CTEST_ASSERT(stats.replayed == 0 && namei("/c") == NULL, "Testing a torn transaction is not replayed");
+    teardown();
+    remove(CRASH_IMAGE);
+}
+
+void test_journal_checkpoint(void) {
+    setup();
+    journal_set_batch(1);
+    journal_reset_stats();
+    char path[32];
+    for(int i = 0; i < 100; i++) {
+        sprintf(path, "/c%d", i);
+        directory_make(path);
+    }
+    struct journal_stats stats;
+    journal_get_stats(&stats);
+    CTEST_ASSERT(stats.commits == 100 && stats.checkpoints > 0, "Testing a full journal is checkpointed");
+    journal_set_batch(JOURNAL_DEFAULT_BATCH);
+
+    image_close();
+    image_open(TEST_IMAGE, 0);
+    int found = 0;
+    for(int i = 0; i < 100; i++) {
+        sprintf(path, "/c%d", i);
+        struct inode *in = namei(path);
+        if(in != NULL) {
+            found++;
+            iput(in);
+        }
+    }
+    journal_get_stats(&stats);
+    CTEST_ASSERT(found == 100 && stats.replayed == 0, "Testing a cleanly closed image has nothing to replay");
+    teardown();
+}
+
+void test_journal_oversized_operation(void) {
+    setup();
+    journal_reset_stats();
+    int first = image_current()->sb.data_start;
+    unsigned char block[BLOCK_SIZE];
+
+    // an operation bigger than the journal is never committed while open
+    journal_begin();
+    for(int i = 0; i < 100; i++) {
+        memset(block, i, BLOCK_SIZE);
+        bwrite(first + i, block);
+    }
+    struct journal_stats stats;
+    journal_get_stats(&stats);
+    CTEST_ASSERT(stats.commits == 0, "Testing a full journal does not commit an open operation");
+    journal_end();
+    journal_get_stats(&stats);
+    CTEST_ASSERT(stats.commits == 2 && stats.blocks == 100, "Testing an oversized operation is committed in pieces once it ends");
+
+    int intact = 1;
+    for(int i = 0; i < 100; i++) {
+        bread(first + i, block);
+        intact = intact && block[0] == i && block[BLOCK_SIZE - 1] == i;
+    }
+    CTEST_ASSERT(intact, "Testing every block of an oversized operation reads back");
+    teardown();
+}
+
+void test_journal_file_write(void) {
+    setup();
+    file_create("/f");
+    journal_commit();
+    struct freemap_stats before;
+    alloc_stats(&before);
+    journal_set_batch(1000);
+    file_set_write_buffer(0);
+    unsigned char data[3 * BLOCK_SIZE];
+    memset(data, 0x3C, sizeof(data));
+    struct file *f = file_open("/f");
+    file_write(f, data, sizeof(data));
+
+    // a crash before the commit loses the write's blocks and size together
+    copy_image(TEST_IMAGE, CRASH_IMAGE);
+    journal_commit();
+    copy_image(TEST_IMAGE, CRASH_IMAGE ".2");
+    file_close(f);
+    image_open(CRASH_IMAGE, 0);
+    struct freemap_stats after;
+    alloc_stats(&after);
+    struct inode *in = namei("/f");
+    CTEST_ASSERT(in != NULL && in->size == 0 && bmap(in, 0) == 0 && after.free_bits == before.free_bits,
+                 "Testing an uncommitted write leaves neither its blocks nor its size behind");
+    if(in != NULL) {
+        iput(in);
+    }
+
+    // once committed, the blocks and the size come back together
+    image_open(CRASH_IMAGE ".2", 0);
+    alloc_stats(&after);
+    in = namei("/f");
+    CTEST_ASSERT(in != NULL && in->size == sizeof(data) && bmap(in, 2) != 0 && after.free_bits == before.free_bits - 3,
+                 "Testing a committed write brings its blocks and size back together");
+    if(in != NULL) {
+        iput(in);
+    }
+    journal_set_batch(JOURNAL_DEFAULT_BATCH);
+
+    // a journal too small for the whole write gets it in pieces
+    struct mkfs_opts opts;
+    image_open(TEST_IMAGE, 1);
+    mkfs_default_opts(&opts);
+    opts.journal_blocks = 8;
+    mkfs_opts(&opts);
+    file_create("/g");
+    journal_reset_stats();
+    f = file_open("/g");
+    file_write(f, data, sizeof(data));
+    struct journal_stats stats;
+    journal_get_stats(&stats);
+    CTEST_ASSERT(stats.ops == 3, "Testing a write too big for the journal is split over transactions");
+    memset(data, 0, sizeof(data));
+    file_seek(f, 0);
+    CTEST_ASSERT(file_read(f, data, sizeof(data)) == sizeof(data) && data[0] == 0x3C && data[sizeof(data) - 1] == 0x3C,
+                 "Testing a split write reads back whole");
+    file_close(f);
+    file_set_write_buffer(FILE_WRITE_BUFFER_DEFAULT_BLOCKS);
+    teardown();
+    remove(CRASH_IMAGE);
+    remove(CRASH_IMAGE ".2");
+}
+
+// writes the inodes back from outside any operation, then sets *done
+static void *isync_thread(void *p) {
+    isync();
+    __atomic_store_n((int *)p, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+void test_journal_isync_waits(void) {
+    setup();
+    file_create("/f");
+    journal_commit();
+
+    // another thread's write-back must not take this half-done operation
+    int done = 0;
+    pthread_t thread;
+    journal_begin();
+    struct inode *in = namei("/f");
+    in->owner_id = 1234;
+    imark_dirty(in);
+    iput(in);
+    pthread_create(&thread, NULL, isync_thread, &done);
+    usleep(30000);
+    int early = __atomic_load_n(&done, __ATOMIC_RELAXED);
+    journal_end();
+    pthread_join(thread, NULL);
+    CTEST_ASSERT(!early && done, "Testing isync() outside an operation waits for the open ones to end");
+
+    image_close();
+    image_open(TEST_IMAGE, 0);
+    in = namei("/f");
+    CTEST_ASSERT(in != NULL && in->owner_id == 1234, "Testing the operation's inode is written back once it ends");
+    if(in != NULL) {
+        iput(in);
+    }
+    teardown();
+}
+
+// like setup(), with the image opened in the given durability mode
+static void setup_durability(int durability, int sync_ms, int sync_writes) {
+    struct image_opts opts;
+    image_default_opts(&opts);
+    opts.durability = durability;
+    opts.sync_ms = sync_ms;
+    opts.sync_writes = sync_writes;
+    image_open_opts(TEST_IMAGE, 1, &opts);
+    mkfs();
+}
+
+void test_durability_each_op(void) {
+    setup_durability(IMAGE_DURABLE_EACH_OP, 0, 0);
+    struct image *img = image_current();
+    unsigned long sync_calls = img->sync_calls;
+    directory_make("/d");
+    CTEST_ASSERT(img->sync_calls - sync_calls == 1, "Testing a journaled operation is durable with one fdatasync()");
+
+    unsigned char data[BLOCK_SIZE];
+    memset(data, 0x5A, BLOCK_SIZE);
+    file_create("/d/f");
+    struct file *f = file_open("/d/f");
+    file_write(f, data, 100);
+    copy_image(TEST_IMAGE, CRASH_IMAGE);
+    file_close(f);
+
+    // nothing is closed or synced by hand before the crash
+    image_open(CRASH_IMAGE, 0);
+    f = file_open("/d/f");
+    memset(data, 0, BLOCK_SIZE);
+    CTEST_ASSERT(f != NULL && file_read(f, data, BLOCK_SIZE) == 100 && data[0] == 0x5A && data[99] == 0x5A,
+                 "Testing every operation survives a crash under IMAGE_DURABLE_EACH_OP");
+    if(f != NULL) {
+        file_close(f);
+    }
+    teardown();
+    remove(CRASH_IMAGE);
+}
+
+void test_durability_each_op_syncs(void) {
+    setup_durability(IMAGE_DURABLE_EACH_OP, 0, 0);
+    struct image *img = image_current();
+    unsigned char data[100];
+    memset(data, 0x6B, sizeof(data));
+    unsigned long sync_calls = img->sync_calls;
+    file_create("/f");
+    CTEST_ASSERT(img->sync_calls - sync_calls == 1, "Testing file_create() is durable with one fdatasync()");
+    struct file *f = file_open("/f");
+    sync_calls = img->sync_calls;
+    file_write(f, data, sizeof(data));
+    CTEST_ASSERT(img->sync_calls - sync_calls == 2,
+                 "Testing a write syncs its data and then commits, with one fdatasync() each");
+    file_close(f);
+
+    // only checkpoints add to that, two fdatasync()s each
+    journal_reset_stats();
+    sync_calls = img->sync_calls;
+    char path[32];
+    for(int i = 0; i < 200; i++) {
+        sprintf(path, "/f%d", i);
+        file_create(path);
+        f = file_open(path);
+        file_write(f, data, sizeof(data));
+        file_close(f);
+    }
+    struct journal_stats stats;
+    journal_get_stats(&stats);
+    CTEST_ASSERT(stats.checkpoints > 0 && img->sync_calls - sync_calls <= 3 * 200 + 2 * stats.checkpoints,
+                 "Testing each operation costs at most its own fdatasync()s under IMAGE_DURABLE_EACH_OP");
+    teardown();
+}
+
+void test_durability_periodic(void) {
+    // by writes: many single-block writes share each fdatasync()
+    setup_durability(IMAGE_DURABLE_PERIODIC, 1000000, 32);
+    struct image *img = image_current();
+    unsigned char data[BLOCK_SIZE];
+    memset(data, 0x77, BLOCK_SIZE);
+    file_create("/f");
+    file_set_write_buffer(0);
+    struct file *f = file_open("/f");
+    unsigned long sync_calls = img->sync_calls;
+    for(int i = 0; i < 100; i++) {
+        file_write(f, data, BLOCK_SIZE);
+    }
+    // each sync point is one fdatasync() for the data and one for the
+    // journal commit of the metadata
+    unsigned long syncs = img->sync_calls - sync_calls;
+    CTEST_ASSERT(syncs > 0 && syncs <= 30, "Testing periodic syncs coalesce many writes");
+    file_close(f);
+    file_set_write_buffer(FILE_WRITE_BUFFER_DEFAULT_BLOCKS);
+    teardown();
+
+    // by time: the flusher syncs once the interval is up, with no further
+    // operation needed; sync_calls is read atomically as it runs alongside
+    setup_durability(IMAGE_DURABLE_PERIODIC, 50, 1000000);
+    img = image_current();
+    image_sync();
+    sync_calls = __atomic_load_n(&img->sync_calls, __ATOMIC_RELAXED);
+    directory_make("/a");
+    directory_make("/b");
+    CTEST_ASSERT(__atomic_load_n(&img->sync_calls, __ATOMIC_RELAXED) == sync_calls,
+                 "Testing no sync before the interval is up");
+    usleep(150000);
+    CTEST_ASSERT(__atomic_load_n(&img->sync_calls, __ATOMIC_RELAXED) > sync_calls &&
+                 __atomic_load_n(&img->unsynced_writes, __ATOMIC_RELAXED) == 0,
+                 "Testing the flusher syncs once the interval is up");
+    teardown();
+}
+
+void test_durability_none_and_explicit(void) {
+    setup_durability(IMAGE_DURABLE_NONE, 0, 0);
+    struct image *img = image_current();
+    unsigned long sync_calls = img->sync_calls;
+    directory_make("/a");
+    journal_commit();
+    image_sync();
+    CTEST_ASSERT(img->sync_calls == sync_calls, "Testing IMAGE_DURABLE_NONE never calls fdatasync()");
+    teardown();
+
+    setup_durability(IMAGE_DURABLE_EXPLICIT, 0, 0);
+    img = image_current();
+    sync_calls = img->sync_calls;
+    directory_make("/a");
+    directory_make("/b");
+    unsigned long before_sync = img->sync_calls - sync_calls;
+    image_sync();
+    CTEST_ASSERT(before_sync == 0 && img->sync_calls > sync_calls, "Testing IMAGE_DURABLE_EXPLICIT syncs on image_sync()");
+    teardown();
+}
+
+#define MKDIR_THREADS 16
+
+struct mkdir_thread_arg {
+    int thread_num;
+    int ndirs;
+    int failures;
+};
+
+// makes the thread's own parent directory, then ndirs directories in it
+static void *mkdir_thread(void *p) {
+    struct mkdir_thread_arg *arg = p;
+    char path[64];
+    sprintf(path, "/t%d", arg->thread_num);
+    if(directory_make(path) == -1) {
+        arg->failures++;
+    }
+    for(int i = 0; i < arg->ndirs; i++) {
+        sprintf(path, "/t%d/d%d", arg->thread_num, i);
+        if(directory_make(path) == -1) {
+            arg->failures++;
+        }
+    }
+    return NULL;
+}
+
+// Runs MKDIR_THREADS threads of mkdir_thread() at once and returns how many
+// of their directory_make() calls failed
+static int run_mkdir_threads(int ndirs) {
+    pthread_t threads[MKDIR_THREADS];
+    struct mkdir_thread_arg args[MKDIR_THREADS];
+    for(int i = 0; i < MKDIR_THREADS; i++) {
+        args[i].thread_num = i;
+        args[i].ndirs = ndirs;
+        args[i].failures = 0;
+        pthread_create(&threads[i], NULL, mkdir_thread, &args[i]);
+    }
+    int failures = 0;
+    for(int i = 0; i < MKDIR_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        failures += args[i].failures;
+    }
+    return failures;
+}
+
+// Returns how many of the directories the threads made are missing, not
+// directories, or share an inode with another one
+static int check_mkdir_threads(int ndirs) {
+    char *seen = calloc(65536, 1);
+    int bad = 0;
+    char path[64];
+    for(int t = 0; t < MKDIR_THREADS; t++) {
+        for(int i = -1; i < ndirs; i++) {
+            if(i == -1) {
+                sprintf(path, "/t%d", t);
+            } else {
+                sprintf(path, "/t%d/d%d", t, i);
+            }
+            struct inode *in = namei(path);
+            if(in == NULL) {
+                bad++;
+                continue;
+            }
+            if(in->flags != INODE_FLAG_DIR || seen[in->inode_num] ||
+                    (i == -1 && in->size != (unsigned int)(ndirs + 2) * DIR_ENTRY_SIZE)) {
+                bad++;
+            }
+            seen[in->inode_num] = 1;
+            iput(in);
+        }
+    }
+    free(seen);
+    return bad;
+}
+
+void test_parallel_directory_make(void) {
+    int ndirs = 40;
+    setup_geometry(4096, 2048);
+    // a small in-core table makes the threads evict each other's inodes
+    inode_table_resize(128);
+    struct freemap_stats before, after;
+    alloc_stats(&before);
+
+    CTEST_ASSERT(run_mkdir_threads(ndirs) == 0, "Testing directory_make() from 16 threads into different parents never fails");
+    CTEST_ASSERT(check_mkdir_threads(ndirs) == 0, "Testing every directory made by 16 threads exists with its own inode");
+    alloc_stats(&after);
+    CTEST_ASSERT(before.free_bits - after.free_bits == MKDIR_THREADS * (ndirs + 1), "Testing concurrent directory_make() allocates one block per directory");
+
+    // the journal, inode write-back and free maps must all have kept up
+    image_close();
+    image_open(TEST_IMAGE, 0);
+    CTEST_ASSERT(check_mkdir_threads(ndirs) == 0, "Testing directories made by 16 threads are all there after reopening");
+    teardown();
+    inode_table_resize(INODE_TABLE_DEFAULT_MAX);
+}
+
+void test_parallel_directory_make_each_op(void) {
+    int ndirs = 8;
+    // operations that end while others are open wait for the shared commit
+    setup_durability(IMAGE_DURABLE_EACH_OP, 0, 0);
+    CTEST_ASSERT(run_mkdir_threads(ndirs) == 0, "Testing directory_make() from 16 threads under IMAGE_DURABLE_EACH_OP");
+    CTEST_ASSERT(check_mkdir_threads(ndirs) == 0, "Testing every directory made under IMAGE_DURABLE_EACH_OP exists");
+    teardown();
+}
+
+int main(void) {
+    CTEST_VERBOSE(1);
+
+    // image.c - image_open(), image_close()
+    test_non_existent_image_open_and_close();
+    test_existing_image_open_and_close();
+    test_image_open_fail();
+    test_image_close_fail();
+
+    // block.c - bread(), bwrite()
+    test_bwrite_and_bread();
+
+    // bcache.c - block cache
+    test_bcache_hits_and_misses();
+    test_bcache_write_back();
+    test_bcache_lru_eviction();
+    test_threaded_block_io();
+    test_bread_ref_pins_cache_buffer();
+    test_mmap_image();
+    test_bwrite_many_and_bread_many();
+
+    // aio.c - asynchronous block I/O
+    test_aio_engines();
+
+    // free.c - set_free(), find_free()
+    test_setting_with_set_free();
+    test_clearing_with_set_free();
+    test_find_free_all_bits_set();
+    test_find_free_one_bit_clear();
+    test_find_next_free();
+    test_count_free();
+    test_bitmap_simd_levels_agree();
+
+    // inode.c, block.c - ialloc(), alloc()
+    test_ialloc_no_free_inode();
+    test_ialloc_free_inode_found();
+    test_ialloc_out_of_slots();
+    test_alloc_no_free_block();
     test_alloc_free_block_found();
+    test_alloc_summary_nearly_full();
+    test_alloc_summary_matches_disk();
+    test_alloc_run();
+    test_alloc_many();
+    test_free_first_after_open();
+    test_ialloc_many();
+    test_directory_make_near_parent();
 
     // mkfs.c - mkfs()
     test_mkfs();
+    test_mkfs_sparse();
+    test_mkfs_preallocate();
 
     // inode.c - find_incore_free(), find_incore(), read_inode(), write_inode(), iget(), iput()
     test_find_incore_free();
     test_find_incore();
+    test_inode_table_growth();
+    test_inode_cache_hot_cycles();
+    test_inode_cache_lru();
+    test_isync_batches_blocks();
+    test_isync_whole_block();
     test_read_inode();
     test_write_inode();
     test_iget();
@@ -406,9 +2399,56 @@ int main(void) {
 
     // inode.c - namei()
     test_namei();
+    test_namei_components();
+    test_dcache();
 
     // dir.c - directory_make()
     test_directory_make();
+    test_directory_index();
+    test_directory_small_stays_linear();
+    test_directory_get_many();
+    test_directory_growth();
+    test_directory_make_inode_limit();
+    test_directory_make_long_name();
+
+    // file.c
+    test_file_create_and_open();
+    test_file_large_sequential();
+    test_file_truncate_and_holes();
+    test_file_write_image_full();
+    test_file_delayed_allocation();
+    test_file_write_coalescing();
+
+    // superblock.c
+    test_superblock();
+    test_large_geometry();
+
+    // journal.c
+    test_journal_group_commit();
+    test_journal_replay();
+    test_journal_checkpoint();
+    test_journal_oversized_operation();
+    test_journal_file_write();
+    test_journal_isync_waits();
+
+    // image.c - durability modes
+    test_durability_each_op();
+    test_durability_each_op_syncs();
+    test_durability_periodic();
+    test_durability_none_and_explicit();
+
+    // inode.c, free.c, dir.c - concurrent directory_make()
+    test_parallel_directory_make();
+    test_parallel_directory_make_each_op();
+
+    // pack.c
+    test_pack_u32();
+    test_inode_block_codec();
+    test_dir_block_codec();
+
+    // readahead.c
+    test_readahead_sequential();
+    test_readahead_random();
 
     CTEST_RESULTS();
 
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include "image.h"
+#include "block.h"
+#include "pack.h"
+#include "superblock.h"
+#include "inode.h"
+#include "mkfs.h"
+#include "journal.h"
+
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+
+// Lays out an image of nblocks blocks with room for ninodes inodes: the
+// superblock, the inode map, the block map, the inode table and the
+// journal, one after the other, followed by the data blocks. The default
+// geometry without a journal comes out the same as the fixed layout images
+// had before they had a superblock.
+// Returns 0, or -1 if the geometry is unusable.
+int superblock_layout(struct superblock *sb, unsigned int nblocks, unsigned int ninodes, unsigned int block_size,
+                      unsigned int journal_blocks) {
+    // the block size is fixed when the library is built
+    if(block_size != BLOCK_SIZE || ninodes == 0 || ninodes > SUPERBLOCK_MAX_INODES ||
+            nblocks > SUPERBLOCK_MAX_BLOCKS || (journal_blocks > 0 && journal_blocks < JOURNAL_MIN_BLOCKS) ||
+            journal_blocks > nblocks) {
+        return -1;
+    }
+    memset(sb, 0, sizeof(struct superblock));
+    sb->magic = SUPERBLOCK_MAGIC;
+    sb->version = SUPERBLOCK_VERSION;
+    sb->block_size = block_size;
+    sb->nblocks = nblocks;
+    sb->ninodes = ninodes;
+    sb->inode_map_start = SUPERBLOCK_NUM + 1;
+    sb->inode_map_blocks = (ninodes + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    sb->block_map_start = sb->inode_map_start + sb->inode_map_blocks;
+    sb->block_map_blocks = (nblocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    sb->inode_table_start = sb->block_map_start + sb->block_map_blocks;
+    sb->inode_table_blocks = (ninodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    sb->journal_start = sb->inode_table_start + sb->inode_table_blocks;
+    sb->journal_blocks = journal_blocks;
+    sb->data_start = sb->journal_start + sb->journal_blocks;
+
+    // leave at least the root directory's block
+    if(sb->data_start >= nblocks) {
+        return -1;
+    }
+    return 0;
+}
+
+void superblock_pack(unsigned char *block, const struct superblock *sb) {
+    memset(block, 0, BLOCK_SIZE);
+    write_u32(block, sb->ninodes);
+    write_u32(block + 4, sb->nblocks);
+    write_u32(block + 8, sb->block_size);
+    write_u32(block + 12, sb->magic);
+    write_u32(block + 16, sb->version);
+    write_u32(block + 20, sb->inode_map_start);
+    write_u32(block + 24, sb->inode_map_blocks);
+    write_u32(block + 28, sb->block_map_start);
+    write_u32(block + 32, sb->block_map_blocks);
+    write_u32(block + 36, sb->inode_table_start);
+    write_u32(block + 40, sb->inode_table_blocks);
+    write_u32(block + 44, sb->data_start);
+    write_u32(block + 48, sb->journal_start);
+    write_u32(block + 52, sb->journal_blocks);
+}
+
+// Returns 0, or -1 if the block does not hold a superblock this library
+// understands
+int superblock_unpack(const unsigned char *block, struct superblock *sb) {
+    sb->ninodes = read_u32(block);
+    sb->nblocks = read_u32(block + 4);
+    sb->block_size = read_u32(block + 8);
+    sb->magic = read_u32(block + 12);
+    sb->version = read_u32(block + 16);
+    sb->inode_map_start = read_u32(block + 20);
+    sb->inode_map_blocks = read_u32(block + 24);
+    sb->block_map_start = read_u32(block + 28);
+    sb->block_map_blocks = read_u32(block + 32);
+    sb->inode_table_start = read_u32(block + 36);
+    sb->inode_table_blocks = read_u32(block + 40);
+    sb->data_start = read_u32(block + 44);
+    sb->journal_start = read_u32(block + 48);
+    sb->journal_blocks = read_u32(block + 52);
+    if(sb->magic != SUPERBLOCK_MAGIC || sb->version < 1 || sb->version > SUPERBLOCK_VERSION ||
+            sb->block_size != BLOCK_SIZE) {
+        return -1;
+    }
+    // version 1 images have no journal
+    if(sb->version == 1) {
+        sb->journal_start = sb->data_start;
+        sb->journal_blocks = 0;
+    }
+    return 0;
+}
+
+// Reads the image's superblock into img->sb, or gives it the default
+// geometry if it has none
+void superblock_load(struct image *img) {
+    unsigned char block[BLOCK_SIZE];
+    block_read_raw(img, SUPERBLOCK_NUM, block);
+    if(superblock_unpack(block, &img->sb) == -1) {
+        superblock_layout(&img->sb, NUM_BLOCKS, NUM_INODES, BLOCK_SIZE, 0);
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef SUPERBLOCK_H
+#define SUPERBLOCK_H
+
+#define SUPERBLOCK_NUM 0
+#define SUPERBLOCK_MAGIC 0x53494d46     // "SIMF"
+#define SUPERBLOCK_VERSION 2             // 2 added the journal
+#define SUPERBLOCK_MAX_INODES 65536     // directory entries hold 16-bit inode numbers
+#define SUPERBLOCK_MAX_BLOCKS 0x7fffffff
+
+struct image;
+
+// Where everything lives in an image. Block 0 holds it on disk; an image
+// without one is taken to have the layout mkfs() has always produced.
+struct superblock {
+    unsigned int ninodes;
+    unsigned int nblocks;
+    unsigned int block_size;
+    unsigned int magic;
+    unsigned int version;
+    unsigned int inode_map_start;
+    unsigned int inode_map_blocks;
+    unsigned int block_map_start;
+    unsigned int block_map_blocks;
+    unsigned int inode_table_start;
+    unsigned int inode_table_blocks;
+    unsigned int data_start;        // first block not holding metadata
+    unsigned int journal_start;
+    unsigned int journal_blocks;    // 0 for an image without a journal
+};
+
+int superblock_layout(struct superblock *sb, unsigned int nblocks, unsigned int ninodes, unsigned int block_size,
+                      unsigned int journal_blocks);
+void superblock_pack(unsigned char *block, const struct superblock *sb);
+int superblock_unpack(const unsigned char *block, struct superblock *sb);
+void superblock_load(struct image *img);
+
+#endif